@@ -218,6 +218,15 @@ reset the LEDSegs object to this state at any time with a ResetStrip() call:
 
   strip->ResetStrip()
 
+The cMax... #defines size every LEDSegs object in the program. If you drive more than one strip and
+they need different capacities, use the LEDSegsT template instead, which takes the sizes as template
+arguments (LEDSegs itself is just LEDSegsT<0, cMaxSegments, cMaxParts, cMaxTimers>):
+
+  LEDSegsT<NumLEDs, MaxSegments, MaxParts, MaxTimers> strip(#LEDs);
+
+A non-zero NumLEDs also keeps the pixel buffer inside the object (no malloc) and caps the strip length
+at NumLEDs; with NumLEDs > 0 the #LEDs argument can be omitted. All sizes share the same code.
+
 =========
 Segments:
 =========
@@ -254,22 +263,33 @@ There are five required arguments to DefineSegment and one optional one:
             1) You reset the LEDSegs object, or
             2) You call the ResetRandom() method to change the randomization scheme. You can do this
                  any time, including setting a timer to do it periodically
-            3) You call SetSegment_RandomPattern([iSegment,] 0..63) to select a different randomization
-                 pattern from the current randomization scheme. See below.
+            3) You call SetSegment_RandomPattern([iSegment,] 0..cSegNRandom-1) to select a different randomization
+                 pattern from the current randomization scheme, or SetSegment_RandomLength() to give the
+                 segment a longer one. See below.
 
      ***Non-Audio Level-Based Actions (no shield needed):
      ______________
      cSegActionAll: Illuminates all LEDs in the segment. Spectrum levels are ignored.
      _______________
-     cSegActionBits:   Illuminates the segment's LEDs from a uint32_t[] sequence of bits.
+     cSegActionBits:   Illuminates the segment's LEDs from a sequence of bits.
           Spectrum levels are ignored for this action. "1" bits show as foreground
           color and "0" bits show as the background color. You must call the strip->SetBitsPtr()
-          method to define a pointer to the bits longword(s) that you want displayed. The bits
-          starting at this location are read out on each refresh cycle. This action is useful for
-          rotating/chasing and sequencing displays and also diagnostic output to the strip.
-          The low-order bit displays in the first LED of the segment. You can define as
-          many bits as you like - it isn't limited to a single longword. Unused bits in the final
-          longword are ignored.
+          method to define a pointer to the bits that you want displayed: a uint8_t[], uint32_t[]
+          or uint64_t[] array. The bits starting at this location are read out on each refresh
+          cycle. This action is useful for rotating/chasing and sequencing displays and also
+          diagnostic output to the strip. The low-order bit displays in the first LED of the
+          segment. You can define as many bits as you like - it isn't limited to a single word.
+          Unused bits in the final word are ignored.
+
+          Bit n is bit (n & 7) of byte n >> 3, the numbering the LEDBits routines use, so the
+          same buffer can be shifted with LEDBits and displayed here. On little-endian processors
+          (AVR, ARM, x86) a uint32_t or uint64_t array numbers its bits the same way. (To clear
+          the pointer, cast NULL to one of the types.)
+
+          To scroll the bits without moving them, call SetSegment_BitsOffset([iSegment,] n): the
+          segment then shows its bits starting from bit n, wrapping around at the number of LEDs
+          the segment shows in its part. That's what BitRotate(width, bits, -n) would display, but
+          bumping n from a timer costs nothing per step however many bits there are.
      _______________
      cSegActionNone:   The segment is not displayed. You normally only use this with custom
          display routines (see below).
@@ -331,6 +351,24 @@ The cSegOptNoOffOverwrite option can be given to a SetSegment_Options() call to
 in that segment from overwriting earlier segments' LEDs, when an LED value in the segment is that
 segments background color. Segment options are documented in more detail below.
 
+_________________
+Segment Blending:
+
+Instead of replacing the LEDs under it, a segment can blend its colors into them with SetSegment_Blend(mode).
+R, G and B (0..127) are blended separately:
+
+  cSegBlendNone       Replace the LED (the default)
+  cSegBlendAdd        Add, saturating at 127
+  cSegBlendMax        The brighter of the two
+  cSegBlendMultiply   Multiply, 127 being 1 (a white segment changes nothing, a black one turns LEDs off)
+  cSegBlendAlpha      Mix, by the segment's SetSegment_Opacity(0..255): 0 is invisible, 255 replaces the LED
+
+Layers of audio-reactive segments can be stacked this way, e.g. a cSegBlendAdd FromMiddle segment over a
+dim cSegActionAll background. Background color LEDs are blended too, unless the segment has
+cSegOptNoOffOverwrite. The blending is done in the pixel buffer; on the host it uses SSE2 when available.
+The mode and opacity take 2 bytes per segment, so on AVR boards blending is only compiled in if you
+#define cSegBlendModes 1 before including the library (otherwise every segment replaces its LEDs).
+
 ______________
 Segment Index:
 
@@ -341,8 +379,10 @@ DefineSegment() sets the "current segment index" to the segment # being defined.
 is the index assumed when you call GetSegment_xxx()/SetSegment_xxx() methods without passing
 an explicit index.) The first call to DefineSegment() sets the current segment index to 0.
 
-A call to DefineSegment() locates an available segment by searching for a 0-LED length (undefined) segment
-slot, starting at the current index and looping around.
+A call to DefineSegment() locates an available (undefined) segment slot, starting at the current index
+and looping around. Free slots are tracked in a bitmap and the defined segments in an ordered list, so
+defining, resetting and displaying segments costs in proportion to the number of defined segments
+rather than to cMaxSegments or the highest index ever used.
 
   strip->GetSegmentIndex();  //returns the current (short integer) current segment index
   strip->SetSegmentIndex(n); //sets the current segment index to segment index "n".
@@ -352,13 +392,17 @@ before the DefineSegment() call. DefineSegment() begins its search starting at t
 As long as that segment is available, it will be the index defined, and that index will be the value
 returned.
 
-You can define up to cMaxSegments segments (100 by default). If you want a higher or lower max,
-use a #define to set cMaxSegments before including this library.
+You can define up to cMaxSegments segments (100 by default). If you want a higher or lower max, use a
+#define to set cMaxSegments before including this library. On AVR boards each segment takes 45 bytes of SRAM,
+because the per-segment caches of render plans (cSegPlanCache), fixed-point reciprocals (cFixedPointCache),
+blend modes (cSegBlendModes) and occlusion culling (cMaxCullSpans) are compiled out there; see LEDSegs.h for
+what each one adds if you #define it in.
 
 You can "undefine" (free up) a segment by calling ResetSegment(iSegment). You can free up all segments
 by calling ResetSegment(). ResetStrip() also un-defines all segments (and parts, etc.)
 You can disable a segment's display without undefining it by setting it's action to cSegActionNone.
-(A segment is undefined/available if it has a length=0 and an action of cSegActionNone)
+(A segment is defined from DefineSegment(), or the first SetSegment_NumLEDs()/SetSegment_Action() on its
+index, until it is reset.)
 
 ___________________________
 Get/Set Segment Properties:
@@ -382,6 +426,7 @@ for the item - usually a short int.
     Get/SetSegment_BackColor
     Get/SetSegment_Bands
         SetSegment_BitsPtr        //(no Get method for this)
+    Get/SetSegment_BitsOffset
         SetSegment_DisplayRoutine //(no Get method for this)
     Get/SetSegment_FirstLED
     Get/SetSegment_ForeColor
@@ -421,9 +466,23 @@ cSegAction_Random causes the segment's LEDs to be lit randomly, the total number
 to the segment's current level. The randomization scheme stays fixed until a ResetStrip() or explicit
 ResetRandom() call.
 
-Within the current randomization scheme, you can select one of 32 randomization patterns [0...31] if you
-want segments to have different randomizations without having to do a ResetRandom(). The default is
-randomization pattern #0. There is no significance to the pattern number except that each is different.
+Within the current randomization scheme, you can select one of cSegNRandom (default 64) randomization
+patterns [0...cSegNRandom-1] if you want segments to have different randomizations without having to do a
+ResetRandom(). The default is randomization pattern #0. There is no significance to the pattern number
+except that each is different.
+
+The pattern repeats every cSegNRandom LEDs. If that shows on a long segment, give it a longer pattern:
+
+  strip->SetSegment_RandomLength([iSegment,] Length);
+
+Length is rounded up to a power of 2 (at most cSegMaxRandomLength, 4096); the pattern number then selects
+one of Length patterns. Segments with the same length share a table of random levels, allocated at 4 bytes
+per slot and filled and sorted by level right then (and again by each ResetRandom()), never during a frame.
+Up to cMaxRandomTables (4) lengths can be in use at once; past that, or if the table can't be allocated, the
+segment keeps the cSegNRandom slots. A long run only visits the slots whose LEDs change from the background
+color (or from the foreground, whichever is fewer), when the run has more than twice as many LEDs as those
+slots, so a pattern about as long as the segment keeps that cost to a pass over the segment's LEDs, and
+segments left at cSegNRandom slots draw as before. DefineSegment() resets the length to cSegNRandom.
 
 You can define a timer or segment action routine, calling ResetRandom() or SetSegment_RandomPattern(),
 if you want to shake things up.
@@ -486,6 +545,32 @@ to a full level where no LEDs will be on (not really recommended for most applic
   short int rescale[] = {2, 0, 1023, 1023, 0};
   strip->SetSegment_Recale(rescale);
 
+SetSegment_Rescale() compiles the array into a lookup table, so rescaling costs one table read per frame. Segments
+given arrays with the same contents share one table. The array is read only when it is set, not every frame:
+editing its contents afterwards changes nothing until you call SetSegment_Rescale() again with it.
+
+Tables are exact and take 2K each. On boards short of RAM you can #define cRescaleTableShift 2 before including
+the library for 514-byte tables that interpolate between every 4th level; rescaled levels are then within a level
+or so of exact, or up to a few levels off where a pair makes a steep jump between multiples of 4. Up to
+cMaxRescaleTables (8) distinct arrays get tables (#define it to change that). Beyond that, or if a table can't be
+allocated, segments fall back to computing the rescale every frame, which gives the exact levels too.
+
+Normalizing the levels takes a few divisions per segment per frame, which are slow on boards without a divide
+instruction. SetFixedPointLevels(true) replaces them with multiplies by reciprocals cached in each segment (recomputed
+only when the segment's max level, LED count or persistence changes). The results are the same as the dividing code.
+The reciprocals take 14 bytes per segment, so on AVR boards they are only compiled in if you #define cFixedPointCache 1
+before including the library; it's then on by default there (#define cFixedPointLevels false to change that).
+Without cFixedPointCache, SetFixedPointLevels() does nothing.
+
+Segments are drawn in index order, so a segment that overwrites (no cSegOptNoOffOverwrite or blend mode)
+hides whatever earlier segments put under its LEDs. The strip works out which LEDs of each segment a later
+unspaced overwriting segment covers (again only after segments change, not every frame) and skips them, and doesn't
+clear the LEDs they'll overwrite either. So segments under a full-strip one cost nothing, and a full-strip
+cSegActionAll background under small segments costs about the LEDs left showing. The output is unchanged.
+SetOcclusionCulling(false) turns it off. Up to cMaxCullSpans (64) hidden ranges are remembered; segments past
+that are drawn whole. Segments in circular parts are never culled. On AVR boards cMaxCullSpans is 0, which compiles
+culling out to save SRAM (SetOcclusionCulling() does nothing); #define it before including the library to use it.
+
 ======
 Colors
 ======
@@ -600,6 +685,37 @@ You can use timer actions or custom segment display routines to dynamically alte
 example you can change the start value to move the part's display area around the strip on each timer
 expiration.
 
+_______________
+Circular Parts:
+
+A part can be made circular, for rings or for chases that should come back around:
+
+  strip->SetPart_Circular(Index, true);
+  strip->SetPart_Offset(Index, Offset);
+
+Segment LEDs that would fall past either end of a circular part wrap around to the other end instead of
+being cropped (a segment longer than the part shows one lap of it). The offset rotates everything in the
+part by Offset LEDs along the part's direction, wrapping at the part's end. Unlike changing the start or
+length, changing the offset doesn't make the part's segments recompile their layout, so stepping it from
+a timer is just a counter bump. The part itself can still hang off the ends of the strip; those LEDs aren't
+shown. DefinePart() resets a part to not circular with offset 0.
+
+________________
+Trails (Decay):
+
+Normally every frame starts with all LEDs off. Give a part a decay and its LEDs start each frame as they
+were in the last one, faded, so whatever moves or drops leaves a trail that dies away:
+
+  strip->SetPart_Decay(Index, Decay);
+
+Each frame an LED keeps (256 - Decay) / 256 of its brightness: 16 gives long comet tails, 128 a short
+afterglow, and 0 holds the LEDs as they were. cPartNoDecay (the default, and what DefinePart() resets to)
+goes back to starting from off. Part 0 is the whole strip, so SetPart_Decay(0, Decay) fades everything;
+where parts overlap, the highest-numbered one with a decay decides. Segment LEDs are drawn over the faded
+frame as usual, so a segment with cSegOptNoOffOverwrite (or cSegBlendMax) leaves the trail showing through
+its off LEDs, while an overwriting one replaces it. The fade is one pass over the pixel buffer, about what
+clearing it costs.
+
 ____________
 Persistence:
 
@@ -759,20 +875,151 @@ is about right for most applications.
 
 After this, you can call CheckForDeadAir(secs) as needed, which returns true if there has been no
 input above the given "level" for "secs" seconds.
+
+==============
+Strip Output:
+==============
+
+By default LPD8806::show() sends the frame a byte at a time through SPI.transfer() (or bit-banged pins).
+On long strips that is most of the frame time. If your board can send a whole buffer at once (DMA, a
+Linux spidev device, ...) you can hand the frame over in one call instead:
+
+  void MyTransfer(const uint8_t *buf, uint16_t len, void *ptr) {...send len bytes...}
+  ...
+  strip->SetStripTransfer(MyTransfer, NULL);
+
+buf is the strip's pixel buffer plus the latch bytes, already in wire format. Don't return until you are
+done reading it, because the next frame is written into the same buffer. SetStripTransfer(NULL, NULL)
+goes back to the per-byte path. The host build has a file descriptor version of this for spidev devices,
+files and pipes (host/device/LPD8806FdTransfer.h).
+
+If the send can run in the background (DMA with a completion flag, a sender thread), use double
+buffering so the next frame is sampled and drawn while this one goes out:
+
+  strip->SetStripAsyncTransfer(MyStartSend, MyWaitSend, NULL);
+
+MyStartSend starts sending buf and returns right away; MyWaitSend returns once that send is done. Each
+show() waits for the previous frame, swaps buffers and starts the new one, so DisplayStrip() no longer
+blocks for the transmit time. This takes a second pixel buffer (3 bytes per LED). On the host,
+host/device/LPD8806ThreadSender.h runs any transfer routine on a sender thread.
+
+Mostly static scenes (All backgrounds, Bits patterns that only move on a timer, silence) send the same
+frame over and over. To skip those:
+
+  strip->SetStripSkipUnchanged(100);
+
+show() then compares each frame with the last one sent (by a hash of the pixel bytes, or for free if
+nothing was written) and doesn't send it again, except that after 100 skips in a row it is resent anyway
+in case the strip picked up a glitch. 0 turns this off (the default). Skipped frames are counted in the
+instrumentation (GetStats_Skipped()).
+
+=================
+Spectrum Sources:
+=================
+
+Each DisplayStrip() starts by reading the seven band levels, normally from the spectrum analyzer shield
+(ReadShieldSpectrum()). To take them from somewhere else (another analyzer chip, a sampled-audio FFT,
+canned levels for testing) give a routine that fills them in:
+
+  void MySource(short *levels, bool doLeft, bool doRight, void *ptr) {...levels[0..6] = 0..cMaxBandLevel...}
+  ...
+  strip->SetSpectrumSource(MySource, NULL);
+
+doLeft and doRight are the DisplayStrip() arguments. Levels outside 0..cMaxBandLevel are clamped, and
+no noise floor is taken off (the shield reader does its own). SetSpectrumSource(NULL, NULL) goes back
+to the shield. On the host, host/spectrum/LEDSpectrumSynth.h generates repeatable sweeps, beats and
+silence, and host/spectrum/LEDSpectrumPCM.h reads a WAV file through a model of the shield's filters.
+
+A source can also give more than seven bands (up to cMaxBands, 64, or 16 on AVR):
+
+  strip->SetSpectrumSource(MySource, NULL, 32);   //MySource fills levels[0..31]
+
+Segment band masks are then LEDBandMask bits 0..31 rather than cSegBand1..7; LEDSegs::BandRange(4, 9)
+makes the mask for bands 4 through 9. Masks with bits beyond the source's bands ignore those bits.
+
+LEDSpectrumFFT turns raw samples into any number of bands. Feed it samples as they arrive and make
+LEDSpectrumFFT::ReadBands the source:
+
+  LEDSpectrumFFT fft;
+  fft.Begin(44100, 1024, 24);                       //sample rate, FFT size (power of two), bands
+  strip->SetSpectrumSource(LEDSpectrumFFT::ReadBands, &fft, 24);
+  ...
+  fft.AddSamples(samples, nFrames, 2);              //interleaved int16_t, 1 or 2 channels
+
+Each read windows the latest FFT-size frames, runs a fixed-point FFT and sums the power into
+log-spaced bands between 40Hz and 16KHz (Begin(rate, size, bands, loHz, hiHz) to change them;
+GetBandHz(band) gives the edges). Stereo input gives left and right from the one transform. It keeps
+about 17 bytes of SRAM per point of cMaxFFTSize (2048, or 128 on AVR). A 1024 point read takes about
+20us on a desktop with SSE2.
+
+================
+Instrumentation:
+================
+
+If the strip lags the music you can find out where the time goes. Put this before including the library:
+
+  #define LEDSEGS_STATS
+
+Each DisplayStrip() call then records the time (in microseconds) spent in each stage: cStatReadSpectrum,
+cStatMapBands, cStatDisplayRoutines, cStatWriteSegments, cStatShow and the whole frame (cStatFrame).
+GetStats(stage) returns the count and min/avg/max/p99 for a stage. Frames that take longer than the
+TimedDisplay() period are counted by GetStats_Overruns(), and frames not sent because they were unchanged
+(see SetStripSkipUnchanged()) by GetStats_Skipped(). GetStats_Culled() counts the segment LEDs that
+occlusion culling left unwritten. Display routine time is also kept per segment
+(GetSegmentStats_Calls/AvgUS/MaxUS). ResetStats() clears everything, and DumpStats(Serial) prints it all.
+
+On AVR the stats use 1284 + 12 * cMaxSegments bytes of SRAM: 212 bytes per stage, 12 for the
+overrun/skipped/culled counts and 12 per segment. That's about 2.5K with the default 100 segments, and roughly
+twice as much on 64-bit hosts. Without LEDSEGS_STATS none of this is compiled in.
 */
 
 /* Start of LEDSEGS:: */
 
 #include "LEDSegs.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//Timing hooks for the optional instrumentation (LEDSEGS_STATS). These compile to nothing otherwise.
+#if defined LEDSEGS_STATS
+#define _LEDSEGS_STAT_START(t) unsigned long t = micros()
+#define _LEDSEGS_STAT_END(stage, t) StatsRecord(stage, micros() - (t))
+#define _LEDSEGS_STAT_SEGMENT_END(iseg, t) {unsigned long us = micros() - (t); \
+  segStats[iseg].calls++; segStats[iseg].totalUS += us; segStats[iseg].maxUS = max(segStats[iseg].maxUS, us);}
+#else
+#define _LEDSEGS_STAT_START(t)
+#define _LEDSEGS_STAT_END(stage, t)
+#define _LEDSEGS_STAT_SEGMENT_END(iseg, t)
+#endif
 
 /*
 ______________
 LEDBits Class:
 
-Some general routines for bit manipulation (this class is inherited in LEDSegs). This is very
-much a work in progress and the specifics shouldn't be assumed for future releases
+Some general routines for bit manipulation (this class is inherited in LEDSegs). A bit field is an
+array of bytes; bit n is bit (n & 7) of byte n >> 3, the numbering cSegActionBits uses. Routines that
+take a bitwidth work on bits 0..bitwidth-1; the others take a range of nbits bits from firstbit. Bits
+of the array outside the field or range are never changed.
+
+Costs, for a field or range of N bits:
+
+  BitRead, BitWrite               O(1) (BitWrite: up to 5 bytes)
+  BitRotate                       O(N/8) byte operations for any shift count (three reversals)
+  BitShiftIn                      O(N/8) byte operations, one pass
+  BitFill                         O(N/8) byte operations plus one word write per repetition group
+  BitSetRange, BitClearRange      O(N/8): the two edge bytes are masked, the middle is memset
+  BitCount                        O(N/8) byte popcounts
+  BitReverse                      O(N/8): one byte reversal pass and one sub-byte shift pass
 */
 
+//Each 4-bit value with its bits reversed
+static const uint8_t BitRev4[16] = {0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF};
+
+static inline uint8_t BitRev8(uint8_t b) {return (BitRev4[b & 0x0F] << 4) | BitRev4[b >> 4];}
+
+//The mask of bits lo..hi-1 of a byte (0 <= lo <= hi <= 8)
+static inline uint8_t BitByteMask(short lo, short hi) {return (uint8_t) ((0xFF << lo) & (0xFF >> (8 - hi)));}
+
 /*
 _________________
 LEDSegs::BitRead:
@@ -780,38 +1027,207 @@ Get the value of a bit in a bit field
 */
 bool LEDBits::BitRead(short bitnum, uint8_t byteary[]) {return (byteary[bitnum >> 3] >> (bitnum & 0x07)) & 1;}
 
+/*
+__________________
+LEDSegs::BitWrite:
+Store the low nbits (0..32) bits of value at bits firstbit..firstbit+nbits-1, value's bit 0 at firstbit.
+*/
+void LEDBits::BitWrite(short firstbit, short nbits, uint8_t bitary[], uint32_t value) {
+  short ibyte, off, take;
+  uint8_t mask;
+
+  while (nbits > 0) {
+    ibyte = firstbit >> 3;
+    off = firstbit & 0x07;
+    take = min((short) (8 - off), nbits);
+    mask = BitByteMask(off, off + take);
+    bitary[ibyte] = (bitary[ibyte] & ~mask) | ((uint8_t) (value << off) & mask);
+    value >>= take;
+    firstbit += take;
+    nbits -= take;
+  }
+}
+
 /*_________________
 LEDSegs::BitRotate:
-Left/right rotation by one bit of any arbitrary field of bits. bitwidth is the number
-of bits, and bitary is the array of 8-bit bytes containing the bits to be rotated. The
-"first" bit is bit #0 in bitary[0]. nbits gives the number of bits to rotate, positive
-is a left rotate and negative is to the right.
+Left/right rotation of any arbitrary field of bits. bitwidth is the number of bits, and bitary is
+the array of 8-bit bytes containing the bits to be rotated. The "first" bit is bit #0 in bitary[0].
+nbits gives the number of bits to rotate, positive is a left rotate (bit 0 moves toward bit 1) and
+negative is to the right. A left rotate by k is a reversal of the whole field followed by reversals of
+its first k and last bitwidth-k bits, so the cost doesn't depend on nbits.
 */
 
 void LEDBits::BitRotate(short bitwidth, uint8_t bitary[], short int nbits) {
-  short ibyte, lastbyte, bitstomove, irotate;
-  byte nextcarry, lastcarry;
-
-  lastbyte = ((bitwidth + 7) >> 3) - 1;
-  bitstomove = abs(nbits);
-  for (irotate = 0; irotate < bitstomove; irotate++) {
-    if (nbits > 0) {  //left rotate
-      lastcarry = (bitary[lastbyte] >> ((bitwidth - 1) & 0x07)) & 1;
-      for (ibyte = 0; ibyte <= lastbyte; ibyte++) {
-        nextcarry = bitary[ibyte] & 0x80;
-        bitary[ibyte] = (bitary[ibyte] << 1) | (lastcarry ? 1 : 0);
-        lastcarry = nextcarry;
+  short k;
+
+  if (bitwidth < 2) return;
+  k = nbits % bitwidth;
+  if (k < 0) k += bitwidth;
+  if (k == 0) return;
+  BitReverse(0, bitwidth, bitary);
+  BitReverse(0, k, bitary);
+  BitReverse(k, bitwidth - k, bitary);
+}
+
+/*
+____________________
+LEDSegs::BitShiftIn:
+Shift the field left (nbits > 0) or right (nbits < 0) by |nbits| (at most 32) bits. The bits shifted
+out of the field are lost. Those shifted in come from the low |nbits| bits of inbits: after a left shift
+bit j of inbits is at bit j of the field, after a right shift it is at bit bitwidth-|nbits|+j.
+*/
+void LEDBits::BitShiftIn(short bitwidth, uint8_t bitary[], short nbits, uint32_t inbits) {
+  short n, q, r, i, src, lastbyte, topbits;
+  uint8_t last, lo, hi;
+
+  if ((bitwidth <= 0) || (nbits == 0)) return;
+  n = min((short) abs(nbits), (short) 32);
+  lastbyte = (bitwidth - 1) >> 3;
+  topbits = ((bitwidth - 1) & 0x07) + 1;  //Bits of the last byte in the field
+  last = bitary[lastbyte];
+
+  if (n < bitwidth) {
+    q = n >> 3;
+    r = n & 0x07;
+    if (nbits > 0) {
+      //Byte i takes its bits from bytes i-q and i-q-1, going down so the sources aren't overwritten yet
+      for (i = lastbyte; i >= 0; i--) {
+        src = i - q;
+        hi = (src >= 0) ? bitary[src] : 0;
+        lo = (src >= 1) ? bitary[src - 1] : 0;
+        bitary[i] = r ? (uint8_t) ((hi << r) | (lo >> (8 - r))) : hi;
       }
     }
     else {
-      lastcarry = bitary[0] & 1;
-      for (ibyte = lastbyte; ibyte >= 0; ibyte--) {
-        nextcarry = bitary[ibyte] & 1;
-        bitary[ibyte] = (bitary[ibyte] >> 1) | (lastcarry ? 0x80 : 0);
-        lastcarry = nextcarry;
-      }  
+      //Clear the bits past the field first so they don't shift into it
+      bitary[lastbyte] &= BitByteMask(0, topbits);
+      for (i = 0; i <= lastbyte; i++) {
+        src = i + q;
+        lo = (src <= lastbyte) ? bitary[src] : 0;
+        hi = (src + 1 <= lastbyte) ? bitary[src + 1] : 0;
+        bitary[i] = r ? (uint8_t) ((lo >> r) | (hi << (8 - r))) : lo;
+      }
     }
   }
+
+  //Restore the bits past the field, then put the new bits in
+  bitary[lastbyte] = (bitary[lastbyte] & BitByteMask(0, topbits)) | (last & ~BitByteMask(0, topbits));
+  if (nbits > 0) BitWrite(0, min(n, bitwidth), bitary, inbits);
+  else if (n <= bitwidth) BitWrite(bitwidth - n, n, bitary, inbits);
+  else BitWrite(0, bitwidth, bitary, inbits >> (n - bitwidth));
+}
+
+/*
+_________________
+LEDSegs::BitFill:
+Fill nbits bits from firstbit with a repeating pattern: the low patternwidth (1..32) bits of pattern,
+its bit 0 first. The pattern is repeated within a word as many whole times as fit and then written a
+word at a time.
+*/
+void LEDBits::BitFill(short firstbit, short nbits, uint8_t bitary[], uint32_t pattern, short patternwidth) {
+  uint32_t word;
+  short wordbits, n;
+
+  if ((patternwidth < 1) || (patternwidth > 32)) return;
+  if (patternwidth < 32) pattern &= (1UL << patternwidth) - 1;
+  word = pattern;
+  for (wordbits = patternwidth; wordbits + patternwidth <= 32; wordbits += patternwidth) word |= pattern << wordbits;
+
+  for (; nbits > 0; firstbit += n, nbits -= n) {
+    n = min(nbits, wordbits);
+    BitWrite(firstbit, n, bitary, word);
+  }
+}
+
+/*
+_______________________________________
+LEDSegs::BitSetRange / BitClearRange:
+Set or clear nbits bits from firstbit.
+*/
+static void BitStoreRange(short firstbit, short nbits, uint8_t bitary[], uint8_t fill) {
+  short firstbyte, lastbyte;
+  uint8_t mask;
+
+  if (nbits <= 0) return;
+  firstbyte = firstbit >> 3;
+  lastbyte = (firstbit + nbits - 1) >> 3;
+  if (firstbyte == lastbyte) {
+    mask = BitByteMask(firstbit & 0x07, ((firstbit + nbits - 1) & 0x07) + 1);
+    bitary[firstbyte] = (bitary[firstbyte] & ~mask) | (fill & mask);
+    return;
+  }
+  mask = BitByteMask(firstbit & 0x07, 8);
+  bitary[firstbyte] = (bitary[firstbyte] & ~mask) | (fill & mask);
+  memset(&bitary[firstbyte + 1], fill, lastbyte - firstbyte - 1);
+  mask = BitByteMask(0, ((firstbit + nbits - 1) & 0x07) + 1);
+  bitary[lastbyte] = (bitary[lastbyte] & ~mask) | (fill & mask);
+}
+
+void LEDBits::BitSetRange(short firstbit, short nbits, uint8_t bitary[]) {BitStoreRange(firstbit, nbits, bitary, 0xFF);}
+void LEDBits::BitClearRange(short firstbit, short nbits, uint8_t bitary[]) {BitStoreRange(firstbit, nbits, bitary, 0x00);}
+
+/*
+__________________
+LEDSegs::BitCount:
+The number of set bits among nbits bits from firstbit
+*/
+short LEDBits::BitCount(short firstbit, short nbits, uint8_t bitary[]) {
+  short ibyte, firstbyte, lastbyte, count;
+
+  if (nbits <= 0) return 0;
+  firstbyte = firstbit >> 3;
+  lastbyte = (firstbit + nbits - 1) >> 3;
+  if (firstbyte == lastbyte) {
+    return __builtin_popcount(bitary[firstbyte] & BitByteMask(firstbit & 0x07, ((firstbit + nbits - 1) & 0x07) + 1));
+  }
+  count = __builtin_popcount(bitary[firstbyte] & BitByteMask(firstbit & 0x07, 8));
+  for (ibyte = firstbyte + 1; ibyte < lastbyte; ibyte++) count += __builtin_popcount(bitary[ibyte]);
+  count += __builtin_popcount(bitary[lastbyte] & BitByteMask(0, ((firstbit + nbits - 1) & 0x07) + 1));
+  return count;
+}
+
+/*
+____________________
+LEDSegs::BitReverse:
+Reverse the order of nbits bits from firstbit. The bytes covering the range are reversed as a whole
+(byte order and the bits within each byte), which puts the range's bits in order but up to 7 bits off
+from where they belong, so the bytes are then shifted back into place and the bits outside the range
+restored.
+*/
+void LEDBits::BitReverse(short firstbit, short nbits, uint8_t bitary[]) {
+  short firstbyte, lastbyte, i, j, delta;
+  uint8_t first, last, t, keepfirst, keeplast;
+
+  if (nbits < 2) return;
+  firstbyte = firstbit >> 3;
+  lastbyte = (firstbit + nbits - 1) >> 3;
+  first = bitary[firstbyte];
+  last = bitary[lastbyte];
+
+  for (i = firstbyte, j = lastbyte; i < j; i++, j--) {
+    t = BitRev8(bitary[i]);
+    bitary[i] = BitRev8(bitary[j]);
+    bitary[j] = t;
+  }
+  if (i == j) bitary[i] = BitRev8(bitary[i]);
+
+  //Bit p of the covered bytes went to 8 * (firstbyte + lastbyte + 1) - 1 - p, so the range now starts
+  //delta bits below firstbit. Shift it back up (or down when delta is negative).
+  delta = (2 * firstbit + nbits) - 8 * (firstbyte + lastbyte + 1);
+  if (delta > 0) {
+    for (i = lastbyte; i > firstbyte; i--) bitary[i] = (bitary[i] << delta) | (bitary[i - 1] >> (8 - delta));
+    bitary[firstbyte] <<= delta;
+  }
+  else if (delta < 0) {
+    delta = -delta;
+    for (i = firstbyte; i < lastbyte; i++) bitary[i] = (bitary[i] >> delta) | (bitary[i + 1] << (8 - delta));
+    bitary[lastbyte] >>= delta;
+  }
+
+  keepfirst = BitByteMask(0, firstbit & 0x07);
+  keeplast = ~BitByteMask(0, ((firstbit + nbits - 1) & 0x07) + 1);
+  bitary[firstbyte] = (bitary[firstbyte] & ~keepfirst) | (first & keepfirst);
+  bitary[lastbyte] = (bitary[lastbyte] & ~keeplast) | (last & keeplast);
 }
 
 /*
@@ -821,10 +1237,17 @@ LEDTimers Class Member Functions:
 The LEDTimers class is inherited in LEDSegs.
 */
 
-//LEDTimers:: Constructor
+//LEDTimers:: Constructor. There are no timers until AttachTimers() supplies the array.
 LEDTimers::LEDTimers() {
+  Timers = NULL;
+  nMaxTimers = 0;
+}
+
+void LEDTimers::AttachTimers(LEDTimer *timers, short maxTimers) {
   short int i;
-  for (i = 0; i < cMaxTimers; i++) {
+  Timers = timers;
+  nMaxTimers = maxTimers;
+  for (i = 0; i < nMaxTimers; i++) {
     Timers[i].timerExpiration = 0;
     Timers[i].timerRepeat = 0;
     Timers[i].timerPtr = NULL;
@@ -832,7 +1255,7 @@ LEDTimers::LEDTimers() {
 }
 
 unsigned short LEDTimers::DefineTimer(unsigned long expirationMS, unsigned long repeatMS, TimerRoutine timerSub) {
-  DefineTimer(expirationMS, repeatMS, timerSub, NULL);
+  return DefineTimer(expirationMS, repeatMS, timerSub, NULL);
 }
 
 //Define a timer. (Note that we simply don't use index 0 and start at 1 -- making timer IDs positive and
@@ -840,7 +1263,7 @@ unsigned short LEDTimers::DefineTimer(unsigned long expirationMS, unsigned long
 
 unsigned short LEDTimers::DefineTimer(unsigned long expirationMS, unsigned long repeatMS, TimerRoutine timerSub, void *ptr) {
   short int i;
-  for (i = 1; i < cMaxTimers; i++) {
+  for (i = 1; i < nMaxTimers; i++) {
     if (Timers[i].timerExpiration == 0) {
       SetTimerExpiration(i, expirationMS);
       SetTimerRepeat(i, repeatMS);
@@ -853,7 +1276,7 @@ unsigned short LEDTimers::DefineTimer(unsigned long expirationMS, unsigned long
 }
 
 void LEDTimers::CancelTimer(short timerID) {
-  if ((timerID > 0) && (timerID < cMaxTimers)) {
+  if ((timerID > 0) && (timerID < nMaxTimers)) {
     Timers[timerID].timerExpiration = 0;
     Timers[timerID].timerRepeat = 0;
     Timers[timerID].timerPtr = NULL;}
@@ -864,7 +1287,7 @@ void LEDTimers::CheckTimers() {
   unsigned long curtime, newexpiration;
 
   //Loop all timers once, looking for the active, expired ones
-  for (i = 1; i < cMaxTimers; i++) {
+  for (i = 1; i < nMaxTimers; i++) {
     if (Timers[i].timerExpiration > 0) {
              
       //If this active timer has now expired, process it.
@@ -898,127 +1321,600 @@ void LEDTimers::SetTimerRepeat(short int itimer, unsigned long int rpt) {Timers[
 void LEDTimers::SetTimerRoutine(short int itimer, TimerRoutine timerroutine) {Timers[itimer].timerSub = timerroutine;}
 void LEDTimers::SetTimerPtr(short int itimer, void *ptr) {Timers[itimer].timerPtr = ptr;}
 
+/*
+______________________________________
+LEDSpectrumFFT Class Member Functions:
+*/
+
+LEDSpectrumFFT::LEDSpectrumFFT() {
+  fftSize = 0;
+  fftNumBands = 0;
+  fftRingPos = 0;
+}
+
+bool LEDSpectrumFFT::Begin(uint32_t sampleRate, short size, short nBands) {return Begin(sampleRate, size, nBands, 40, 16000);}
+
+//The tables are worked out in integer math too (see SinCosQ30, Log2Q30 and Exp2Q30), so using the class
+//doesn't pull floating point into an AVR sketch. Values are Q30 fixed point in 64-bit integers.
+
+const int64_t cQ30One = 1LL << 30;
+const int64_t cQ30Pi = 3373259426LL;  //pi * 2^30
+const int64_t cQ30Ln2 = 744261118LL;  //ln(2) * 2^30
+
+//sin and cos of 2 * pi * m / n for m in 0..n/2 (n a power of 2, at least 16). Taylor series to the 13th
+//power are exact to Q30 up to pi/4; the rest of the half circle comes from symmetry.
+static void SinCosQ30(long m, long n, int64_t &sn, int64_t &c) {
+  static const uint8_t sinDiv[] = {156, 110, 72, 42, 20, 6}, cosDiv[] = {132, 90, 56, 30, 12, 2};
+  int64_t x, x2, rs = cQ30One, rc = cQ30One;
+  bool negCos = false, swap = false;
+  short k;
+
+  if (m > n / 4) {m = n / 2 - m; negCos = true;}  //sin(pi - a) = sin(a), cos(pi - a) = -cos(a)
+  if (m > n / 8) {m = n / 4 - m; swap = true;}    //sin(pi/2 - a) = cos(a)
+  x = 2 * cQ30Pi * m / n;
+  x2 = (x * x) >> 30;
+  for (k = 0; k < 6; k++) {
+    rs = cQ30One - ((x2 * rs) >> 30) / sinDiv[k];
+    rc = cQ30One - ((x2 * rc) >> 30) / cosDiv[k];
+  }
+  rs = (x * rs) >> 30;
+  sn = swap ? rc : rs;
+  c = swap ? rs : rc;
+  if (negCos) c = -c;
+}
+
+//log2(v) for v >= 1, a bit of fraction per squaring of the mantissa
+static int64_t Log2Q30(uint32_t v) {
+  short e, k;
+  int64_t m, result;
+
+  for (e = 31; !(v & (1UL << e)); e--) {}
+  m = ((int64_t) v << 30) >> e;
+  result = (int64_t) e << 30;
+  for (k = 29; k >= 0; k--) {
+    m = (m * m) >> 30;
+    if (m >= 2 * cQ30One) {m >>= 1; result |= 1LL << k;}
+  }
+  return result;
+}
+
+//2^x rounded to an integer, for x in Q30 (e^(f ln 2) by its Taylor series for the fraction f)
+static long Exp2Q30(int64_t x) {
+  int64_t y, r = cQ30One;
+  short k, ipart, shift;
+
+  ipart = (short) (x >> 30);
+  y = ((x - ((int64_t) ipart << 30)) * cQ30Ln2) >> 30;
+  for (k = 13; k >= 1; k--) r = cQ30One + ((y * r) >> 30) / k;
+  shift = 30 - ipart;
+  if (shift <= 0) return (long) (r << -shift);
+  if (shift > 62) return 0;
+  return (long) ((r + (1LL << (shift - 1))) >> shift);
+}
+
+bool LEDSpectrumFFT::Begin(uint32_t sampleRate, short size, short nBands, long loHz, long hiHz) {
+  short i, h, j, log2;
+  int64_t logLo, logSpan, logBinScale, sn, c;
+
+  for (log2 = 4; (log2 < 15) && ((1L << log2) < size); log2++) {}
+  if ((size < 16) || (size > cMaxFFTSize) || ((1L << log2) != size) || (nBands < 1) || (nBands > cMaxBands) ||
+      (sampleRate == 0)) return false;
+  hiHz = min(hiHz, (long) (sampleRate * 9 / 20));
+  loHz = max(loHz, 1L);
+  if (loHz >= hiHz) return false;
+
+  //Log-spaced band edges, rounded to bins (edge * size / sampleRate). Bands narrower than a bin are pushed
+  //up to one bin each.
+  logLo = Log2Q30(loHz);
+  logSpan = Log2Q30(hiHz) - logLo;
+  logBinScale = ((int64_t) log2 << 30) - Log2Q30(sampleRate);
+  for (i = 0; i <= nBands; i++) {
+    bandFirstBin[i] = (short) max(Exp2Q30(logLo + logSpan * i / nBands + logBinScale), 1L);
+    if ((i > 0) && (bandFirstBin[i] <= bandFirstBin[i - 1])) bandFirstBin[i] = bandFirstBin[i - 1] + 1;
+  }
+  if (bandFirstBin[nBands] > size / 2) return false;
+
+  //Hann window and twiddles (scaled by 32767 and rounded)
+  for (i = 0; i <= size / 2; i++) {
+    SinCosQ30(i, size, sn, c);
+    window[i] = (int16_t) (((cQ30One - c) * 32767) >> 31);
+  }
+  for (h = 1; h < size; h <<= 1) {
+    for (j = 0; j < h; j++) {
+      SinCosQ30((long) j * (size / (2 * h)), size, sn, c);
+      c = (c * 32767 + (1LL << 29)) >> 30;
+      sn = (sn * 32767 + (1LL << 29)) >> 30;
+      twReal[2 * (h + j)] = (int16_t) c;
+      twReal[2 * (h + j) + 1] = (int16_t) sn;
+      twImag[2 * (h + j)] = (int16_t) -sn;
+      twImag[2 * (h + j) + 1] = (int16_t) c;
+    }
+  }
+  memset(ringLeft, 0, sizeof(ringLeft));
+  memset(ringRight, 0, sizeof(ringRight));
+  fftRate = sampleRate;
+  fftSize = size;
+  fftNumBands = nBands;
+  fftRingPos = 0;
+  return true;
+}
+
+void LEDSpectrumFFT::AddSamples(const int16_t *samples, short nFrames, short nChannels) {
+  short mask = fftSize - 1;
+
+  if ((fftSize == 0) || (nChannels < 1)) return;
+  if (nFrames > fftSize) {  //Only the last fftSize frames are kept anyway
+    samples += (long) (nFrames - fftSize) * nChannels;
+    nFrames = fftSize;
+  }
+  for (; nFrames > 0; nFrames--, samples += nChannels) {
+    ringLeft[fftRingPos] = samples[0];
+    ringRight[fftRingPos] = samples[(nChannels > 1) ? 1 : 0];
+    fftRingPos = (fftRingPos + 1) & mask;
+  }
+}
+
+short LEDSpectrumFFT::GetNumBands() {return fftNumBands;}
+long LEDSpectrumFFT::GetBandHz(short iBand) {return (long) ((uint32_t) bandFirstBin[iBand] * fftRate / fftSize);}
+
+void LEDSpectrumFFT::ReadBands(short *levels, bool doLeft, bool doRight, void *ptr) {
+  ((LEDSpectrumFFT *) ptr)->Analyze(levels, doLeft, doRight);
+}
+
+static inline int16_t FFTSat(long v) {return (int16_t) constrain(v, -32768L, 32767L);}
+
+//Integer square root
+static uint16_t FFTSqrt(uint32_t v) {
+  uint32_t root = 0, bit = 1UL << 30;
+  while (bit > v) bit >>= 2;
+  for (; bit; bit >>= 2) {
+    if (v >= root + bit) {v -= root + bit; root = (root >> 1) + bit;}
+    else root >>= 1;
+  }
+  return (uint16_t) root;
+}
+
+/*_________________________
+LEDSpectrumFFT::Transform
+In-place radix-2 decimation-in-time FFT of data[] (already in bit-reversed order), Q15. Each butterfly is
+a' = a/2 + b*w/2, b' = a/2 - b*w/2, so every stage halves and the result (the DFT / fftSize) can't overflow.
+b*w/2 is rounded from the 32-bit products. With SSE2, four butterflies at a time for the stages of 4 or
+more (the same arithmetic, so the results are identical).
+*/
+
+void LEDSpectrumFFT::Transform() {
+  short h, g, j;
+  int16_t *pa, *pb;
+  const int16_t *wr, *wi;
+  long tr, ti, ar, ai;
+#if defined(__SSE2__)
+  const __m128i round = _mm_set1_epi32(32768);
+  __m128i a, b, re, im, t;
+#endif
+
+  for (h = 1; h < fftSize; h <<= 1) {
+    wr = twReal + 2 * h;
+    wi = twImag + 2 * h;
+    for (g = 0; g < fftSize; g += 2 * h) {
+      pa = data + 2 * g;
+      pb = pa + 2 * h;
+      j = 0;
+#if defined(__SSE2__)
+      for (; j + 4 <= h; j += 4) {
+        a = _mm_srai_epi16(_mm_loadu_si128((const __m128i *) (pa + 2 * j)), 1);
+        b = _mm_loadu_si128((const __m128i *) (pb + 2 * j));
+        re = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(b, _mm_loadu_si128((const __m128i *) (wr + 2 * j))), round), 16);
+        im = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(b, _mm_loadu_si128((const __m128i *) (wi + 2 * j))), round), 16);
+        t = _mm_packs_epi32(re, im);                      //re0..re3, im0..im3
+        t = _mm_unpacklo_epi16(t, _mm_srli_si128(t, 8));  //re0, im0, re1, im1, ...
+        _mm_storeu_si128((__m128i *) (pa + 2 * j), _mm_adds_epi16(a, t));
+        _mm_storeu_si128((__m128i *) (pb + 2 * j), _mm_subs_epi16(a, t));
+      }
+#endif
+      for (; j < h; j++) {
+        tr = ((long) pb[2 * j] * wr[2 * j] + (long) pb[2 * j + 1] * wr[2 * j + 1] + 32768L) >> 16;
+        ti = ((long) pb[2 * j] * wi[2 * j] + (long) pb[2 * j + 1] * wi[2 * j + 1] + 32768L) >> 16;
+        ar = pa[2 * j] >> 1;
+        ai = pa[2 * j + 1] >> 1;
+        pa[2 * j] = FFTSat(ar + tr);
+        pa[2 * j + 1] = FFTSat(ai + ti);
+        pb[2 * j] = FFTSat(ar - tr);
+        pb[2 * j + 1] = FFTSat(ai - ti);
+      }
+    }
+  }
+}
+
+/*_______________________
+LEDSpectrumFFT::Analyze
+Window the latest fftSize samples (left as the real part, right as the imaginary part) into data[] in
+bit-reversed order, transform, and split the two channels back out of each bin pair:
+  2 L[k] = Z[k] + conj(Z[n - k]),  2 R[k] = -j (Z[k] - conj(Z[n - k]))
+A band's level is the square root of its bins' total power, scaled so that a full-scale sine (Hann
+windowed, about 1.22 x a quarter of full scale over its three bins) reads cMaxBandLevel. The total power
+of one channel is at most 2^30, so it sums in 32 bits.
+*/
+
+void LEDSpectrumFFT::Analyze(short *levels, bool doLeft, bool doRight) {
+  short i, k, r, bit, iBand, half, mask, n;
+  int16_t w;
+  long zr, zi, mr, mi, lr, li, rr, ri;
+  uint32_t powerLeft, powerRight, power;
+
+  if (fftSize == 0) return;
+  if (!(doLeft || doRight)) {
+    for (iBand = 0; iBand < fftNumBands; iBand++) levels[iBand] = 0;
+    return;
+  }
+
+  n = fftSize;
+  half = n >> 1;
+  mask = n - 1;
+  for (i = 0, r = 0; i < n; i++) {
+    w = window[(i <= half) ? i : n - i];
+    data[2 * r] = (int16_t) (((long) ringLeft[(fftRingPos + i) & mask] * w + 16384L) >> 15);
+    data[2 * r + 1] = (int16_t) (((long) ringRight[(fftRingPos + i) & mask] * w + 16384L) >> 15);
+    for (bit = half; r & bit; bit >>= 1) r ^= bit;  //r = the bit reverse of i + 1
+    r |= bit;
+  }
+  Transform();
+
+  for (iBand = 0; iBand < fftNumBands; iBand++) {
+    powerLeft = powerRight = 0;
+    for (k = bandFirstBin[iBand]; k < bandFirstBin[iBand + 1]; k++) {
+      zr = data[2 * k];
+      zi = data[2 * k + 1];
+      mr = data[2 * (n - k)];
+      mi = data[2 * (n - k) + 1];
+      lr = (zr + mr) >> 1;
+      li = (zi - mi) >> 1;
+      rr = (zi + mi) >> 1;
+      ri = (mr - zr) >> 1;
+      powerLeft += (uint32_t) (lr * lr) + (uint32_t) (li * li);
+      powerRight += (uint32_t) (rr * rr) + (uint32_t) (ri * ri);
+    }
+    power = 0;
+    if (doLeft) power = powerLeft;
+    if (doRight) power = max(power, powerRight);
+    levels[iBand] = (short) min(((uint32_t) FFTSqrt(power) * 1671UL) >> 14, (uint32_t) cMaxBandLevel);
+  }
+}
+
 /*
 ____________________________________________
 LED strip class (LEDSegs::) member functions
 */
 
 //Create a timer that refreshes the display. teTimedDisplay is private
-short int LEDSegs::TimedDisplay(short int timeMS) {return(DefineTimer(timeMS, timeMS, LEDSegs::teTimedDisplay, this));}
+short int LEDSegsBase::TimedDisplay(short int timeMS) {
+#if defined LEDSEGS_STATS
+  stripDisplayPeriodMS = timeMS;
+#endif
+  return(DefineTimer(timeMS, timeMS, LEDSegsBase::teTimedDisplay, this));
+}
 
-//Reset the random permutation array (for cSegActionRandom)
-void LEDSegs::ResetRandom() {
-  unsigned short i;
+//Reset the random permutation arrays (for cSegActionRandom): the cSegNRandom slots and the longer tables
+//in use
+void LEDSegsBase::ResetRandom() {
+  short itable;
   randomSeed(micros());
-  for (i = 0; i < cSegNRandom; i++) {segRandomLevels[i] = random(cMaxSegmentLevel);}
+  for (itable = 0; itable <= cMaxRandomTables; itable++) {
+    if ((itable == 0) || (randomTables[itable].refs > 0)) FillRandomTable(&randomTables[itable]);
+  }
 }
 
-void LEDSegs::SetSegmentIndex(short Idx) {
-  segCurrentIndex = constrain(Idx, 0, cMaxSegments - 1);
-  segMaxDefinedIndex = max(segMaxDefinedIndex, segCurrentIndex);
+//Fill a random table with new levels, and sort its slots by level so a frame can find the lit ones with a
+//binary search (see RandomLitSlots)
+void LEDSegsBase::FillRandomTable(RandomTable *table) {
+  unsigned short i, j, gap, slot;
+  unsigned short *levels = table->levels, *sorted = table->sorted;
+
+  for (i = 0; i < (unsigned short) table->length; i++) {levels[i] = random(cMaxSegmentLevel); sorted[i] = i;}
+
+  //Shell sort
+  for (gap = table->length / 2; gap > 0; gap /= 2) {
+    for (i = gap; i < (unsigned short) table->length; i++) {
+      slot = sorted[i];
+      for (j = i; (j >= gap) && (levels[sorted[j - gap]] > levels[slot]); j -= gap) {
+        sorted[j] = sorted[j - gap];
+      }
+      sorted[j] = slot;
+    }
+  }
+}
+
+//The number of random slots lit at a level: those with levels <= level are sorted[0..n-1]
+short LEDSegsBase::RandomLitSlots(RandomTable *table, short level) {
+  short lo = 0, hi = table->length, mid;
+  while (lo < hi) {
+    mid = (lo + hi) >> 1;
+    if (table->levels[table->sorted[mid]] <= level) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+/*_________________________
+LEDSegs::AcquireRandomTable
+Find or allocate (and fill) the random table of a given length and take a reference to it. Segments with
+the same length share a table. Returns the table index, or 0 (the cSegNRandom slots) if the length is no
+longer than those, there's no free table slot or no memory.
+*/
+
+short LEDSegsBase::AcquireRandomTable(short length) {
+  short i, ifree;
+  unsigned short *levels;
+
+  if (length <= cSegNRandom) return 0;
+
+  ifree = -1;
+  for (i = 1; i <= cMaxRandomTables; i++) {
+    if (randomTables[i].refs == 0) {if ((ifree < 0) || (randomTables[i].length == length)) ifree = i;}
+    else if (randomTables[i].length == length) {
+      randomTables[i].refs++;
+      return i;
+    }
+  }
+  if (ifree < 0) return 0;
+
+  //Reuse the slot's memory if it was the same length, else allocate
+  levels = randomTables[ifree].levels;
+  if ((levels != NULL) && (randomTables[ifree].length != length)) {free(levels); levels = NULL;}
+  if (levels == NULL) levels = (unsigned short *) malloc(2 * length * sizeof(unsigned short));
+  randomTables[ifree].levels = levels;
+  if (levels == NULL) return 0;
+  randomTables[ifree].sorted = levels + length;
+  randomTables[ifree].length = length;
+  randomTables[ifree].refs = 1;
+  FillRandomTable(&randomTables[ifree]);
+  return ifree;
+}
+
+//Drop a segment's reference to a random table. The table memory is kept for reuse by the slot.
+void LEDSegsBase::ReleaseRandomTable(short itable) {
+  if (itable > 0) randomTables[itable].refs--;
 }
-short LEDSegs::GetSegmentIndex() {return segCurrentIndex;}
+
+void LEDSegsBase::SetSegmentIndex(short Idx) {
+  segCurrentIndex = constrain(Idx, 0, nMaxSegments - 1);
+}
+short LEDSegsBase::GetSegmentIndex() {return segCurrentIndex;}
 
 //Smallest allowed max level (default=1023) and decay (default=1) of max level on each refresh cycle
 
-void LEDSegs::SetMaxLevelFloor(short int iFloor) {stripMaxLevelFloor = constrain(iFloor, 1, cMaxSegmentLevel);}
-short int LEDSegs::GetMaxLevelFloor() {return stripMaxLevelFloor;}
-void LEDSegs::SetMaxLevelDecay(short int iDecay) {stripMaxLevelDecay = constrain(iDecay, 1, cMaxSegmentLevel);}
-short int LEDSegs::GetMaxLevelDecay() {return stripMaxLevelDecay;}
+void LEDSegsBase::SetMaxLevelFloor(short int iFloor) {stripMaxLevelFloor = constrain(iFloor, 1, cMaxSegmentLevel);}
+short int LEDSegsBase::GetMaxLevelFloor() {return stripMaxLevelFloor;}
+void LEDSegsBase::SetMaxLevelDecay(short int iDecay) {stripMaxLevelDecay = constrain(iDecay, 1, cMaxSegmentLevel);}
+short int LEDSegsBase::GetMaxLevelDecay() {return stripMaxLevelDecay;}
+void LEDSegsBase::SetFixedPointLevels(bool fixedPoint) {stripFixedPoint = fixedPoint && cFixedPointCache;}
+bool LEDSegsBase::GetFixedPointLevels() {return stripFixedPoint;}
+void LEDSegsBase::SetOcclusionCulling(bool culling) {stripCulling = culling && (cMaxCullSpans > 0); stripCullValid = false;}
+bool LEDSegsBase::GetOcclusionCulling() {return stripCulling;}
 
 //The SetSegment_xxx and GetSegment_xxx routines are overloaded. The segment # parameter
 //can be omitted and defaults to the current segment index. Note that there are no GET methods
 //for a couple of properties.
 
-void LEDSegs::SetSegment_Action(short nSegment, short Action) {if (Action >= 0) {SegmentData[nSegment].segAction = Action;};}
-void LEDSegs::SetSegment_Action(short Action) {SetSegment_Action(segCurrentIndex, Action);}
-void LEDSegs::SetSegment_BackColor(short nSegment, uint32_t BackColor) {SegmentData[nSegment].segBackColor = BackColor;}
-void LEDSegs::SetSegment_BackColor(uint32_t BackColor) {SetSegment_BackColor(segCurrentIndex, BackColor);}
-void LEDSegs::SetSegment_Bands(short nSegment, short Bands) {SegmentData[nSegment].segBands = Bands; SegmentData[nSegment].segMaxLevel = stripMaxLevelFloor;}
-void LEDSegs::SetSegment_Bands(short Bands) {SetSegment_Bands(segCurrentIndex, Bands);}
-void LEDSegs::SetSegment_DisplayRoutine(short nSegment, SegmentDisplayRoutine Routine) {SegmentData[nSegment].segDisplayRoutine = *Routine;}
-void LEDSegs::SetSegment_DisplayRoutine(SegmentDisplayRoutine Routine) {SetSegment_DisplayRoutine(segCurrentIndex, Routine);}
-void LEDSegs::SetSegment_FirstLED(short nSegment, short FirstLED) {SegmentData[nSegment].segFirstLED = FirstLED;}
-void LEDSegs::SetSegment_FirstLED(short FirstLED) {SetSegment_FirstLED(segCurrentIndex, FirstLED);}
-void LEDSegs::SetSegment_ForeColor(short nSegment, uint32_t ForeColor) {SegmentData[nSegment].segForeColor = ForeColor;}
-void LEDSegs::SetSegment_ForeColor(uint32_t ForeColor) {SetSegment_ForeColor(segCurrentIndex, ForeColor);}
-void LEDSegs::SetSegment_Level(short nSegment, short level) {SegmentData[nSegment].segLevel = constrain(level, 0, cMaxSegmentLevel);}
-void LEDSegs::SetSegment_Level(short level) {SetSegment_Level(segCurrentIndex, level);}
-void LEDSegs::SetSegment_MaxLevel(short maxlevel) {SetSegment_Level(segCurrentIndex, maxlevel);}
-void LEDSegs::SetSegment_MaxLevel(short nSegment, short maxlevel) {SegmentData[nSegment].segMaxLevel = maxlevel;}
-void LEDSegs::SetSegment_NumLEDs(short nSegment, short nLEDs) {if ((nLEDs >= 0) && (nLEDs <= nLEDsInStrip)) {SegmentData[nSegment].segNumLEDs = nLEDs;};}
-void LEDSegs::SetSegment_NumLEDs(short nLEDs) {SetSegment_NumLEDs(segCurrentIndex, nLEDs);}
-void LEDSegs::SetSegment_Part(short nSegment, short partNum) {if ((partNum >= 0) && (partNum < cMaxParts)) SegmentData[nSegment].segPart = partNum;}
-void LEDSegs::SetSegment_Part(short partNum) {SetSegment_Part(segCurrentIndex, partNum);}
-void LEDSegs::SetSegment_BitsPtr(short nSegment, uint32_t *ptrval) {SegmentData[nSegment].segBitsPtr = ptrval;}
-void LEDSegs::SetSegment_BitsPtr(uint32_t *ptrval) {SetSegment_BitsPtr(segCurrentIndex, ptrval);}
-void LEDSegs::SetSegment_Options(short nSegment, short Options) {if (Options >= 0) {SegmentData[nSegment].segOptions = Options;};}
-void LEDSegs::SetSegment_Options(short Options) {SetSegment_Options(segCurrentIndex, Options);}
-void LEDSegs::SetSegment_Persistence(short up, short down) {SetSegment_Persistence(segCurrentIndex, up, down);}
-void LEDSegs::SetSegment_Persistence(short nSegment, short up, short down) {SegmentData[nSegment].segPersistUp = up; SegmentData[nSegment].segPersistDown = down;}
-void LEDSegs::SetSegment_RandomPattern(short nSegment, short RandomPattern) {if (RandomPattern >= 0) {SegmentData[nSegment].segRandomPattern = RandomPattern & cSegNRandomMask;};}
-void LEDSegs::SetSegment_RandomPattern(short RandomPattern) {SetSegment_RandomPattern(segCurrentIndex, RandomPattern);}
-void LEDSegs::SetSegment_Spacing(short nSegment, short Spacing) {if (Spacing >= 0) {SegmentData[nSegment].segSpacing = Spacing;};}
-void LEDSegs::SetSegment_Rescale(const short int *scaleary) {SetSegment_Rescale(segCurrentIndex, scaleary);}
-void LEDSegs::SetSegment_Rescale(short nSegment, const short int *scaleary) {SegmentData[nSegment].segRescaleAry = scaleary;}
-void LEDSegs::SetSegment_Spacing(short Spacing) {SetSegment_Spacing(segCurrentIndex, Spacing);}
-
-short    LEDSegs::GetSegment_Action(short nSegment)    {return SegmentData[nSegment].segAction;}
-short    LEDSegs::GetSegment_Action()                  {return SegmentData[segCurrentIndex].segAction;}
-uint32_t LEDSegs::GetSegment_BackColor(short nSegment) {return SegmentData[nSegment].segBackColor;}
-uint32_t LEDSegs::GetSegment_BackColor()               {return SegmentData[segCurrentIndex].segBackColor;}
-short    LEDSegs::GetSegment_Bands(short nSegment)     {return SegmentData[nSegment].segBands;}
-short    LEDSegs::GetSegment_Bands()                   {return SegmentData[segCurrentIndex].segBands;}
-short    LEDSegs::GetSegment_FirstLED(short nSegment)  {return SegmentData[nSegment].segFirstLED;}
-short    LEDSegs::GetSegment_FirstLED()                {return SegmentData[segCurrentIndex].segFirstLED;}
-uint32_t LEDSegs::GetSegment_ForeColor(short nSegment) {return SegmentData[nSegment].segForeColor;}
-uint32_t LEDSegs::GetSegment_ForeColor()               {return SegmentData[segCurrentIndex].segForeColor;}
-short    LEDSegs::GetSegment_Level(short nSegment)     {return SegmentData[nSegment].segLevel;}
-short    LEDSegs::GetSegment_Level()                   {return SegmentData[segCurrentIndex].segLevel;}
-short    LEDSegs::GetSegment_MaxLevel(short nSegment)  {return SegmentData[nSegment].segMaxLevel;}
-short    LEDSegs::GetSegment_MaxLevel()                {return SegmentData[segCurrentIndex].segMaxLevel;}
-short    LEDSegs::GetSegment_NumLEDs(short nSegment)   {return SegmentData[nSegment].segNumLEDs;}
-short    LEDSegs::GetSegment_NumLEDs()                 {return SegmentData[segCurrentIndex].segNumLEDs;}
-short    LEDSegs::GetSegment_Options(short nSegment)   {return SegmentData[nSegment].segOptions;}
-short    LEDSegs::GetSegment_Options()                 {return SegmentData[segCurrentIndex].segOptions;}
-short    LEDSegs::GetSegment_RandomPattern(short nSegment) {return SegmentData[nSegment].segRandomPattern;}
-short    LEDSegs::GetSegment_RandomPattern()           {return SegmentData[segCurrentIndex].segRandomPattern;}
-short    LEDSegs::GetSegment_Spacing(short nSegment)   {return SegmentData[nSegment].segSpacing;}
-short    LEDSegs::GetSegment_Spacing()                 {return SegmentData[segCurrentIndex].segSpacing;}
+void LEDSegsBase::SetSegment_Action(short nSegment, short Action) {
+  if ((Action >= 0) && (Action != SegAction[nSegment])) {
+    SegAction[nSegment] = Action;
+    InvalidatePlan(nSegment);
+    stripCullValid = false;
+    if (Action != cSegActionNone) ActivateSegment(nSegment);
+  }
+}
+void LEDSegsBase::SetSegment_Action(short Action) {SetSegment_Action(segCurrentIndex, Action);}
+void LEDSegsBase::SetSegment_BackColor(short nSegment, uint32_t BackColor) {SegmentData[nSegment].segBackColor = BackColor;}
+void LEDSegsBase::SetSegment_BackColor(uint32_t BackColor) {SetSegment_BackColor(segCurrentIndex, BackColor);}
+void LEDSegsBase::SetSegment_Bands(short nSegment, LEDBandMask Bands) {SegBands[nSegment] = Bands; SegMaxLevel[nSegment] = stripMaxLevelFloor;}
+void LEDSegsBase::SetSegment_Bands(LEDBandMask Bands) {SetSegment_Bands(segCurrentIndex, Bands);}
+void LEDSegsBase::SetSegment_DisplayRoutine(short nSegment, SegmentDisplayRoutine Routine) {SegmentData[nSegment].segDisplayRoutine = *Routine;}
+void LEDSegsBase::SetSegment_DisplayRoutine(SegmentDisplayRoutine Routine) {SetSegment_DisplayRoutine(segCurrentIndex, Routine);}
+void LEDSegsBase::SetSegment_FirstLED(short nSegment, short FirstLED) {
+  if (FirstLED != SegmentData[nSegment].segFirstLED) {SegmentData[nSegment].segFirstLED = FirstLED; InvalidatePlan(nSegment); stripCullValid = false;}
+}
+void LEDSegsBase::SetSegment_FirstLED(short FirstLED) {SetSegment_FirstLED(segCurrentIndex, FirstLED);}
+void LEDSegsBase::SetSegment_ForeColor(short nSegment, uint32_t ForeColor) {SegmentData[nSegment].segForeColor = ForeColor;}
+void LEDSegsBase::SetSegment_ForeColor(uint32_t ForeColor) {SetSegment_ForeColor(segCurrentIndex, ForeColor);}
+void LEDSegsBase::SetSegment_Level(short nSegment, short level) {SegLevel[nSegment] = constrain(level, 0, cMaxSegmentLevel);}
+void LEDSegsBase::SetSegment_Level(short level) {SetSegment_Level(segCurrentIndex, level);}
+void LEDSegsBase::SetSegment_MaxLevel(short maxlevel) {SetSegment_Level(segCurrentIndex, maxlevel);}
+void LEDSegsBase::SetSegment_MaxLevel(short nSegment, short maxlevel) {SegMaxLevel[nSegment] = maxlevel;}
+void LEDSegsBase::SetSegment_NumLEDs(short nSegment, short nLEDs) {
+  if ((nLEDs >= 0) && (nLEDs <= nLEDsInStrip) && (nLEDs != SegNumLEDs[nSegment])) {
+    SegNumLEDs[nSegment] = nLEDs;
+#if cFixedPointCache
+    SegLEDsRecip[nSegment] = (nLEDs > 0) ? (1UL << 24) / nLEDs : 0;
+#endif
+    InvalidatePlan(nSegment);
+    stripCullValid = false;
+    ActivateSegment(nSegment);
+  }
+}
+void LEDSegsBase::SetSegment_NumLEDs(short nLEDs) {SetSegment_NumLEDs(segCurrentIndex, nLEDs);}
+void LEDSegsBase::SetSegment_Part(short nSegment, short partNum) {
+  if ((partNum >= 0) && (partNum < nMaxParts) && (partNum != SegmentData[nSegment].segPart)) {SegmentData[nSegment].segPart = partNum; InvalidatePlan(nSegment); stripCullValid = false;}
+}
+void LEDSegsBase::SetSegment_Part(short partNum) {SetSegment_Part(segCurrentIndex, partNum);}
+void LEDSegsBase::SetSegment_BitsPtr(short nSegment, const uint8_t *ptrval) {SegmentData[nSegment].segBitsPtr = ptrval;}
+void LEDSegsBase::SetSegment_BitsPtr(short nSegment, const uint32_t *ptrval) {SetSegment_BitsPtr(nSegment, (const uint8_t *) ptrval);}
+void LEDSegsBase::SetSegment_BitsPtr(short nSegment, const uint64_t *ptrval) {SetSegment_BitsPtr(nSegment, (const uint8_t *) ptrval);}
+void LEDSegsBase::SetSegment_BitsPtr(const uint8_t *ptrval) {SetSegment_BitsPtr(segCurrentIndex, ptrval);}
+void LEDSegsBase::SetSegment_BitsPtr(const uint32_t *ptrval) {SetSegment_BitsPtr(segCurrentIndex, ptrval);}
+void LEDSegsBase::SetSegment_BitsPtr(const uint64_t *ptrval) {SetSegment_BitsPtr(segCurrentIndex, ptrval);}
+void LEDSegsBase::SetSegment_BitsOffset(short nSegment, short offset) {SegmentData[nSegment].segBitsOffset = offset;}
+void LEDSegsBase::SetSegment_BitsOffset(short offset) {SetSegment_BitsOffset(segCurrentIndex, offset);}
+void LEDSegsBase::SetSegment_Blend(short nSegment, short Blend) {
+  if ((Blend >= cSegBlendNone) && (Blend <= cSegBlendAlpha)) {
+#if cSegBlendModes
+    SegmentData[nSegment].segBlend = Blend;
+#endif
+    stripCullValid = false;
+  }
+}
+void LEDSegsBase::SetSegment_Blend(short Blend) {SetSegment_Blend(segCurrentIndex, Blend);}
+void LEDSegsBase::SetSegment_Opacity(short nSegment, short Opacity) {
+#if cSegBlendModes
+  SegmentData[nSegment].segOpacity = constrain(Opacity, 0, 255);
+#endif
+}
+void LEDSegsBase::SetSegment_Opacity(short Opacity) {SetSegment_Opacity(segCurrentIndex, Opacity);}
+void LEDSegsBase::SetSegment_Options(short nSegment, short Options) {if (Options >= 0) {SegOptions[nSegment] = Options; stripCullValid = false;};}
+void LEDSegsBase::SetSegment_Options(short Options) {SetSegment_Options(segCurrentIndex, Options);}
+void LEDSegsBase::SetSegment_Persistence(short up, short down) {SetSegment_Persistence(segCurrentIndex, up, down);}
+void LEDSegsBase::SetSegment_Persistence(short nSegment, short up, short down) {
+  SegPersistUp[nSegment] = up;
+  SegPersistDown[nSegment] = down;
+#if cFixedPointCache
+  SegPersistUpRecip[nSegment] = (up > 0) ? (1UL << 22) / (up + cMaxSegmentLevel) : 0;
+  SegPersistDownRecip[nSegment] = (down > 0) ? (1UL << 22) / (down + cMaxSegmentLevel) : 0;
+#endif
+}
+void LEDSegsBase::SetSegment_RandomPattern(short nSegment, short RandomPattern) {
+  if (RandomPattern >= 0) {
+    SegmentData[nSegment].segRandomPattern = RandomPattern & (randomTables[SegmentData[nSegment].segRandomTable].length - 1);
+  }
+}
+void LEDSegsBase::SetSegment_RandomPattern(short RandomPattern) {SetSegment_RandomPattern(segCurrentIndex, RandomPattern);}
+//The length is rounded up to a power of 2; the table is filled now and by each ResetRandom(), not every frame
+void LEDSegsBase::SetSegment_RandomLength(short nSegment, short Length) {
+  short length = cSegNRandom;
+  while ((length < Length) && (length < cSegMaxRandomLength)) length *= 2;
+  if (length == GetSegment_RandomLength(nSegment)) return;
+  ReleaseRandomTable(SegmentData[nSegment].segRandomTable);
+  SegmentData[nSegment].segRandomTable = AcquireRandomTable(length);
+  SetSegment_RandomPattern(nSegment, SegmentData[nSegment].segRandomPattern);
+}
+void LEDSegsBase::SetSegment_RandomLength(short Length) {SetSegment_RandomLength(segCurrentIndex, Length);}
+void LEDSegsBase::SetSegment_Spacing(short nSegment, short Spacing) {
+  if ((Spacing >= 0) && (Spacing != SegmentData[nSegment].segSpacing)) {SegmentData[nSegment].segSpacing = Spacing; InvalidatePlan(nSegment); stripCullValid = false;}
+}
+void LEDSegsBase::SetSegment_Rescale(const short int *scaleary) {SetSegment_Rescale(segCurrentIndex, scaleary);}
+//The array is compiled now; later edits to it need another SetSegment_Rescale() call
+void LEDSegsBase::SetSegment_Rescale(short nSegment, const short int *scaleary) {
+  ReleaseRescaleTable(SegRescale[nSegment]);
+  SegmentData[nSegment].segRescaleAry = scaleary;
+  SegRescale[nSegment] = AcquireRescaleTable(scaleary);
+  if ((SegRescale[nSegment] < 0) && (scaleary != NULL)) SegRescale[nSegment] = cRescaleUncompiled;
+}
+void LEDSegsBase::SetSegment_Spacing(short Spacing) {SetSegment_Spacing(segCurrentIndex, Spacing);}
+
+short    LEDSegsBase::GetSegment_Action(short nSegment)    {return SegAction[nSegment];}
+short    LEDSegsBase::GetSegment_Action()                  {return SegAction[segCurrentIndex];}
+uint32_t LEDSegsBase::GetSegment_BackColor(short nSegment) {return SegmentData[nSegment].segBackColor;}
+uint32_t LEDSegsBase::GetSegment_BackColor()               {return SegmentData[segCurrentIndex].segBackColor;}
+LEDBandMask LEDSegsBase::GetSegment_Bands(short nSegment) {return SegBands[nSegment];}
+LEDBandMask LEDSegsBase::GetSegment_Bands()               {return SegBands[segCurrentIndex];}
+short    LEDSegsBase::GetSegment_BitsOffset(short nSegment) {return SegmentData[nSegment].segBitsOffset;}
+short    LEDSegsBase::GetSegment_BitsOffset()              {return SegmentData[segCurrentIndex].segBitsOffset;}
+short    LEDSegsBase::GetSegment_Blend(short nSegment)     {return SegBlend(&SegmentData[nSegment]);}
+short    LEDSegsBase::GetSegment_Blend()                   {return SegBlend(&SegmentData[segCurrentIndex]);}
+short    LEDSegsBase::GetSegment_FirstLED(short nSegment)  {return SegmentData[nSegment].segFirstLED;}
+short    LEDSegsBase::GetSegment_FirstLED()                {return SegmentData[segCurrentIndex].segFirstLED;}
+uint32_t LEDSegsBase::GetSegment_ForeColor(short nSegment) {return SegmentData[nSegment].segForeColor;}
+uint32_t LEDSegsBase::GetSegment_ForeColor()               {return SegmentData[segCurrentIndex].segForeColor;}
+short    LEDSegsBase::GetSegment_Level(short nSegment)     {return SegLevel[nSegment];}
+short    LEDSegsBase::GetSegment_Level()                   {return SegLevel[segCurrentIndex];}
+short    LEDSegsBase::GetSegment_MaxLevel(short nSegment)  {return SegMaxLevel[nSegment];}
+short    LEDSegsBase::GetSegment_MaxLevel()                {return SegMaxLevel[segCurrentIndex];}
+short    LEDSegsBase::GetSegment_NumLEDs(short nSegment)   {return SegNumLEDs[nSegment];}
+short    LEDSegsBase::GetSegment_NumLEDs()                 {return SegNumLEDs[segCurrentIndex];}
+short    LEDSegsBase::GetSegment_Options(short nSegment)   {return SegOptions[nSegment];}
+short    LEDSegsBase::GetSegment_Options()                 {return SegOptions[segCurrentIndex];}
+short    LEDSegsBase::GetSegment_Opacity(short nSegment)   {return SegOpacity(&SegmentData[nSegment]);}
+short    LEDSegsBase::GetSegment_Opacity()                 {return SegOpacity(&SegmentData[segCurrentIndex]);}
+short    LEDSegsBase::GetSegment_RandomPattern(short nSegment) {return SegmentData[nSegment].segRandomPattern;}
+short    LEDSegsBase::GetSegment_RandomPattern()           {return SegmentData[segCurrentIndex].segRandomPattern;}
+short    LEDSegsBase::GetSegment_RandomLength(short nSegment) {return randomTables[SegmentData[nSegment].segRandomTable].length;}
+short    LEDSegsBase::GetSegment_RandomLength()            {return GetSegment_RandomLength(segCurrentIndex);}
+short    LEDSegsBase::GetSegment_Spacing(short nSegment)   {return SegmentData[nSegment].segSpacing;}
+short    LEDSegsBase::GetSegment_Spacing()                 {return SegmentData[segCurrentIndex].segSpacing;}
 
 //Define segment methods
 
-short LEDSegs::DefineSegment(short firstled, short nleds, short action, uint32_t forecolor, short bands) {
+short LEDSegsBase::DefineSegment(short firstled, short nleds, short action, uint32_t forecolor, LEDBandMask bands) {
   return DefineSegment(firstled, nleds, action, forecolor, bands, 0);
 };
 
 //Free up a given segment. Current index is left undefined
-void LEDSegs::ResetSegment(short int i) {
-  SegmentData[i].segAction = cSegActionNone;
-  SegmentData[i].segNumLEDs = -1;  //This and a none action marks an available segment
-  if (segMaxDefinedIndex == i) segMaxDefinedIndex--;
+void LEDSegsBase::ResetSegment(short int i) {
+  short ipos;
+  if (! (segFreeBits[i >> 5] & (1UL << (i & 31)))) {
+    ipos = ActivePosition(i);
+    segNumActive--;
+    memmove(&segActive[ipos], &segActive[ipos + 1], (segNumActive - ipos) * sizeof(short));
+    segFreeBits[i >> 5] |= 1UL << (i & 31);
+  }
+  SegAction[i] = cSegActionNone;
+  SegNumLEDs[i] = -1;  //This and a none action marks an available segment
+  InvalidatePlan(i);
+  stripCullValid = false;
+  ReleaseRescaleTable(SegRescale[i]);
+  SegmentData[i].segRescaleAry = NULL;
+  SegRescale[i] = cRescaleNone;
+  ReleaseRandomTable(SegmentData[i].segRandomTable);
+  SegmentData[i].segRandomTable = 0;
   segCurrentIndex = -1;
 }
 
 //Free up all segments. Current index is left undefined
-void LEDSegs::ResetSegments() {
+void LEDSegsBase::ResetSegments() {
   short int i;
-  for (i = 0; i < cMaxSegments; i++) {ResetSegment(i);}
+  //Mark every slot free first so each ResetSegment() only has to clear the fields
+  segNumActive = 0;
+  memset(segFreeBits, 0xFF, ((nMaxSegments + 31) / 32) * sizeof(uint32_t));
+  if (nMaxSegments & 31) segFreeBits[nMaxSegments >> 5] = (1UL << (nMaxSegments & 31)) - 1;
+  for (i = 0; i < nMaxSegments; i++) {ResetSegment(i);}
   segCurrentIndex = -1;
-  segMaxDefinedIndex = -1;
+}
+
+//Add a free slot to the defined segments (no-op if it is already defined)
+void LEDSegsBase::ActivateSegment(short iseg) {
+  short ipos;
+  if (! (segFreeBits[iseg >> 5] & (1UL << (iseg & 31)))) return;
+  segFreeBits[iseg >> 5] &= ~(1UL << (iseg & 31));
+  ipos = ActivePosition(iseg);
+  memmove(&segActive[ipos + 1], &segActive[ipos], (segNumActive - ipos) * sizeof(short));
+  segActive[ipos] = iseg;
+  segNumActive++;
+  stripCullValid = false;
+}
+
+//Position in segActive of the first defined segment with index >= iseg (segNumActive if none)
+short LEDSegsBase::ActivePosition(short iseg) {
+  short lo = 0, hi = segNumActive, mid;
+  while (lo < hi) {
+    mid = (lo + hi) >> 1;
+    if (segActive[mid] < iseg) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+//The first free slot at or after istart, wrapping around to 0. -1 if all slots are defined.
+short LEDSegsBase::FindFreeSegment(short istart) {
+  const short nwords = (nMaxSegments + 31) / 32;
+  short iword = istart >> 5, i;
+  uint32_t bits = segFreeBits[iword] & (0xFFFFFFFFUL << (istart & 31));
+
+  //One extra word so the wrap gets back to the slots below istart in its own word
+  for (i = 0; i <= nwords; i++) {
+    if (bits) return (iword << 5) + __builtin_ctzl(bits);
+    if (++iword >= nwords) iword = 0;
+    bits = segFreeBits[iword];
+  }
+  return -1;
 }
 
 //Methods that match LPD8806 member function, except declared static and does not set the high bit (this
 //is done by LPD8806 setPixelColor. Return value is GRB (not RGB!) value in long int.
     
-uint32_t LEDSegs::Color(byte r, byte g, byte b) {
+uint32_t LEDSegsBase::Color(byte r, byte g, byte b) {
   return ((uint32_t)(g) << 16) | ((uint32_t)(r) <<  8) | b;
 }
 
 //Get the r/g/b components of a color into byte values (remember value is GRB, not RGB), return array [0..2]
 //is ordered RGB
 
-void LEDSegs::Colorvals(uint32_t Color, byte rgbvals[]) {
+void LEDSegsBase::Colorvals(uint32_t Color, byte rgbvals[]) {
   rgbvals[1] = ((Color >> 16) & 0x7F);
   rgbvals[0] = ((Color >> 8) & 0x7F);
   rgbvals[2] = (Color & 0x7F);
@@ -1026,64 +1922,100 @@ void LEDSegs::Colorvals(uint32_t Color, byte rgbvals[]) {
     
 /* Parts methods (public) */
 
-void LEDSegs::DefinePart(short partNum, short partStart, short partLen, bool partUp) {
-  if ((partNum < 1) || (partNum >= cMaxParts)) return;
+void LEDSegsBase::DefinePart(short partNum, short partStart, short partLen, bool partUp) {
+  if ((partNum < 1) || (partNum >= nMaxParts)) return;
   stripParts[partNum].start = constrain(partStart, 0, nLEDsInStrip);
   stripParts[partNum].len = constrain(partLen, 0, nLEDsInStrip);
   stripParts[partNum].partup = partUp;
+  stripParts[partNum].circular = false;
+  stripParts[partNum].offset = 0;
+  SetPart_Decay(partNum, cPartNoDecay);
+  InvalidatePartPlans(partNum);
 }
 
-short LEDSegs::GetPart_Start(short ipart) {return stripParts[ipart].start;}
-void  LEDSegs::SetPart_Start(short ipart, short partstart) {stripParts[ipart].start = partstart;}
+short LEDSegsBase::GetPart_Start(short ipart) {return stripParts[ipart].start;}
+void  LEDSegsBase::SetPart_Start(short ipart, short partstart) {if (partstart != stripParts[ipart].start) {stripParts[ipart].start = partstart; InvalidatePartPlans(ipart);}}
+
+short LEDSegsBase::GetPart_Len(short ipart) {return stripParts[ipart].len;}
+void  LEDSegsBase::SetPart_Len(short ipart, short partlen) {if (partlen != stripParts[ipart].len) {stripParts[ipart].len = partlen; InvalidatePartPlans(ipart);}}
+
+bool LEDSegsBase::GetPart_Up(short ipart) {return stripParts[ipart].partup;}
+void LEDSegsBase::SetPart_Up(short ipart, bool up) {if (up != stripParts[ipart].partup) {stripParts[ipart].partup = up; InvalidatePartPlans(ipart);}}
 
-short LEDSegs::GetPart_Len(short ipart) {return stripParts[ipart].len;}
-void  LEDSegs::SetPart_Len(short ipart, short partlen) {stripParts[ipart].len = partlen;}
+bool LEDSegsBase::GetPart_Circular(short ipart) {return stripParts[ipart].circular;}
+void LEDSegsBase::SetPart_Circular(short ipart, bool circular) {if (circular != stripParts[ipart].circular) {stripParts[ipart].circular = circular; InvalidatePartPlans(ipart);}}
 
-bool LEDSegs::GetPart_Up(short ipart) {return stripParts[ipart].partup;}
-void LEDSegs::SetPart_Up(short ipart, bool up) {stripParts[ipart].partup = up;}
+//The offset is applied when the segments are written, so changing it doesn't recompile their plans
+short LEDSegsBase::GetPart_Offset(short ipart) {return stripParts[ipart].offset;}
+void  LEDSegsBase::SetPart_Offset(short ipart, short offset) {stripParts[ipart].offset = offset;}
+
+short LEDSegsBase::GetPart_Decay(short ipart) {return stripParts[ipart].decay;}
+void  LEDSegsBase::SetPart_Decay(short ipart, short decay) {
+  short i;
+  stripParts[ipart].decay = (decay < 0) ? cPartNoDecay : min(decay, (short) 255);
+  stripDecay = false;
+  for (i = 0; i < nMaxParts; i++) {if (stripParts[i].decay >= 0) stripDecay = true;}
+}
 
 /* Dead air detection public methods */
-bool LEDSegs::CheckForDeadAir(short secs) {return DeadAirSecondsCount >= secs;}
-void LEDSegs::DisableDeadAirDetect() {CancelTimer(DeadAirDetectTimerID);}
-void LEDSegs::EnableDeadAirDetect(short int level) {
+bool LEDSegsBase::CheckForDeadAir(short secs) {return DeadAirSecondsCount >= secs;}
+void LEDSegsBase::DisableDeadAirDetect() {CancelTimer(DeadAirDetectTimerID);}
+void LEDSegsBase::EnableDeadAirDetect(short int level) {
   DisableDeadAirDetect();
   DeadAirLevel = level * 3; //3 is the number of bands summed for the level
   DeadAirDetectTimerID = DefineTimer(1000, 1000, teCheckForDeadAir, this); 
 }
 
 //Called by TimedDisplay() timer routine on expiration
-void LEDSegs::teTimedDisplay(short int itimer, void *ptr) {((LEDSegs *) ptr)->DisplayStrip(true, true);}
+void LEDSegsBase::teTimedDisplay(short int itimer, void *ptr) {((LEDSegsBase *) ptr)->DisplayStrip(true, true);}
 
 //Initialize the parts array (all parts = entire strip with up order)
-void LEDSegs::ResetParts() {
+void LEDSegsBase::ResetParts() {
   short i;
-  for (i = 0; i < cMaxParts; i++) {
+  for (i = 0; i < nMaxParts; i++) {
     stripParts[i].start = 0;
     stripParts[i].len = nLEDsInStrip;
     stripParts[i].partup = true;
+    stripParts[i].circular = false;
+    stripParts[i].offset = 0;
+    stripParts[i].decay = cPartNoDecay;
+  }
+  stripDecay = false;
+  for (i = 0; i < nMaxSegments; i++) {InvalidatePlan(i);}
+  stripCullValid = false;
+}
+
+//Force the render plans of all segments in a part to be recompiled (the part's geometry changed)
+void LEDSegsBase::InvalidatePartPlans(short ipart) {
+  short ipos, iseg;
+  for (ipos = 0; ipos < segNumActive; ipos++) {
+    iseg = segActive[ipos];
+    if (SegmentData[iseg].segPart == ipart) InvalidatePlan(iseg);
   }
+  stripCullValid = false;
 }
 
-//Called on dead air timer expiration every second. We sum selected bands' maxes to check for signal.
+//Called on dead air timer expiration every second. We sum selected bands' maxes to check for signal:
+//the second to fourth sevenths of the bands (the shield's bands 2..4), scaled to a sum of three bands.
 //ptr is the timer pointer, which is set to the "this" pointer for the segment class instance.
-void LEDSegs::teCheckForDeadAir(short itimer, void *ptr) {
-  short SumOfMax, iband;
-  LEDSegs *segsptr = (LEDSegs *) ptr;
+void LEDSegsBase::teCheckForDeadAir(short itimer, void *ptr) {
+  short iband, firstBand, lastBand;
+  long SumOfMax;
+  LEDSegsBase *segsptr = (LEDSegsBase *) ptr;
+  firstBand = segsptr->stripNumBands / cSegNumBands;
+  lastBand = max(4 * segsptr->stripNumBands / cSegNumBands, firstBand + 1);
   SumOfMax = 0;
-  for (iband = 1; iband <= 3; iband++) {SumOfMax += segsptr->SpectrumMax[iband]; segsptr->SpectrumMax[iband] = 0;}
+  for (iband = firstBand; iband < lastBand; iband++) {SumOfMax += segsptr->SpectrumMax[iband]; segsptr->SpectrumMax[iband] = 0;}
+  SumOfMax = SumOfMax * 3 / (lastBand - firstBand);
   if (SumOfMax <= segsptr->DeadAirLevel) segsptr->DeadAirSecondsCount++; else segsptr->DeadAirSecondsCount = 0;
 }
     
-//Constructor and destructor
-LEDSegs::LEDSegs(short nLEDs) {
-  LEDSegsInit(nLEDs, true, 0, 0); //Constructor with default data/clock
-}
-LEDSegs::LEDSegs(short nLEDs, short pinData, short pinClock) {
-  LEDSegsInit(nLEDs, false, pinData, pinClock); //Constructor with explicit data/clock
-}
-
-LEDSegs::~LEDSegs() {
-  delete[] objLPDStrip;
+//Destructor. (The LEDSegsT constructors attach the storage and call LEDSegsInit.)
+LEDSegsBase::~LEDSegsBase() {
+  short i;
+  for (i = 0; i < cMaxRescaleTables; i++) {if (rescaleTables[i].levels != NULL) free(rescaleTables[i].levels);}
+  for (i = 1; i <= cMaxRandomTables; i++) {if (randomTables[i].levels != NULL) free(randomTables[i].levels);}
+  delete objLPDStrip;
 }
 
 /*
@@ -1091,15 +2023,41 @@ ____________
 LEDSegsInit:Common constructor code
 */
 
-void LEDSegs::LEDSegsInit(short nLEDs, bool useSPI, short pinData, short pinClock) {
+void LEDSegsBase::LEDSegsInit(short nLEDs, bool useSPI, short pinData, short pinClock) {
   short i;
   
-  //Create an LED strip object. Either SPI or digital pins
+  //Create an LED strip object. Either SPI or digital pins. A fixed-size LEDSegsT has its own pixel
+  //buffer (stripPixels), which limits the strip length.
 
-  if (useSPI) objLPDStrip = new LPD8806(nLEDs);
-  else objLPDStrip = new LPD8806(nLEDs, pinData, pinClock);
+  if (nMaxLEDs > 0) nLEDs = constrain(nLEDs, 0, nMaxLEDs);
+  objLPDStrip = new LPD8806();
+  if (! useSPI) objLPDStrip->updatePins(pinData, pinClock);
+  objLPDStrip->updateLength(nLEDs, stripPixels);
 
   nLEDsInStrip = nLEDs;
+#if defined LEDSEGS_STATS
+  stripDisplayPeriodMS = 0;
+#endif
+  stripGenericRuns = false;
+  spectrumSource = NULL;
+  spectrumSourcePtr = NULL;
+  stripNumBands = cSegNumBands;
+  stripBandsMask = BandRange(0, cSegNumBands - 1);
+  for (i = 0; i < nMaxSegments; i++) {
+    SegRescale[i] = cRescaleNone;
+    SegmentData[i].segRandomTable = 0;
+#if cFixedPointCache
+    SegMaxRecipFor[i] = 0;
+#endif
+  }
+  for (i = 0; i < cMaxRescaleTables; i++) {rescaleTables[i].refs = 0; rescaleTables[i].levels = NULL;}
+  randomTables[0].length = cSegNRandom;
+  randomTables[0].levels = segRandomLevels;
+  randomTables[0].sorted = segRandomSorted;
+  for (i = 1; i <= cMaxRandomTables; i++) {randomTables[i].length = randomTables[i].refs = 0; randomTables[i].levels = NULL;}
+#if defined LEDSEGS_STATS
+  ResetStats();
+#endif
 
   //Setup pins to drive the spectrum analyzer.
 
@@ -1128,30 +2086,24 @@ Set the properties of the current LED segment. Return value is the segment index
 This routine sets the current segment index.
 */
 
-short LEDSegs::DefineSegment(short FirstLED, short nLEDs, short Action, uint32_t ForeColor, short Bands, short PartIndex) {
+short LEDSegsBase::DefineSegment(short FirstLED, short nLEDs, short Action, uint32_t ForeColor, LEDBandMask Bands, short PartIndex) {
 
-  short int i, iseg;
+  short int iseg;
   
-  //Loop all segment slots starting with the current, to find the first available (indicated by -1 length and no action).
-  //We do it this way so if somebody wants to define a particular segment index then just call SetSegmentIndex(n)
-  //before calling DefineSegment(...).
+  //Find the first free slot starting with the current one and looping around. We do it this way so if
+  //somebody wants to define a particular segment index then just call SetSegmentIndex(n) before calling
+  //DefineSegment(...).
   
-  for (i = 0; i < cMaxSegments; i++) {
-    iseg = i + segCurrentIndex;
-    if (iseg >= cMaxSegments) iseg = iseg - cMaxSegments;
-    if ((SegmentData[iseg].segNumLEDs < 0) && (SegmentData[iseg].segAction == cSegActionNone)) break;
-  }
+  iseg = FindFreeSegment(max(segCurrentIndex, 0));
 
   //If none available, return -1, and set iseg to be new current segment index
-  if (i >= cMaxSegments) {return(segCurrentIndex = -1);}
+  if (iseg < 0) {return(segCurrentIndex = -1);}
   segCurrentIndex = iseg;
-
-  //Track the highest segment index defined. This speeds the refresh loop a bit esp. if cMaxSegments is big.
-  segMaxDefinedIndex = max(segMaxDefinedIndex, segCurrentIndex);
+  ActivateSegment(iseg);
   
   //Set the segment properties passed in
 
-  SetSegment_Part(constrain(PartIndex, 0, cMaxParts - 1));
+  SetSegment_Part(constrain(PartIndex, 0, nMaxParts - 1));
   SetSegment_FirstLED(FirstLED);
   SetSegment_NumLEDs(nLEDs);
   SetSegment_Action(Action);
@@ -1163,11 +2115,15 @@ short LEDSegs::DefineSegment(short FirstLED, short nLEDs, short Action, uint32_t
   SetSegment_Spacing(0);
   SetSegment_Options(0);
   SetSegment_DisplayRoutine(NULL);
-  SetSegment_BitsPtr(NULL);
+  SetSegment_BitsPtr((const uint8_t *) NULL);
+  SetSegment_BitsOffset(0);
+  SetSegment_Blend(cSegBlendNone);
+  SetSegment_Opacity(255);
+  SetSegment_RandomLength(cSegNRandom);
   SetSegment_RandomPattern(0);
   SetSegment_Persistence(0, 0);
-  SegmentData[iseg].segRescaleAry = NULL;
-  SegmentData[iseg].segLevel = 0;
+  SetSegment_Rescale(NULL);
+  SegLevel[iseg] = 0;
   
   //Return the segment index that was defined
   return segCurrentIndex;
@@ -1178,10 +2134,15 @@ LEDSegs::DisplayStrip
 Sample and display according to the defined segments
 */
 
-void LEDSegs::DisplayStrip(bool doLeft, bool doRight) {
+void LEDSegsBase::DisplayStrip(bool doLeft, bool doRight) {
+  _LEDSEGS_STAT_START(tFrame);
   ReadSpectrum(doLeft, doRight);
+  _LEDSEGS_STAT_END(cStatReadSpectrum, tFrame);
+  _LEDSEGS_STAT_START(tMap);
   MapBandsToSegments();
+  _LEDSEGS_STAT_END(cStatMapBands, tMap);
   ShowSegments();
+  _LEDSEGS_STAT_END(cStatFrame, tFrame);
 };
 
 /*_________________________
@@ -1190,91 +2151,102 @@ Convert spectrum band samples into LED strip segment values in the range 0..(#-L
 We average all the bands defined for the segment, and then scale the final segment value
 */
 
-void LEDSegs::MapBandsToSegments() {
-  short iSegment, iBand, segBands, numbands, scaledTotal, maxTotal;
-  short iscale, peak1, peak2, out1, out2, nscalemax;
-  long sampleTotal;
-  const short int *rescaleary;
+void LEDSegsBase::MapBandsToSegments() {
+  short ipos, iSegment, scaledTotal, maxTotal, itable;
+  LEDBandMask segBands;
+  const short *levels;
+  uint32_t recip, quotient;
   bool useBandMax;
   long int dividend, persist, lastlevel;
 
+  //New spectrum sample: forget last frame's band aggregates
+  bandAggValid[0] = bandAggValid[1] = 0;
+
   //Loop all defined segments to calculate the normalized band value. We do this even for ActionNone
   //in case a segment display routine wants to change the action
 
-  for (iSegment = 0; iSegment <= segMaxDefinedIndex; iSegment++) {
-    if (SegmentData[iSegment].segNumLEDs >= 0) {
-      segBands = SegmentData[iSegment].segBands;
-      useBandMax = ! (SegmentData[iSegment].segOptions & cSegOptBandAvg);
+  for (ipos = 0; ipos < segNumActive; ipos++) {
+    iSegment = segActive[ipos];
+    if (SegNumLEDs[iSegment] >= 0) {
+      segBands = SegBands[iSegment];
+      useBandMax = ! (SegOptions[iSegment] & cSegOptBandAvg);
     
-      //Loop all bands in the segment to accumulate the sample total and the max levels
-
-      sampleTotal = 0;
-      numbands = 0;
-
 #if defined DIAGSEGS
     Serial.print("Values for Seg. "); Serial.print(iSegment); Serial.print("  ");
-    Serial.print("Prev.Max="); Serial.print(SegmentData[iSegment].segMaxLevel); Serial.print(", ");
+    Serial.print("Prev.Max="); Serial.print(SegMaxLevel[iSegment]); Serial.print(", ");
 #endif
 
-      for (iBand = 0; iBand < cSegNumBands; iBand++) {
-        if ((segBands >> iBand) & 1) {
-          numbands++;
-          if (useBandMax) {sampleTotal = max(sampleTotal, SpectrumLevel[iBand]);}
-          else {sampleTotal += SpectrumLevel[iBand];}
-        }
-      }
-      if (numbands == 0) numbands = 1; //Safety
-    
-      //Average by number of bands, or if using BandMax option then use sample total
-      scaledTotal = useBandMax ? sampleTotal : sampleTotal / numbands;
+      //Max or average of the segment's bands (shared by all segments with the same bands)
+      scaledTotal = BandAggregate(segBands, useBandMax);
 
       //Compute max and record in segment
-      maxTotal = SegmentData[iSegment].segMaxLevel;
+      maxTotal = SegMaxLevel[iSegment];
       maxTotal = maxTotal - stripMaxLevelDecay;
       if (maxTotal < stripMaxLevelFloor) maxTotal = stripMaxLevelFloor;
       if (maxTotal <= scaledTotal) maxTotal = scaledTotal;
-      SegmentData[iSegment].segMaxLevel = maxTotal;
+      SegMaxLevel[iSegment] = maxTotal;
 
 #if defined DIAGSEGS
-Serial.print("Total="); Serial.print(sampleTotal); Serial.print(",");
-Serial.print("Scaled="); Serial.print(scaledTotal); Serial.print(",");
-Serial.print("Max="); Serial.print(SegmentData[iSegment].segMaxLevel); Serial.print(",");
+Serial.print("Bands="); Serial.print(scaledTotal); Serial.print(",");
+Serial.print("Max="); Serial.print(SegMaxLevel[iSegment]); Serial.print(",");
 #endif
 
       //Scale level to [0..1022] based on max. We only allow scaling up to 1022. This allows
       //an action routine to detect clipping when the raw value is 1023
       if (scaledTotal < cMaxSegmentLevel) {
-        scaledTotal = ((long) (scaledTotal * cMaxSegmentLevel)) / ((long) maxTotal);
+#if cFixedPointCache
+        if (stripFixedPoint) {
+          //Exact: scaledTotal <= maxTotal <= 1023, so the reciprocal's error stays under one part in 2^20
+          if (SegMaxRecipFor[iSegment] != maxTotal) {
+            SegMaxRecip[iSegment] = (((uint32_t) cMaxSegmentLevel << 20) + maxTotal - 1) / maxTotal;
+            SegMaxRecipFor[iSegment] = maxTotal;
+          }
+          scaledTotal = ((uint32_t) scaledTotal * SegMaxRecip[iSegment]) >> 20;
+        }
+        else
+#endif
+        scaledTotal = ((long) scaledTotal * cMaxSegmentLevel) / ((long) maxTotal);
 #if defined DIAGSEGS
       Serial.print("Normalized="); Serial.print(scaledTotal); Serial.print(",");
 #endif        
-        //If a rescaling array, do that now
-        rescaleary = SegmentData[iSegment].segRescaleAry;
-        if (rescaleary != NULL) {
-          nscalemax = (2 * rescaleary[0]) + 1;
-          for (iscale = 1; iscale < nscalemax; iscale += 2) {if (rescaleary[iscale] > scaledTotal) break;}
-          if (iscale == 1) {peak1 = out1 = 0;}
-            else {peak1 = rescaleary[iscale-2]; out1 = rescaleary[iscale-1];}
-          if (iscale >= nscalemax) {peak2 = out2 = cMaxSegmentLevel;}
-            else {peak2 = rescaleary[iscale]; out2 = rescaleary[iscale+1];}
-          scaledTotal = out1 + (((long) (out2 - out1) * (long) (scaledTotal - peak1)) / (long) (peak2 - peak1));
-
-          //Limit scaled value to 1022
-          if (scaledTotal >= cMaxSegmentLevel) scaledTotal = cMaxSegmentLevel - 1;
+        //If a rescaling array, do that now: a table lookup if it was compiled, else the slow way
+        itable = SegRescale[iSegment];
+        if (itable >= 0) {
+          levels = rescaleTables[itable].levels;
+#if cRescaleTableShift == 0
+          scaledTotal = levels[scaledTotal];
+#else
+          short ilevel = scaledTotal >> cRescaleTableShift;
+          scaledTotal = levels[ilevel] + (((long) (levels[ilevel + 1] - levels[ilevel]) *
+                        (scaledTotal & ((1 << cRescaleTableShift) - 1))) >> cRescaleTableShift);
+#endif
+        }
+        else if (itable == cRescaleUncompiled) {
+          scaledTotal = RescaleLevel(SegmentData[iSegment].segRescaleAry, scaledTotal);
         }
       }
 
       //If we have persistence, do that calc. Note that .segLevel must still be set to the prior level
-      lastlevel = SegmentData[iSegment].segLevel;
-      persist = scaledTotal < lastlevel ? SegmentData[iSegment].segPersistDown : SegmentData[iSegment].segPersistUp;      
+      lastlevel = SegLevel[iSegment];
+      persist = scaledTotal < lastlevel ? SegPersistDown[iSegment] : SegPersistUp[iSegment];
       if (persist > 0) {
-        dividend = persist * SegmentData[iSegment].segLevel; //(actually still last level)
-        dividend = dividend + (scaledTotal * cMaxSegmentLevel);
+        dividend = persist * SegLevel[iSegment]; //(actually still last level)
+        dividend = dividend + ((long) scaledTotal * cMaxSegmentLevel);
+#if cFixedPointCache
+        if (stripFixedPoint && (dividend >= 0)) {
+          //The reciprocal estimate is low by at most (persist + 1023) / 4096, so step up to the exact quotient
+          recip = scaledTotal < lastlevel ? SegPersistDownRecip[iSegment] : SegPersistUpRecip[iSegment];
+          quotient = ((uint32_t) dividend * recip) >> 22;
+          while ((long) (quotient + 1) * (persist + cMaxSegmentLevel) <= dividend) quotient++;
+          scaledTotal = quotient;
+        }
+        else
+#endif
         scaledTotal = dividend / (persist + cMaxSegmentLevel);
       }
       
       //Record final scaled level for segment
-      SegmentData[iSegment].segLevel = scaledTotal;      
+      SegLevel[iSegment] = scaledTotal;      
       
 #if defined DIAGSEGS
     if ((scaledTotal < 0) || (scaledTotal > cMaxSegmentLevel)) {Serial.print(" OUT OF RANGE! ");} else {Serial.print("Final=");}
@@ -1288,16 +2260,43 @@ Serial.print("Max="); Serial.print(SegmentData[iSegment].segMaxLevel); Serial.pr
 
 /*___________________
 LEDSegs::ReadSpectrum
-Read the spectrum band samples into class array SpectrumLevel[].
-"Channels" tells whether to read left, right, or average both channels.
+Read the spectrum band samples into class array SpectrumLevel[] from the spectrum source (the shield
+unless SetSpectrumSource() gave another) and update SpectrumMax[].
+"Channels" tells whether to read left, right, or the max of both channels.
+*/
+void LEDSegsBase::ReadSpectrum(bool doLeft, bool doRight) {
+  short iBand;
+
+  if (spectrumSource) spectrumSource(SpectrumLevel, doLeft, doRight, spectrumSourcePtr);
+  else ReadShieldSpectrum(SpectrumLevel, doLeft, doRight, NULL);
+
+  //Sources other than the shield are not trusted to stay in range
+  for (iBand = 0; iBand < stripNumBands; iBand++) {
+    SpectrumLevel[iBand] = constrain(SpectrumLevel[iBand], 0, cMaxBandLevel);
+    SpectrumMax[iBand] = max(SpectrumMax[iBand], SpectrumLevel[iBand]);
+  }
+
+#if defined DIAGSEGS
+  Serial.print("Bands (Cur/Max):");
+  for (iBand = 0; iBand < stripNumBands; iBand++) {
+    Serial.print(" "); Serial.print(SpectrumLevel[iBand]); Serial.print("/"); Serial.print(SpectrumMax[iBand]);
+  }
+  Serial.println();
+#endif
+}
+
+/*_________________________
+LEDSegs::ReadShieldSpectrum
+The default spectrum source: read the seven bands from the spectrum analyzer shield into levels[],
+less each band's noise floor. ptr is unused.
 */
-void LEDSegs::ReadSpectrum(bool doLeft, bool doRight) {
+void LEDSegsBase::ReadShieldSpectrum(short *levels, bool doLeft, bool doRight, void *) {
   short iBand, thisLevel;
   short leftLevel, rightLevel;
   
 #if defined DIAGSEGS
   Serial.println();
-  Serial.print("Bands: (L/R/Cur/Max):");
+  Serial.print("Bands: (L/R):");
 #endif
 
   //This loop happens nBands times per sample. It just records the current sample values
@@ -1314,7 +2313,7 @@ void LEDSegs::ReadSpectrum(bool doLeft, bool doRight) {
     Serial.print(" ");
     Serial.print(iBand); Serial.print("=(");
     Serial.print(leftLevel); Serial.print(",");
-    Serial.print(rightLevel); Serial.print(",");
+    Serial.print(rightLevel); Serial.print(")");
 #endif
 
     //Subtract out assumed noise floor for this band
@@ -1322,13 +2321,7 @@ void LEDSegs::ReadSpectrum(bool doLeft, bool doRight) {
     if (thisLevel < 0) thisLevel = 0;
 
     //Set current value for this band
-    SpectrumLevel[iBand] = thisLevel;
-    SpectrumMax[iBand] = max(SpectrumMax[iBand], thisLevel);
-
-#if defined DIAGSEGS
-    Serial.print(SpectrumLevel[iBand]); Serial.print(",");
-    Serial.print(SpectrumMax[iBand]); Serial.print(")");
-#endif
+    levels[iBand] = thisLevel;
 
     //Toggle to readout next band
     digitalWrite(cSpectrumStrobe, HIGH);
@@ -1339,82 +2332,288 @@ void LEDSegs::ReadSpectrum(bool doLeft, bool doRight) {
 #endif
 }
 
+/*___________________
+LEDSegs::RescaleLevel
+Remap a normalized level [0..1023] through a rescale array (see SetSegment_Rescale)
+*/
+
+short LEDSegsBase::RescaleLevel(const short int *rescaleary, short level) {
+  short iscale, peak1, peak2, out1, out2, nscalemax;
+
+  nscalemax = (2 * rescaleary[0]) + 1;
+  for (iscale = 1; iscale < nscalemax; iscale += 2) {if (rescaleary[iscale] > level) break;}
+  if (iscale == 1) {peak1 = out1 = 0;}
+    else {peak1 = rescaleary[iscale-2]; out1 = rescaleary[iscale-1];}
+  if (iscale >= nscalemax) {peak2 = out2 = cMaxSegmentLevel;}
+    else {peak2 = rescaleary[iscale]; out2 = rescaleary[iscale+1];}
+  if (peak2 == peak1) level = out1; //Last pair's input is 1023 and so is the level: avoid the divide by 0
+  else level = out1 + (((long) (out2 - out1) * (long) (level - peak1)) / (long) (peak2 - peak1));
+
+  //Limit scaled value to 1022
+  if (level >= cMaxSegmentLevel) level = cMaxSegmentLevel - 1;
+  return level;
+}
+
+/*__________________________
+LEDSegs::AcquireRescaleTable
+Find or compile the lookup table for a rescale array and take a reference to it. Arrays with the same
+contents share a table. Returns the table index, or -1 if there's no array, no free table slot or no
+memory, in which case MapBandsToSegments() falls back to RescaleLevel() every frame.
+*/
+
+short LEDSegsBase::AcquireRescaleTable(const short int *rescaleary) {
+  short i, ifree, nvals, level;
+  uint32_t hash;
+  short *levels;
+
+  if (rescaleary == NULL) return -1;
+
+  nvals = (2 * rescaleary[0]) + 1;
+  hash = 2166136261UL;
+  for (i = 0; i < nvals; i++) hash = (hash ^ (uint16_t) rescaleary[i]) * 16777619UL;
+
+  ifree = -1;
+  for (i = 0; i < cMaxRescaleTables; i++) {
+    if (rescaleTables[i].refs == 0) {if (ifree < 0) ifree = i;}
+    else if ((rescaleTables[i].srcHash == hash) && (rescaleTables[i].srcAry[0] == rescaleary[0]) &&
+             !memcmp(rescaleTables[i].srcAry, rescaleary, nvals * sizeof(short))) {
+      rescaleTables[i].refs++;
+      return i;
+    }
+  }
+  if (ifree < 0) return -1;
+
+  //Compile: table entry i is the rescaled value of input level i << cRescaleTableShift (the last
+  //entries are clamped to the top input level, 1023, so interpolation never reads past the end)
+  levels = rescaleTables[ifree].levels;
+  if (levels == NULL) levels = (short *) malloc(cRescaleTableLen * sizeof(short));
+  if (levels == NULL) return -1;
+  for (i = 0; i < cRescaleTableLen; i++) {
+    level = min((long) i << cRescaleTableShift, (long) cMaxSegmentLevel);
+    levels[i] = RescaleLevel(rescaleary, level);
+  }
+  rescaleTables[ifree].levels = levels;
+  rescaleTables[ifree].srcAry = rescaleary;
+  rescaleTables[ifree].srcHash = hash;
+  rescaleTables[ifree].refs = 1;
+  return ifree;
+}
+
+//Drop a segment's reference to a table (if it has one). The table memory is kept for reuse by the slot.
+void LEDSegsBase::ReleaseRescaleTable(short itable) {
+  if (itable >= 0) rescaleTables[itable].refs--;
+}
+
+/*____________________
+LEDSegs::BandAggregate
+The max (useBandMax) or average of the current SpectrumLevel[] over the bands in bandMask. Each
+mask/mode is computed once per frame; many segments usually share a handful of masks.
+*/
+
+short LEDSegsBase::BandAggregate(LEDBandMask bandMask, bool useBandMax) {
+  short iBand, numbands, imode, islot;
+  long sampleTotal;
+  uint32_t hash;
+  LEDBandMask bits;
+
+  bandMask &= stripBandsMask;
+  imode = useBandMax ? 0 : 1;
+  hash = (uint32_t) bandMask ^ (uint32_t) ((bandMask >> 16) >> 16);
+  islot = (short) ((uint32_t) (hash * 0x9E3779B1UL) >> 27);
+  if ((bandAggValid[imode] & (1UL << islot)) && (bandAggMask[imode][islot] == bandMask)) return bandAggLevel[imode][islot];
+
+  sampleTotal = 0;
+  numbands = 0;
+  for (iBand = 0, bits = bandMask; bits; iBand++, bits >>= 1) {
+    if (bits & 1) {
+      numbands++;
+      if (useBandMax) {sampleTotal = max(sampleTotal, SpectrumLevel[iBand]);}
+      else {sampleTotal += SpectrumLevel[iBand];}
+    }
+  }
+  if (numbands == 0) numbands = 1; //Safety
+
+  bandAggMask[imode][islot] = bandMask;
+  bandAggLevel[imode][islot] = useBandMax ? sampleTotal : sampleTotal / numbands;
+  bandAggValid[imode] |= 1UL << islot;
+  return bandAggLevel[imode][islot];
+}
+
 /*_________________
 LEDSegs::ResetStrip
 Reset the LED strip to initial state
 */
 
-void LEDSegs::ResetStrip() {
+void LEDSegsBase::ResetStrip() {
   short iband;
   ResetSegments();
   segCurrentIndex = 0;
   ResetParts();
   stripMaxLevelDecay = 1;
   stripMaxLevelFloor = cMaxSegmentLevel;
+  stripFixedPoint = cFixedPointLevels && cFixedPointCache;
+  stripCulling = (cMaxCullSpans > 0);
+  stripCullValid = false;
   ResetRandom(); //Init the random permutation array (for cSegActionRandom)
   DeadAirDetectTimerID = -1;
-  for (iband = 0; iband < cSegNumBands; iband++) {SpectrumMax[iband] = 0;} //Reset band maxes
+  for (iband = 0; iband < cMaxBands; iband++) {SpectrumMax[iband] = 0;} //Reset band maxes
   objLPDStrip->begin(); //Clear and init the strip
   objLPDStrip->show();  //Update the LED strip display to display all off to start
 }
 
+/*_______________________
+LEDSegs::SetStripTransfer
+Send each frame to the strip in one call to fn (see Strip Output, above). NULL restores the per-byte path.
+*/
+
+void LEDSegsBase::SetStripTransfer(LPD8806TransferRoutine fn, void *ptr) {objLPDStrip->setTransfer(fn, ptr);}
+
+/*____________________________
+LEDSegs::SetStripSkipUnchanged
+Don't send frames identical to the last one sent, but resend after maxSkip skips in a row. 0 = off.
+*/
+
+void LEDSegsBase::SetStripSkipUnchanged(unsigned short maxSkip) {objLPDStrip->setSkipUnchanged(maxSkip);}
+
+/*________________________
+LEDSegs::SetSpectrumSource
+Take the band levels from fn instead of the spectrum analyzer shield (see Spectrum Sources, above).
+NULL goes back to the shield.
+*/
+
+void LEDSegsBase::SetSpectrumSource(SpectrumSourceRoutine fn, void *ptr) {SetSpectrumSource(fn, ptr, cSegNumBands);}
+
+//nBands: the number of bands fn fills in (the shield's cSegNumBands if fn is NULL)
+void LEDSegsBase::SetSpectrumSource(SpectrumSourceRoutine fn, void *ptr, short nBands) {
+  short iband;
+  spectrumSource = fn;
+  spectrumSourcePtr = ptr;
+  stripNumBands = fn ? constrain(nBands, 1, cMaxBands) : cSegNumBands;
+  stripBandsMask = BandRange(0, stripNumBands - 1);
+  for (iband = 0; iband < cMaxBands; iband++) {SpectrumLevel[iband] = 0; SpectrumMax[iband] = 0;}
+}
+
+short LEDSegsBase::GetSpectrumBands() {return stripNumBands;}
+
+/*________________
+LEDSegs::BandRange
+The band mask (for DefineSegment and SetSegment_Bands) selecting bands firstBand..lastBand (0-origin).
+*/
+
+LEDBandMask LEDSegsBase::BandRange(short firstBand, short lastBand) {
+  LEDBandMask mask = 0;
+  firstBand = max(firstBand, 0);
+  lastBand = min(lastBand, cMaxBands - 1);
+  for (; lastBand >= firstBand; lastBand--) mask |= (LEDBandMask) 1 << lastBand;
+  return mask;
+}
+
+/*____________________________
+LEDSegs::SetStripAsyncTransfer
+Double-buffered background output: start begins sending a frame, wait blocks until it is out.
+*/
+
+void LEDSegsBase::SetStripAsyncTransfer(LPD8806TransferRoutine start, LPD8806WaitRoutine wait, void *ptr) {
+  objLPDStrip->setAsyncTransfer(start, wait, ptr);
+}
+
 /*___________________
 LEDSegs::ShowSegments
-Display the segment values on the LED strip. You're in for a hairy ride...
+Display the segment values on the LED strip: run the display routines, write the segments into
+the strip's pixel buffer, then refresh the strip.
 */
 
-void LEDSegs::ShowSegments() {
-  short    iSegment, iLEDinSegment, iLED, LEDIncrement, segval;
-  short    partStart, partLen, partEnd;
-  short    segFirstLED, segNumLEDs, segRandomPattern;
-  short    Action, Options, segSpacing1, SpacingCount;
-  bool     optOffOverwrite, optModulate, notSpacingLED, partUp;
-  uint32_t thisColor, backColor, foreColor;
-  byte     bcRGB[3], fcRGB[3];
-  stripSegment *segptr;
-  uint32_t (*bitsary);
-  short bitscounter;
-  static uint32_t zerobits = 0;
+void LEDSegsBase::ShowSegments() {
+  _LEDSEGS_STAT_START(tRoutines);
+  RunDisplayRoutines();
+  _LEDSEGS_STAT_END(cStatDisplayRoutines, tRoutines);
+  _LEDSEGS_STAT_START(tWrite);
+  WriteSegments();
+  _LEDSEGS_STAT_END(cStatWriteSegments, tWrite);
+
+  //Finally, refresh the strip.
+  _LEDSEGS_STAT_START(tShow);
+  objLPDStrip->show();
+  _LEDSEGS_STAT_END(cStatShow, tShow);
+}
+
+/*_________________________
+LEDSegs::RunDisplayRoutines
+Call any segment display routines that are defined
+*/
+
+void LEDSegsBase::RunDisplayRoutines() {
+  short ipos, iSegment;
   SegmentDisplayRoutine routine;
-  
-  //Call any defined segment display routines that are defined
 
-  for (iSegment = 0; iSegment <= segMaxDefinedIndex; iSegment++) {
+  for (ipos = 0; ipos < segNumActive; ipos++) {
+    iSegment = segActive[ipos];
     routine = SegmentData[iSegment].segDisplayRoutine;
-    if (routine != NULL) routine(iSegment);
+    if (routine != NULL) {
+      _LEDSEGS_STAT_START(tRoutine);
+      routine(iSegment);
+      _LEDSEGS_STAT_SEGMENT_END(iSegment, tRoutine);
+      //The routine may have defined or reset segments: carry on with the next index after this one
+      ipos = ActivePosition(iSegment + 1) - 1;
+    }
   };
+}
+
+/*____________________
+LEDSegs::WriteSegments
+Write the segment values into the strip's pixel buffer. The geometry of each segment (start,
+direction, spacing and cropping to its part) only changes when a SetSegment_xxx/SetPart_xxx call
+changes it, so it is resolved once into the segment's render plan (see CompileSegmentPlan) and
+each frame just lights the plan's LEDs according to the level.
+*/
 
-  //Init all LEDs in the strip to off
-  for (iLED = 0; iLED < nLEDsInStrip; iLED++) {objLPDStrip->setPixelColor(iLED, RGBOff);}
+void LEDSegsBase::WriteSegments() {
+  short    ipos, iSegment, irun, segval;
+  short    segNumLEDs, Action, Options;
+  bool     optOffOverwrite, optModulate, offsets, culled;
+  uint32_t backColor, foreColor;
+  byte     bcRGB[3], fcRGB[3];
+  uint8_t  *pixels;
+  stripSegment *segptr;
+  SegmentPlan *plan;
+
+  //Init all LEDs in the strip to off, or to the last frame faded (culling leaves out the ones opaque segments
+  //will overwrite anyway)
+#if cMaxCullSpans > 0
+  if (stripCulling) CullSegments();
+  else
+#endif
+  if (stripDecay) FadeLEDs(0, objLPDStrip->numPixels());
+  else objLPDStrip->clear();
+
+  //Runs are written by the specialized kernels unless the strip buffer doesn't match the strip
+  //length (failed allocation) or the generic loop was asked for
+  pixels = objLPDStrip->getPixels();
+  if (stripGenericRuns || (objLPDStrip->numPixels() != nLEDsInStrip)) pixels = NULL;
 
   //Write defined segment in segment index order
-  for (iSegment = 0; iSegment <= segMaxDefinedIndex; iSegment++) {
+  for (ipos = 0; ipos < segNumActive; ipos++) {
 
-    segptr = &SegmentData[iSegment];
-    Action = segptr->segAction;
+    iSegment = segActive[ipos];
+    Action = SegAction[iSegment];
 
     //Process segment if it does something
 
     if (Action != cSegActionNone) {
+      segptr = &SegmentData[iSegment];
 
       /* Local vars for fast reference */
-      partStart =   stripParts[segptr->segPart].start;
-      partLen =     stripParts[segptr->segPart].len;
-      partEnd =     partStart + partLen - 1;
-      partUp =      stripParts[segptr->segPart].partup;
       backColor =   segptr->segBackColor;
       foreColor =   segptr->segForeColor;
-      segSpacing1 = segptr->segSpacing + 1;
-      segNumLEDs =  segptr->segNumLEDs;
-      segRandomPattern = segptr->segRandomPattern;
+      segNumLEDs =  SegNumLEDs[iSegment];
       
-      Options = segptr->segOptions;
+      Options = SegOptions[iSegment];
       optOffOverwrite = (Options & cSegOptNoOffOverwrite) == 0;
       optModulate = (Options & cSegOptModulateSegment) != 0;
       
       //The value coming out of MapBandsToSegments() is [0...1023]. Now we apply any scaling options...
       //When done, segval will contain the number of LEDs to illuminate for this segment.
-      segval = segptr->segLevel;
+      segval = SegLevel[iSegment];
 
       //Rescale final value to the number of LEDs that segval means for this segment's length
 
@@ -1424,10 +2623,10 @@ void LEDSegs::ShowSegments() {
       short diagval1, diagval2, diagval3, diagval4, diagval5;
       if ((segval < 0) || (segval > segNumLEDs)) {
         diagval1 = segNumLEDs;
-        diagval2 = SegmentData[iSegment].segLevel;
-        diagval3 = SegmentData[iSegment].segLevel * (segNumLEDs + 1);
+        diagval2 = SegLevel[iSegment];
+        diagval3 = SegLevel[iSegment] * (segNumLEDs + 1);
         diagval4 = cMaxSegmentLevel + 1;
-        diagval5 = (SegmentData[iSegment].segLevel * (segNumLEDs + 1)) / (cMaxSegmentLevel + 1);
+        diagval5 = (SegLevel[iSegment] * (segNumLEDs + 1)) / (cMaxSegmentLevel + 1);
         Serial.print("# LEDs out of range: "); Serial.print(segval); Serial.print(" of "); Serial.print(segNumLEDs);
         Serial.print(" (Diags: "); Serial.print(diagval1);
         Serial.print(", "); Serial.print(diagval2);
@@ -1437,7 +2636,7 @@ void LEDSegs::ShowSegments() {
         Serial.print(")");
         Serial.println("");
       }
-      Serial.print("SegmentLevel["); Serial.print(iSegment); Serial.print("]="); Serial.print(segptr->segLevel); Serial.print(" = ");
+      Serial.print("SegmentLevel["); Serial.print(iSegment); Serial.print("]="); Serial.print(SegLevel[iSegment]); Serial.print(" = ");
       Serial.print(segval); Serial.print(" of "); Serial.print(segNumLEDs); Serial.println(" LEDs");
 #endif
       segval = constrain(segval, 0, segNumLEDs); //Safety to keep in expected range
@@ -1445,148 +2644,1067 @@ void LEDSegs::ShowSegments() {
       //If this is a cSegModulateSegment option, then figure the foreground color scaled between
       //backcolor and forecolor according to the segment's spectrum level.
 
-      if (optModulate) {
+#if cFixedPointCache
+      if (optModulate && (segNumLEDs > 0) && stripFixedPoint) {
         Colorvals(backColor, bcRGB);
         Colorvals(foreColor, fcRGB);
-        foreColor = LEDSegs::Color(
+        foreColor = LEDSegsBase::Color(
+                      bcRGB[0] + ModulateStep(fcRGB[0] - bcRGB[0], segval, iSegment)
+                      , bcRGB[1] + ModulateStep(fcRGB[1] - bcRGB[1], segval, iSegment)
+                      , bcRGB[2] + ModulateStep(fcRGB[2] - bcRGB[2], segval, iSegment));
+      }
+      else
+#endif
+      if (optModulate && (segNumLEDs > 0)) {
+        Colorvals(backColor, bcRGB);
+        Colorvals(foreColor, fcRGB);
+        foreColor = LEDSegsBase::Color(
                       bcRGB[0] + (((fcRGB[0] - bcRGB[0]) * segval) / segNumLEDs)
                       , bcRGB[1] + (((fcRGB[1] - bcRGB[1]) * segval) / segNumLEDs)
                       , bcRGB[2] + (((fcRGB[2] - bcRGB[2]) * segval) / segNumLEDs));
       }
 
-      //Get the starting LED index (segFirstLED) for this segment based on the action. For
-      //parts that have a down direction, the start position for the segments is inverted
-      //within the part.
-
-      segFirstLED = segptr->segFirstLED + partStart; //default value
-      switch (Action) {
-        case cSegActionFromBottom:
-        case cSegActionRandom:
-        case cSegActionBits:
-        case cSegActionFromTop:
-          if (!partUp) segFirstLED = (partStart + partLen) - (segptr->segFirstLED + segNumLEDs);
-          break;
-        case cSegActionAll:
-        case cSegActionFromMiddle:
-          break;
+      //Bring the render plan up to date if the geometry changed, then light it
+
+      plan = ReadyPlan(iSegment);
+
+      //Runs in a circular part, or of a scrolled Bits segment, still need their offsets applied. Runs
+      //with hidden LEDs are written around them.
+      offsets = stripParts[segptr->segPart].circular || ((Action == cSegActionBits) && (segptr->segBitsOffset != 0));
+#if cMaxCullSpans > 0
+      culled = stripCulling && (segptr->cullCount > 0);
+#else
+      culled = false;
+#endif
+      for (irun = 0; irun < plan->numRuns; irun++) {
+#if cMaxCullSpans > 0
+        if (culled) WriteVisibleRun(iSegment, &plan->runs[irun], segval, foreColor, optOffOverwrite, pixels);
+        else
+#endif
+        if (offsets) WritePlanRun(iSegment, &plan->runs[irun], segval, foreColor, optOffOverwrite, pixels);
+        else if (pixels) WriteRunKernel(iSegment, &plan->runs[irun], segval, foreColor, optOffOverwrite, pixels);
+        else WriteRun(iSegment, &plan->runs[irun], segval, foreColor, optOffOverwrite);
+      }
+    } //If an action defined
+  }  //Segment loop
+}
+
+/*___________________
+LEDSegs::CullSegments
+Occlusion culling. A segment is opaque where it overwrites every LED of a run: an overwriting segment
+(no cSegOptNoOffOverwrite or blend mode) with an action, on an unspaced run. Anything an earlier segment writes there is
+overwritten, so going through the segments from the last drawn to the first, each segment's hidden LED
+ranges are the ones already covered by opaque runs; they're stored in cullSpans[] for WriteVisibleRun().
+Only the cCullMaxCover largest opaque ranges are tracked (forgetting one just culls less), and circular
+parts, whose LEDs move with the part offset, are left alone. Levels don't change any of this, so like the
+render plans it's only worked out again after the segments change. Each frame the strip is then cleared
+except where the opaque ranges will be written.
+*/
+
+#if cMaxCullSpans > 0
+//Add [lo..hi] to the ascending list of ncover disjoint ranges, merging the ones it overlaps or touches.
+//Past cCullMaxCover ranges, the shortest is dropped. Returns the new count. (cover has room for one extra.)
+static short AddCoverRange(short cover[][2], short ncover, short lo, short hi, short maxcover) {
+  short i, j, k, ismall;
+
+  for (i = 0; (i < ncover) && (cover[i][1] < lo - 1); i++);
+  for (j = i; (j < ncover) && (cover[j][0] <= hi + 1); j++) {
+    lo = min(lo, cover[j][0]);
+    hi = max(hi, cover[j][1]);
+  }
+  if (j != i + 1) {
+    memmove(&cover[i + 1], &cover[j], (ncover - j) * sizeof(cover[0]));
+    ncover += 1 - (j - i);
+  }
+  cover[i][0] = lo;
+  cover[i][1] = hi;
+
+  if (ncover > maxcover) {
+    ismall = 0;
+    for (k = 1; k < ncover; k++) {
+      if (cover[k][1] - cover[k][0] < cover[ismall][1] - cover[ismall][0]) ismall = k;
+    }
+    ncover--;
+    memmove(&cover[ismall], &cover[ismall + 1], (ncover - ismall) * sizeof(cover[0]));
+  }
+  return ncover;
+}
+
+void LEDSegsBase::CullSegments() {
+  short ipos, iSegment, irun, icover, nspans, lo, hi, runlo, runhi, spanlo, spanhi, Action;
+  stripSegment *segptr;
+  SegmentPlan *plan;
+  PlanRun *run;
+  bool opaque;
+
+  if (!stripCullValid) {
+    stripCullValid = true;
+    cullNumCover = 0;
+    nspans = 0;
+    for (ipos = segNumActive - 1; ipos >= 0; ipos--) {
+      iSegment = segActive[ipos];
+      segptr = &SegmentData[iSegment];
+      segptr->cullCount = 0;
+      Action = SegAction[iSegment];
+      if (Action == cSegActionNone) continue;
+      plan = ReadyPlan(iSegment);
+      if (stripParts[segptr->segPart].circular || (plan->numRuns == 0)) continue;
+
+      //The LEDs the segment spans
+      lo = nLEDsInStrip;
+      hi = -1;
+      for (irun = 0; irun < plan->numRuns; irun++) {
+        run = &plan->runs[irun];
+        runlo = run->firstLED;
+        runhi = run->firstLED + (run->count - 1) * run->step;
+        if (run->step < 0) {runlo = runhi; runhi = run->firstLED;}
+        lo = min(lo, runlo);
+        hi = max(hi, runhi);
       }
 
-      //Now figure the initial starting LED for the segment, and the initial increment to get to the
-      //next LED in sequence (+1, 0, -1)
-
-      LEDIncrement = 1;   //default value
-      iLED = segFirstLED; //default value
-      switch (Action) {
-        case cSegActionFromBottom:
-        case cSegActionRandom:
-          if (!partUp) {LEDIncrement = -1; iLED = segFirstLED + segNumLEDs - 1;}
-          break;
-        case cSegActionFromTop:
-          if (partUp) {LEDIncrement = -1; iLED = segFirstLED + segNumLEDs - 1;}
-          break;
-        case cSegActionAll:
-          break;
-        case cSegActionFromMiddle:
-          LEDIncrement = 0;
-          iLED = segFirstLED + ((segNumLEDs - 1) >> 1);
-          break;
-        case cSegActionBits:
-          if (!partUp) {LEDIncrement = -1; iLED = segFirstLED + segNumLEDs - 1;}
-          bitsary = segptr->segBitsPtr;
-          if (bitsary == NULL) bitsary = &zerobits;
-          bitscounter = 0;
-          break;
+      //Its hidden ranges
+      segptr->cullFirst = nspans;
+      for (icover = 0; icover < cullNumCover; icover++) {
+        spanlo = max(lo, cullCover[icover][0]);
+        spanhi = min(hi, cullCover[icover][1]);
+        if (spanlo > spanhi) continue;
+        if (nspans >= cMaxCullSpans) {segptr->cullCount = 0; nspans = segptr->cullFirst; break;}
+        cullSpans[nspans][0] = spanlo;
+        cullSpans[nspans][1] = spanhi;
+        nspans++;
+        segptr->cullCount++;
       }
 
-#if defined DIAGSEGS
-  Serial.print("iLED="); Serial.print(iLED);
-  Serial.print(", LEDInc="); Serial.print(LEDIncrement);
-  Serial.print(", segFirstLED="); Serial.print(segFirstLED);
-  Serial.print(", segNumLEDs="); Serial.print(segNumLEDs);
-  Serial.println();
+      //What it hides
+      opaque = ((SegOptions[iSegment] & cSegOptNoOffOverwrite) == 0) && (SegBlend(segptr) == cSegBlendNone) &&
+               (Action > cSegActionNone) && (Action <= cSegActionBits);
+      for (irun = 0; opaque && (irun < plan->numRuns); irun++) {
+        run = &plan->runs[irun];
+        if (abs(run->step) != 1) continue;
+        runlo = (run->step > 0) ? run->firstLED : run->firstLED - run->count + 1;
+        cullNumCover = AddCoverRange(cullCover, cullNumCover, runlo, runlo + run->count - 1, cCullMaxCover);
+      }
+    }
+  }
+
+  //Clear (or fade) the LEDs in between
+  lo = 0;
+  for (icover = 0; icover < cullNumCover; icover++) {
+    FadeLEDs(lo, cullCover[icover][0] - lo);
+    lo = cullCover[icover][1] + 1;
+  }
+  FadeLEDs(lo, objLPDStrip->numPixels() - lo);
+}
 #endif
 
-      //This counts down from spacing-1 each time it hits 0 (an illuminated LED).
-      //The first LED is always a non-spacer, which is why we init to zero.
+/*_______________
+LEDSegs::FadeLEDs
+Start count LEDs from first for a new frame: off, or with parts given a decay (SetPart_Decay), the last
+frame's colors faded. An LED fades by the decay of the highest-numbered part with one that contains it, and
+is cleared if there's none. Each stretch of LEDs with the same decay is one pass of FadeBytes().
+*/
+
+//Scale n bytes (7-bit color values | 0x80) by keep / 256
+static void FadeBytes(uint8_t *p, short n, short keep) {
+  short i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128(), mask7 = _mm_set1_epi8(0x7F), bit7 = _mm_set1_epi8((char) 0x80);
+  const __m128i vkeep = _mm_set1_epi16(keep);
+  __m128i v, lo, hi;
+
+  for (; i + 16 <= n; i += 16) {
+    v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (p + i)), mask7);
+    lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), vkeep), 8);
+    hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), vkeep), 8);
+    _mm_storeu_si128((__m128i *) (p + i), _mm_or_si128(_mm_packus_epi16(lo, hi), bit7));
+  }
+#endif
+  for (; i < n; i++) p[i] = (((uint16_t) (p[i] & 0x7F) * keep) >> 8) | 0x80;
+}
+
+void LEDSegsBase::FadeLEDs(short first, short count) {
+  uint8_t *pixels;
+  short x, end, next, ipart, decay, partEnd;
+  Parts *part;
+
+  if (!stripDecay) {objLPDStrip->fillPixelColor(first, count, RGBOff); return;}
+  end = min((short) (first + count), (short) objLPDStrip->numPixels());
+  if (first >= end) return;
+  pixels = objLPDStrip->getPixels();
+
+  //Find the decay at x and the next LED where it could change: the start of a later part with a decay, or the end
+  //of one containing x
+  for (x = first; x < end; x = next) {
+    decay = cPartNoDecay;
+    next = end;
+    for (ipart = nMaxParts - 1; ipart >= 0; ipart--) {
+      part = &stripParts[ipart];
+      if ((part->decay < 0) || (part->len <= 0)) continue;
+      partEnd = part->start + part->len;
+      if (part->start > x) next = min(next, part->start);
+      else if (partEnd > x) {
+        next = min(next, partEnd);
+        if (decay < 0) decay = part->decay;
+      }
+    }
+    if (decay < 0) memset(pixels + 3 * x, 0x80, 3 * (next - x));
+    else if (decay > 0) FadeBytes(pixels + 3 * x, 3 * (next - x), 256 - decay);
+  }
+}
+
+/*_________________________
+LEDSegs::CompileSegmentPlan
+Resolve a segment's geometry into its render plan: the LEDs the segment can write, as runs of
+evenly-stepped LEDs already cropped to the segment's part (and the strip). Each run entry also
+carries its position in the segment's fill order (iLEDinSegment, which the level is compared
+against) and its bit number for cSegActionBits.
+
+FromMiddle segments fill in the order c, c+1, c-1, c+2, c-2... from the center c (fill order 2m-1 for
+c+m and 2m for c-m). With s = spacing + 1, only every s'th LED out on each side is lit: c - k*s (fill
+order 2k*s) and c + k*s, k > 0 (fill order 2k*s - 1). So they compile to two runs stepping away from the
+center, whose fill order advances by 2*s per LED.
+
+In a circular part the runs aren't cropped to the part. Their first LED is wrapped into the part and they
+keep at most one lap of entries; WritePlanRun() rotates them by the part's offset and crops them to the
+strip on each write.
+*/
 
-      SpacingCount = 0;
+//Find the entries j in [0..count-1] of first + j*stride that fall in [lo..hi]. Returns jfirst > jlast if none.
+static void ClipPlanEntries(short first, short stride, short count, short lo, short hi, short &jfirst, short &jlast) {
+  long a, b;
 
-      //Loop across the LEDs in the segment being illuminated.
+  if (stride > 0) {a = (long) lo - first; b = (long) hi - first;}
+  else {a = (long) first - hi; b = (long) first - lo; stride = -stride;}
+  jfirst = (a <= 0) ? 0 : (short) min((a + stride - 1) / stride, (long) count);
+  jlast = (b < 0) ? -1 : (short) min(b / stride, (long) (count - 1));
+}
 
-      for (iLEDinSegment = 0; iLEDinSegment < segNumLEDs; iLEDinSegment++) {
+void LEDSegsBase::CompileSegmentPlan(short iSegment) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  SegmentPlan *plan = Plan(iSegment);
+  Parts *part = &stripParts[segptr->segPart];
+  short partStart, segFirstLED, segNumLEDs, segSpacing1, center;
+  short firstLED, LEDIncrement;
+
+  partStart =   part->start;
+  segNumLEDs =  SegNumLEDs[iSegment];
+  segSpacing1 = segptr->segSpacing + 1;
+
+  plan->valid = (cSegPlanCache != 0);
+  plan->numRuns = 0;
+  plan->ordStep = segSpacing1;
+  plan->bitsWidth = 0;
+  if (segNumLEDs <= 0) return;
+
+  //FromMiddle: the low run from the center down, then the high run from one spacing above it up. (The
+  //part's direction doesn't change a FromMiddle segment.)
+
+  if (SegAction[iSegment] == cSegActionFromMiddle) {
+    center = segptr->segFirstLED + partStart + ((segNumLEDs - 1) >> 1);
+    plan->ordStep = 2 * segSpacing1;
+    AddPlanRun(iSegment, center, -segSpacing1, (segNumLEDs + (2 * segSpacing1) - 1) / (2 * segSpacing1), 0);
+    AddPlanRun(iSegment, center + segSpacing1, segSpacing1, segNumLEDs / (2 * segSpacing1), (2 * segSpacing1) - 1);
+    return;
+  }
 
-        //If the LED is outside the segment's part range, or a spacing-skipped LED,
-        //then we don't process the display for it (this is the "cropping")
+  //Get the starting LED index (segFirstLED) for this segment based on the action. For
+  //parts that have a down direction, the start position for the segments is inverted
+  //within the part.
+
+  segFirstLED = segptr->segFirstLED + partStart;
+  if ((SegAction[iSegment] != cSegActionAll) && !part->partup) {
+    segFirstLED = (partStart + part->len) - (segptr->segFirstLED + segNumLEDs);
+  }
+
+  //Now figure the initial starting LED for the segment, and the direction (+1/-1)
+
+  LEDIncrement = 1;
+  firstLED = segFirstLED;
+  switch (SegAction[iSegment]) {
+    case cSegActionFromBottom:
+    case cSegActionRandom:
+    case cSegActionBits:
+      if (!part->partup) {LEDIncrement = -1; firstLED = segFirstLED + segNumLEDs - 1;}
+      break;
+    case cSegActionFromTop:
+      if (part->partup) {LEDIncrement = -1; firstLED = segFirstLED + segNumLEDs - 1;}
+      break;
+  }
 
-        notSpacingLED = (SpacingCount == 0);
-        if ((iLED >= partStart) && (iLED <= partEnd) && (notSpacingLED)) {
+  //Every (spacing+1)th LED is written
+  AddPlanRun(iSegment, firstLED, LEDIncrement * segSpacing1, (segNumLEDs + segSpacing1 - 1) / segSpacing1, 0);
+}
+
+//Add count entries, from firstLED step LEDs apart and from fill order firstOrd the plan's ordStep apart, as a
+//run of the segment's plan. They're cropped to the part and then to the strip. Bits are only consumed by
+//LEDs inside the part, so the bit number starts counting at the part crop.
+void LEDSegsBase::AddPlanRun(short iSegment, short firstLED, short step, short count, short firstOrd) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  Parts *part = &stripParts[segptr->segPart];
+  short partEnd, jfirst, jlast, jpartfirst, jpartlast, rel;
+  SegmentPlan *plan = Plan(iSegment);
+  PlanRun *run = &plan->runs[plan->numRuns];
+
+  if (count <= 0) return;
+
+  if (part->circular) {
+    if (part->len <= 0) return;
+    count = min(count, (short) ((part->len + abs(step) - 1) / abs(step)));
+    rel = (firstLED - part->start) % part->len;
+    if (rel < 0) rel += part->len;
+    run->firstLED = part->start + rel;
+    run->count =    count;
+    run->step =     step;
+    run->firstOrd = firstOrd;
+    run->firstBit = 0;
+    plan->bitsWidth = count;
+    plan->numRuns++;
+    return;
+  }
+
+  partEnd = part->start + part->len - 1;
+  ClipPlanEntries(firstLED, step, count, part->start, partEnd, jpartfirst, jpartlast);
+  ClipPlanEntries(firstLED, step, count, max(part->start, (short) 0), min(partEnd, (short) (nLEDsInStrip - 1)), jfirst, jlast);
+  plan->bitsWidth = max((short) (jpartlast - jpartfirst + 1), (short) 0);
+  if (jfirst > jlast) return;
+
+  run->firstLED = firstLED + (jfirst * step);
+  run->count =    jlast - jfirst + 1;
+  run->step =     step;
+  run->firstOrd = firstOrd + (jfirst * plan->ordStep);
+  run->firstBit = jfirst - jpartfirst;
+  plan->numRuns++;
+}
+
+/*___________________
+LEDSegs::WritePlanRun
+Write one render plan run, applying the offsets that are left out of the plan so that changing them
+costs nothing: a circular part's rotation and a Bits segment's scroll. Each can wrap the run around
+once, so it's written as up to four pieces, each an ordinary run.
+*/
 
-          //Calculate the color (foreground/background) based on the action type.
-          thisColor = backColor;  //Assume background color
-          switch (Action) {
-            case cSegActionFromBottom:
-            case cSegActionFromTop:
-            case cSegActionFromMiddle:
-              //(Note the ">" is correct. ">=" will give you an always-on first LED).
-              if (segval > iLEDinSegment) thisColor = foreColor;
-              break;
-            case cSegActionAll:
-              thisColor = foreColor;
-              break;
-            case cSegActionRandom:
-              if (segRandomLevels[(iLEDinSegment + segRandomPattern) & cSegNRandomMask] <= segptr->segLevel) thisColor = foreColor;
+void LEDSegsBase::WritePlanRun(short iSegment, PlanRun *run, short segval, uint32_t foreColor, bool optOffOverwrite,
+                               uint8_t *pixels) {
+  Parts *part = &stripParts[SegmentData[iSegment].segPart];
+  PlanRun pieces[2], *piece;
+  short len, rel, n1, npieces, ipiece, jfirst, jlast;
+
+  if (!part->circular) {WriteScrolledRun(iSegment, run, segval, foreColor, optOffOverwrite, pixels); return;}
+
+  //Rotate the run's first LED along the part's direction, and split the run where it passes the end of the part
+  len = part->len;
+  rel = (short) ((run->firstLED - part->start + (long) (part->partup ? part->offset : -part->offset)) % len);
+  if (rel < 0) rel += len;
+  if (run->step > 0) n1 = (len - 1 - rel) / run->step + 1;
+  else n1 = rel / -run->step + 1;
+  n1 = min(n1, run->count);
+
+  pieces[0] = *run;
+  pieces[0].firstLED = part->start + rel;
+  pieces[0].count = n1;
+  npieces = 1;
+  if (n1 < run->count) {
+    pieces[1] = *run;
+    pieces[1].firstLED = pieces[0].firstLED + (n1 * run->step) + ((run->step > 0) ? -len : len);
+    pieces[1].count = run->count - n1;
+    pieces[1].firstOrd += n1 * Plan(iSegment)->ordStep;
+    pieces[1].firstBit += n1;
+    npieces = 2;
+  }
+
+  //Crop each piece to the strip (the part may hang off either end)
+  for (ipiece = 0; ipiece < npieces; ipiece++) {
+    piece = &pieces[ipiece];
+    ClipPlanEntries(piece->firstLED, piece->step, piece->count, 0, nLEDsInStrip - 1, jfirst, jlast);
+    if (jfirst > jlast) continue;
+    piece->firstLED += jfirst * piece->step;
+    piece->count = jlast - jfirst + 1;
+    piece->firstOrd += jfirst * Plan(iSegment)->ordStep;
+    piece->firstBit += jfirst;
+    WriteScrolledRun(iSegment, piece, segval, foreColor, optOffOverwrite, pixels);
+  }
+}
+
+//Write a run, scrolling a Bits segment's bits by segBitsOffset: the run is split where its bit number
+//wraps around the plan's bitsWidth
+void LEDSegsBase::WriteScrolledRun(short iSegment, PlanRun *run, short segval, uint32_t foreColor, bool optOffOverwrite,
+                                   uint8_t *pixels) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  PlanRun pieces[2];
+  short width, n1, npieces, ipiece;
+
+  width = Plan(iSegment)->bitsWidth;
+  npieces = 1;
+  pieces[0] = *run;
+  if ((SegAction[iSegment] == cSegActionBits) && (segptr->segBitsOffset != 0) && (width > 0)) {
+    pieces[0].firstBit = (short) ((run->firstBit + (long) segptr->segBitsOffset) % width);
+    if (pieces[0].firstBit < 0) pieces[0].firstBit += width;
+    n1 = min((short) (width - pieces[0].firstBit), run->count);
+    if (n1 < run->count) {
+      pieces[0].count = n1;
+      pieces[1] = *run;
+      pieces[1].firstLED += n1 * run->step;
+      pieces[1].count = run->count - n1;
+      pieces[1].firstOrd += n1 * Plan(iSegment)->ordStep;
+      pieces[1].firstBit = 0;
+      npieces = 2;
+    }
+  }
+
+  for (ipiece = 0; ipiece < npieces; ipiece++) {
+    if (pixels) WriteRunKernel(iSegment, &pieces[ipiece], segval, foreColor, optOffOverwrite, pixels);
+    else WriteRun(iSegment, &pieces[ipiece], segval, foreColor, optOffOverwrite);
+  }
+}
+
+#if cMaxCullSpans > 0
+//Write a run of a segment that has hidden LEDs (see CullSegments): just the entries in between the
+//segment's cullSpans. (A segment with hidden LEDs is never in a circular part.)
+void LEDSegsBase::WriteVisibleRun(short iSegment, PlanRun *run, short segval, uint32_t foreColor, bool optOffOverwrite,
+                                  uint8_t *pixels) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  PlanRun piece;
+  short ispan, k, jfirst, jlast, jnext;
+
+  //Go through the spans in the run's entry order, writing the entries before each
+  jnext = 0;
+  for (k = 0; k <= segptr->cullCount; k++) {
+    if (k < segptr->cullCount) {
+      ispan = segptr->cullFirst + ((run->step > 0) ? k : segptr->cullCount - 1 - k);
+      ClipPlanEntries(run->firstLED, run->step, run->count, cullSpans[ispan][0], cullSpans[ispan][1], jfirst, jlast);
+      if (jfirst > jlast) continue;
+    }
+    else jfirst = jlast = run->count;
+
+    if (jfirst > jnext) {
+      piece = *run;
+      piece.firstLED += jnext * run->step;
+      piece.count = jfirst - jnext;
+      piece.firstOrd += jnext * Plan(iSegment)->ordStep;
+      piece.firstBit += jnext;
+      WriteScrolledRun(iSegment, &piece, segval, foreColor, optOffOverwrite, pixels);
+    }
+#if defined LEDSEGS_STATS
+    if (k < segptr->cullCount) statsCulled += jlast - jfirst + 1;
+#endif
+    jnext = jlast + 1;
+  }
+}
+#endif
+
+/*_______________
+LEDSegs::WriteRun
+Write one render plan run for the segment's action
+*/
+
+//Blend one 7-bit color value over another (see cSegBlendXXX). weight is the opacity scaled to 0..256.
+//Multiply is the product / 127 rounded to nearest (division-free), and alpha the weighted mean rounded down.
+static inline uint8_t BlendChannel(uint8_t under, uint8_t over, short mode, short weight) {
+  uint16_t m;
+
+  switch (mode) {
+    case cSegBlendAdd:
+      return min(under + over, 127);
+    case cSegBlendMax:
+      return max(under, over);
+    case cSegBlendMultiply:
+      m = (under * over) + 63;
+      return (m + (m >> 7) + 1) >> 7;
+    case cSegBlendAlpha:
+      return ((uint16_t) under * (256 - weight) + (uint16_t) over * weight) >> 8;
+  }
+  return over;
+}
+
+//Set an LED through the strip object, blending it with the LED's color if the segment has a blend mode
+void LEDSegsBase::WritePixel(short iLED, uint32_t color, stripSegment *segptr) {
+  uint32_t under;
+  short mode, weight;
+
+  mode = SegBlend(segptr);
+  if (mode != cSegBlendNone) {
+    under = objLPDStrip->getPixelColor(iLED);
+    weight = SegOpacity(segptr) + (SegOpacity(segptr) >> 7);
+    color = ((uint32_t) BlendChannel((under >> 16) & 0x7F, (color >> 16) & 0x7F, mode, weight) << 16) |
+            ((uint32_t) BlendChannel((under >> 8) & 0x7F, (color >> 8) & 0x7F, mode, weight) << 8) |
+            BlendChannel(under & 0x7F, color & 0x7F, mode, weight);
+  }
+  objLPDStrip->setPixelColor(iLED, color);
+}
+
+void LEDSegsBase::WriteRun(short iSegment, PlanRun *run, short segval, uint32_t foreColor, bool optOffOverwrite) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  short    j, nlit, iLED, ord, ordStep, bitnum, segRandomPattern, segLevel, randomMask;
+  uint32_t backColor, thisColor;
+  const uint8_t *bitsary;
+  const unsigned short *randomLevels;
+  bool     writeFore;
+
+  backColor = segptr->segBackColor;
+  ordStep = Plan(iSegment)->ordStep;
+  iLED = run->firstLED;
+
+  //An LED is skipped if its color is the background and this is a no-off-overwrite segment
+  writeFore = optOffOverwrite || (foreColor != backColor);
+
+  switch (SegAction[iSegment]) {
+    case cSegActionFromBottom:
+    case cSegActionFromTop:
+    case cSegActionFromMiddle:
+      //The entries with fill order below segval are lit: the first nlit of the run. (Note ">"
+      //is correct, ">=" would give an always-on first LED.)
+      nlit = 0;
+      if (segval > run->firstOrd) nlit = min((short) ((segval - run->firstOrd + ordStep - 1) / ordStep), run->count);
+      if (writeFore) WriteRunColor(run, 0, nlit, foreColor, segptr);
+      if (optOffOverwrite) WriteRunColor(run, nlit, run->count - nlit, backColor, segptr);
+      break;
+
+    case cSegActionAll:
+      if (writeFore) WriteRunColor(run, 0, run->count, foreColor, segptr);
+      break;
+
+    case cSegActionRandom:
+      segRandomPattern = segptr->segRandomPattern;
+      segLevel = SegLevel[iSegment];
+      randomLevels = randomTables[segptr->segRandomTable].levels;
+      randomMask = randomTables[segptr->segRandomTable].length - 1;
+      ord = run->firstOrd;
+      for (j = 0; j < run->count; j++, iLED += run->step, ord += ordStep) {
+        thisColor = (randomLevels[(ord + segRandomPattern) & randomMask] <= segLevel) ? foreColor : backColor;
 #if defined DIAGRANDOM
-  Serial.print("**Random: iLED="); Serial.print(iLEDinSegment);
-  Serial.print(", RanLev="); Serial.print(segRandomLevels[(iLEDinSegment + segRandomPattern) & cSegNRandomMask]);
-  Serial.print(", SegLev="); Serial.print(segptr->segLevel);
+  Serial.print("**Random: iLED="); Serial.print(ord);
+  Serial.print(", RanLev="); Serial.print(randomLevels[(ord + segRandomPattern) & randomMask]);
+  Serial.print(", SegLev="); Serial.print(segLevel);
   Serial.print(", Color="); Serial.print(thisColor,HEX);
   Serial.println();
 #endif
-              break;
-            case cSegActionBits:
-              if (((*bitsary) >> bitscounter) & 1) thisColor = foreColor;
-              bitscounter++;
-              if (bitscounter >= 32) {bitscounter = 0; bitsary++;};
-              break;
-          }
+        if ((thisColor != backColor) || optOffOverwrite) WritePixel(iLED, thisColor, segptr);
+      }
+      break;
+
+    case cSegActionBits:
+      //A NULL bits pointer displays as all zero bits
+      bitsary = segptr->segBitsPtr;
+      bitnum = run->firstBit;
+      for (j = 0; j < run->count; j++, iLED += run->step, bitnum++) {
+        thisColor = (bitsary && ((bitsary[bitnum >> 3] >> (bitnum & 7)) & 1)) ? foreColor : backColor;
+        if ((thisColor != backColor) || optOffOverwrite) WritePixel(iLED, thisColor, segptr);
+      }
+      break;
+  }
+}
+
+/*_____________________
+LEDSegs::WriteRunKernel
+The same as WriteRun, but every (action, no-off-overwrite, step) combination has its own loop,
+generated from the templates below and picked from RunKernels[] once per run. The loops write the
+pixel buffer directly: the plan already cropped the run to the strip and resolved its direction and
+spacing into the step, so no per-LED tests are left. When overwriting, Random and Bits pick each
+LED's color with a mask instead of a branch; no-off-overwrite segments only store their lit LEDs.
+*/
 
-          //Write the LED color, but not if the value is the background color and this is a no-off-overwrite segment.
-          if ((thisColor != backColor) || optOffOverwrite) {
-            objLPDStrip->setPixelColor(iLED, thisColor);
-          }          
+//What a kernel needs to write one run. Colors are encoded as the LPD8806 stores them (G, R, B | 0x80).
+struct RunJob {
+  uint8_t *p;            //The run's first LED in the pixel buffer
+  short stride;          //Bytes from one LED of the run to the next (3 * step)
+  short count;           //LEDs in the run
+  short nlit;            //Fill: the first nlit LEDs get the foreground color
+  uint8_t fore[3], back[3];
+  const unsigned short *randomLevels; //Random: the cutoff levels and their slot mask (length - 1), the first
+  short randomMask;                   //LED's fill order + pattern, the fill order step and the segment's level
+  short ord, ordStep, level;
+  const uint8_t *bits;   //Bits: the bit array and the first LED's bit number
+  short bitnum;
+};
+typedef void (*RunKernel)(RunJob *);
+
+//Fill n LEDs from p upward with one color: 4 LEDs, then copy the filled part onto the next, doubling
+static void FillGRB(uint8_t *p, short n, const uint8_t *grb) {
+  short i, done, chunk;
+  for (i = 0; (i < n) && (i < 4); i++) {p[3 * i] = grb[0]; p[3 * i + 1] = grb[1]; p[3 * i + 2] = grb[2];}
+  for (done = i; done < n; done += chunk) {
+    chunk = min(done, (short) (n - done));
+    memcpy(p + 3 * done, p, 3 * chunk);
+  }
+}
 
-        } //Segment LED within part range and not spacer
+//Fill actions: the first nlit LEDs foreground, the rest background if Overwrite. Step is the run's
+//step when it is +/-1 (contiguous in the buffer), 0 for spaced runs.
+template <bool Overwrite, short Step> static void KernelFill(RunJob *job) {
+  short j, nlit = job->nlit, count = job->count, stride = job->stride;
+  uint8_t *p = job->p, f0 = job->fore[0], f1 = job->fore[1], f2 = job->fore[2];
+  uint8_t b0 = job->back[0], b1 = job->back[1], b2 = job->back[2];
 
-        //Move to next LED. For from-middle, we jump back and forth around the center of the
-        //segment, increasing the increment's absolute value by one more each jump.
+  if (Step == 1) {
+    FillGRB(p, nlit, job->fore);
+    if (Overwrite) FillGRB(p + 3 * nlit, count - nlit, job->back);
+  }
+  else if (Step == -1) {
+    FillGRB(p - 3 * (nlit - 1), nlit, job->fore);
+    if (Overwrite) FillGRB(p - 3 * (count - 1), count - nlit, job->back);
+  }
+  else {
+    for (j = 0; j < nlit; j++, p += stride) {p[0] = f0; p[1] = f1; p[2] = f2;}
+    if (Overwrite) {
+      for (; j < count; j++, p += stride) {p[0] = b0; p[1] = b1; p[2] = b2;}
+    }
+  }
+}
 
-        if (Action == cSegActionFromMiddle) {
-          if (LEDIncrement <= 0) {
-            LEDIncrement--;
-            if (notSpacingLED) {
-              SpacingCount = segSpacing1;
-            }
-            SpacingCount--;
-          }
-          else {
-            LEDIncrement++;
-          }
-          LEDIncrement = -LEDIncrement;
-        }
-        else {
-          if (notSpacingLED) {
-            SpacingCount = segSpacing1;
-          }
-          SpacingCount--;
-        }
+//Random: an LED is foreground when its cutoff level is <= the segment level
+template <bool Overwrite, short Step> static void KernelRandom(RunJob *job) {
+  short j, count = job->count, ord = job->ord, ordStep = job->ordStep, level = job->level, mask = job->randomMask;
+  short stride = Step ? 3 * Step : job->stride;
+  const unsigned short *levels = job->randomLevels;
+  uint8_t *p = job->p, m, f0 = job->fore[0], f1 = job->fore[1], f2 = job->fore[2];
+  uint8_t b0 = job->back[0], b1 = job->back[1], b2 = job->back[2];
+
+  for (j = 0; j < count; j++, p += stride, ord += ordStep) {
+    if (Overwrite) {
+      m = -(uint8_t) (levels[ord & mask] <= level);
+      p[0] = (f0 & m) | (b0 & ~m);
+      p[1] = (f1 & m) | (b1 & ~m);
+      p[2] = (f2 & m) | (b2 & ~m);
+    }
+    else if (levels[ord & mask] <= level) {p[0] = f0; p[1] = f1; p[2] = f2;}
+  }
+}
 
-        iLED += LEDIncrement;
-      } //LED-in-segment loop
-    } //If an action defined
-  }  //Segment loop
+//Bits runs at least this long expand whole bytes through a table of 4-LED color patterns
+const short cBitsTableMinLEDs = 64;
+
+//The 16 patterns of 4 LEDs, LED k foreground when bit k of the index is set. For Step -1 the LEDs are
+//stored in reverse, since the run goes down the buffer.
+template <short Step> static void BuildBitsTable(uint8_t table[16][12], const uint8_t *fore, const uint8_t *back) {
+  short v, k;
+  const uint8_t *grb;
+  uint8_t *q;
+
+  for (v = 0; v < 16; v++) {
+    for (k = 0; k < 4; k++) {
+      grb = ((v >> k) & 1) ? fore : back;
+      q = &table[v][3 * ((Step == 1) ? k : 3 - k)];
+      q[0] = grb[0]; q[1] = grb[1]; q[2] = grb[2];
+    }
+  }
+}
 
-  //Finally, refresh the strip.
-  objLPDStrip->show();
+//Bits: an LED is foreground when its bit is set. The bits are read a byte at a time. Long contiguous
+//overwrite runs copy each whole byte's 8 LEDs from the pattern table as two 12-byte blocks;
+//no-off-overwrite runs skip zero bytes and only visit the set bits.
+template <bool Overwrite, short Step> static void KernelBits(RunJob *job) {
+  short j, k, nb, count = job->count;
+  short stride = Step ? 3 * Step : job->stride;
+  const uint8_t *bits = job->bits + (job->bitnum >> 3);
+  uint8_t *p = job->p, *q, m, v, f0 = job->fore[0], f1 = job->fore[1], f2 = job->fore[2];
+  uint8_t b0 = job->back[0], b1 = job->back[1], b2 = job->back[2];
+  uint8_t table[16][12];
+  bool useTable = Overwrite && (Step != 0) && (count >= cBitsTableMinLEDs);
+
+  if (useTable) BuildBitsTable<Step>(table, job->fore, job->back);
+
+  //The first byte may start part way in, and the last may end part way
+  for (j = 0; j < count; j += nb, p += nb * stride) {
+    if (j == 0) {v = *bits++ >> (job->bitnum & 7); nb = 8 - (job->bitnum & 7);}
+    else {v = *bits++; nb = 8;}
+    if (nb > count - j) nb = count - j;
+
+    if (useTable && (nb == 8)) {
+      if (Step == 1) {memcpy(p, table[v & 15], 12); memcpy(p + 12, table[v >> 4], 12);}
+      else {memcpy(p - 9, table[v & 15], 12); memcpy(p - 21, table[v >> 4], 12);}
+    }
+    else if (Overwrite) {
+      for (k = 0, q = p; k < nb; k++, q += stride, v >>= 1) {
+        m = -(uint8_t) (v & 1);
+        q[0] = (f0 & m) | (b0 & ~m);
+        q[1] = (f1 & m) | (b1 & ~m);
+        q[2] = (f2 & m) | (b2 & ~m);
+      }
+    }
+    else {
+      for (v &= (1 << nb) - 1; v; v &= v - 1) {
+        q = p + __builtin_ctz(v) * stride;
+        q[0] = f0; q[1] = f1; q[2] = f2;
+      }
+    }
+  }
+}
+
+//Set every LED of a run to one color
+static void FillRunColor(RunJob *job, const uint8_t *grb) {
+  short j;
+  uint8_t *p = job->p;
+
+  if (job->stride == 3) FillGRB(p, job->count, grb);
+  else if (job->stride == -3) FillGRB(p - 3 * (job->count - 1), job->count, grb);
+  else {
+    for (j = 0; j < job->count; j++, p += job->stride) {p[0] = grb[0]; p[1] = grb[1]; p[2] = grb[2];}
+  }
 }
 
+//Random by slot rather than by LED: the lit LEDs are the ones using one of the first nslots slots of
+//sorted. With n = randomMask + 1 slots, entry j of the run uses slot (ord + j * ordStep) & randomMask, so with
+//g the largest power of 2 dividing ordStep (at most n), a slot s is used by no entry unless g divides s - ord,
+//and otherwise by every (n / g)th entry from j0 = ((s - ord) / g) / (ordStep / g), the division being by the
+//inverse of an odd number mod n / g. When overwriting, the run is first filled with whichever color most LEDs
+//get and only the other slots are visited.
+static void WriteRandomSlots(RunJob *job, const unsigned short *sorted, short nslots, bool overwrite) {
+  unsigned short g, n, period, odd, inv, d, j0;
+  short i, ifirst, ilast, j;
+  const uint8_t *grb;
+  uint8_t *p;
+
+  n = job->randomMask + 1;
+  g = job->ordStep & -job->ordStep;
+  if ((g == 0) || (g > n)) g = n;
+  period = n / g;
+  odd = job->ordStep / g;
+  inv = odd; //Newton's iteration: 3, 6, 12, 24 correct low bits
+  for (i = 0; i < 3; i++) inv *= 2 - odd * inv;
+
+  ifirst = 0;
+  ilast = nslots;
+  grb = job->fore;
+  if (overwrite && (nslots > n / 2)) {
+    FillRunColor(job, job->fore);
+    ifirst = nslots;
+    ilast = n;
+    grb = job->back;
+  }
+  else if (overwrite) FillRunColor(job, job->back);
+
+  for (i = ifirst; i < ilast; i++) {
+    d = (sorted[i] - job->ord) & job->randomMask;
+    if (d & (g - 1)) continue;
+    j0 = ((d / g) * inv) & (period - 1);
+    for (j = j0, p = job->p + j0 * job->stride; j < job->count; j += period, p += period * job->stride) {
+      p[0] = grb[0]; p[1] = grb[1]; p[2] = grb[2];
+    }
+  }
+}
+
+//Indexed by [kind][overwrite][step: +1, -1, spaced]
+const short cKernelFill = 0, cKernelRandom = 1, cKernelBits = 2;
+static const RunKernel RunKernels[3][2][3] = {
+  {{KernelFill<false, 1>,   KernelFill<false, -1>,   KernelFill<false, 0>},
+   {KernelFill<true, 1>,    KernelFill<true, -1>,    KernelFill<true, 0>}},
+  {{KernelRandom<false, 1>, KernelRandom<false, -1>, KernelRandom<false, 0>},
+   {KernelRandom<true, 1>,  KernelRandom<true, -1>,  KernelRandom<true, 0>}},
+  {{KernelBits<false, 1>,   KernelBits<false, -1>,   KernelBits<false, 0>},
+   {KernelBits<true, 1>,    KernelBits<true, -1>,    KernelBits<true, 0>}}};
+
+static void EncodeGRB(uint32_t c, uint8_t *grb) {
+  grb[0] = (c >> 16) | 0x80;
+  grb[1] = (c >>  8) | 0x80;
+  grb[2] =  c        | 0x80;
+}
+
+//Blending segments. The pixel buffer's bytes are each a 7-bit color value | 0x80, so the blend modes work on
+//them byte by byte, in place. A blended run is drawn cBlendChunk LEDs at a time into a scratch buffer by the
+//unspaced kernels and then blended into the pixels by BlendKernels[mode - 1]. The scratch is zeroed first, so
+//the LEDs a no-off-overwrite segment skips are the bytes left without 0x80, which the blend leaves alone.
+#if defined(__AVR__)
+const short cBlendChunk = 16;
+#else
+const short cBlendChunk = 128;
+#endif
+const short cBlendMinLEDs = 8;
+typedef void (*BlendKernel)(uint8_t *, const uint8_t *, short, short);
+
+#if defined(__SSE2__)
+//16 values (0..127) at a time: the same arithmetic as BlendChannel(), products in 16 bits
+template <short Mode> static inline __m128i BlendVector(__m128i under, __m128i over, __m128i weight) {
+  __m128i zero = _mm_setzero_si128(), lo, hi;
+
+  if (Mode == cSegBlendAdd) return _mm_min_epu8(_mm_add_epi8(under, over), _mm_set1_epi8(127));
+  if (Mode == cSegBlendMax) return _mm_max_epu8(under, over);
+  if (Mode == cSegBlendMultiply) {
+    lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(under, zero), _mm_unpacklo_epi8(over, zero)), _mm_set1_epi16(63));
+    hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(under, zero), _mm_unpackhi_epi8(over, zero)), _mm_set1_epi16(63));
+    lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 7)), _mm_set1_epi16(1)), 7);
+    hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 7)), _mm_set1_epi16(1)), 7);
+    return _mm_packus_epi16(lo, hi);
+  }
+  //Alpha
+  lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(under, zero), _mm_sub_epi16(_mm_set1_epi16(256), weight)),
+                     _mm_mullo_epi16(_mm_unpacklo_epi8(over, zero), weight));
+  hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(under, zero), _mm_sub_epi16(_mm_set1_epi16(256), weight)),
+                     _mm_mullo_epi16(_mm_unpackhi_epi8(over, zero), weight));
+  return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+#endif
+
+//Blend n bytes of src into dst, skipping src bytes without 0x80
+template <short Mode> static void BlendBytes(uint8_t *dst, const uint8_t *src, short n, short weight) {
+  short i = 0;
+
+#if defined(__SSE2__)
+  const __m128i mask7 = _mm_set1_epi8(0x7F), bit7 = _mm_set1_epi8((char) 0x80), vweight = _mm_set1_epi16(weight);
+  __m128i under, over, written, blended;
+
+  for (; i + 16 <= n; i += 16) {
+    under = _mm_loadu_si128((const __m128i *) (dst + i));
+    over = _mm_loadu_si128((const __m128i *) (src + i));
+    written = _mm_cmplt_epi8(over, _mm_setzero_si128());
+    blended = _mm_or_si128(BlendVector<Mode>(_mm_and_si128(under, mask7), _mm_and_si128(over, mask7), vweight), bit7);
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_and_si128(written, blended), _mm_andnot_si128(written, under)));
+  }
+#endif
+  for (; i < n; i++) {
+    if (src[i] & 0x80) dst[i] = BlendChannel(dst[i] & 0x7F, src[i] & 0x7F, Mode, weight) | 0x80;
+  }
+}
+
+static const BlendKernel BlendKernels[4] = {BlendBytes<cSegBlendAdd>, BlendBytes<cSegBlendMax>,
+                                            BlendBytes<cSegBlendMultiply>, BlendBytes<cSegBlendAlpha>};
+
+//Write a run's LEDs with kernels[] (the unspaced kernels for the run's kind and overwrite option), blending them
+//into the pixels
+static void BlendRun(RunJob *job, const RunKernel *kernels, short step, BlendKernel blend, short weight) {
+  uint8_t scratch[3 * cBlendChunk];
+  RunJob chunk = *job;
+  short done, n, j;
+
+  for (done = 0; done < job->count; done += n) {
+    n = min(cBlendChunk, (short) (job->count - done));
+    memset(scratch, 0, 3 * n);
+    chunk.count = n;
+    chunk.nlit = constrain(job->nlit - done, 0, n);
+    chunk.ord = job->ord + done * job->ordStep;
+    chunk.bitnum = job->bitnum + done;
+
+    //The scratch is in pixel order, so a step -1 chunk is drawn from its end
+    if (step == -1) {
+      chunk.p = scratch + 3 * (n - 1);
+      chunk.stride = -3;
+      kernels[1](&chunk);
+      blend(job->p - 3 * (done + n - 1), scratch, 3 * n, weight);
+      continue;
+    }
+    chunk.p = scratch;
+    chunk.stride = 3;
+    kernels[0](&chunk);
+    if (step == 1) blend(job->p + 3 * done, scratch, 3 * n, weight);
+    else {
+      for (j = 0; j < n; j++) blend(job->p + (done + j) * job->stride, scratch + 3 * j, 3, weight);
+    }
+  }
+}
+
+void LEDSegsBase::WriteRunKernel(short iSegment, PlanRun *run, short segval, uint32_t foreColor, bool optOffOverwrite,
+                                 uint8_t *pixels) {
+  stripSegment *segptr = &SegmentData[iSegment];
+  short kind, istep, nslots, nvisit;
+  RandomTable *table;
+  RunJob job;
+
+  //A no-off-overwrite segment whose foreground is its background color writes nothing
+  if (!optOffOverwrite && (foreColor == segptr->segBackColor)) return;
+
+  //Short blended runs aren't worth drawing in the scratch buffer
+  if ((SegBlend(segptr) != cSegBlendNone) && (run->count < cBlendMinLEDs)) {
+    WriteRun(iSegment, run, segval, foreColor, optOffOverwrite);
+    return;
+  }
+
+  job.p = pixels + 3 * run->firstLED;
+  job.stride = 3 * run->step;
+  job.count = run->count;
+  job.ordStep = Plan(iSegment)->ordStep;
+  job.nlit = job.ord = job.bitnum = 0;
+  EncodeGRB(foreColor, job.fore);
+  EncodeGRB(segptr->segBackColor, job.back);
+
+  switch (SegAction[iSegment]) {
+    case cSegActionFromBottom:
+    case cSegActionFromTop:
+    case cSegActionFromMiddle:
+      //As in WriteRun: the entries with fill order below segval are lit
+      kind = cKernelFill;
+      job.nlit = 0;
+      if (segval > run->firstOrd) job.nlit = min((short) ((segval - run->firstOrd + job.ordStep - 1) / job.ordStep), run->count);
+      break;
+
+    case cSegActionAll:
+      kind = cKernelFill;
+      job.nlit = run->count;
+      break;
+
+    case cSegActionRandom:
+      kind = cKernelRandom;
+      table = &randomTables[segptr->segRandomTable];
+      job.randomLevels = table->levels;
+      job.randomMask = table->length - 1;
+      job.ord = run->firstOrd + segptr->segRandomPattern;
+      job.level = SegLevel[iSegment];
+
+      //Go by slot when there are clearly fewer slots to visit than LEDs in the run. (Short runs aren't
+      //worth the binary search.)
+      if ((run->count >= 32) && (SegBlend(segptr) == cSegBlendNone)) {
+        nslots = RandomLitSlots(table, job.level);
+        nvisit = (optOffOverwrite && (nslots > table->length / 2)) ? table->length - nslots : nslots;
+        if (nvisit < run->count / 2) {WriteRandomSlots(&job, table->sorted, nslots, optOffOverwrite); return;}
+      }
+      break;
+
+    case cSegActionBits:
+      //A NULL bits pointer displays as all zero bits
+      kind = segptr->segBitsPtr ? cKernelBits : cKernelFill;
+      job.nlit = 0;
+      job.bits = segptr->segBitsPtr;
+      job.bitnum = run->firstBit;
+      break;
+
+    default:
+      return;
+  }
+
+  if (SegBlend(segptr) != cSegBlendNone) {
+    BlendRun(&job, RunKernels[kind][optOffOverwrite], run->step, BlendKernels[SegBlend(segptr) - 1],
+             SegOpacity(segptr) + (SegOpacity(segptr) >> 7));
+    return;
+  }
+  istep = (run->step == 1) ? 0 : ((run->step == -1) ? 1 : 2);
+  RunKernels[kind][optOffOverwrite][istep](&job);
+}
+
+#if cFixedPointCache
+//delta * segval / segNumLEDs (truncated toward 0, as the dividing code does) using the segment's cached
+//reciprocal. |delta| * segval <= 127 * segNumLEDs, so the estimate is at most 1 low.
+short LEDSegsBase::ModulateStep(short delta, short segval, short iSegment) {
+  uint32_t mag, quotient;
+
+  mag = (uint32_t) (delta < 0 ? -delta : delta) * segval;
+  quotient = (mag * SegLEDsRecip[iSegment]) >> 24;
+  if ((quotient + 1) * SegNumLEDs[iSegment] <= mag) quotient++;
+  return delta < 0 ? -(short) quotient : (short) quotient;
+}
+#endif
+
+//Set n LEDs of a run, starting at entry jfirst, to one color. Unspaced runs of segments that don't
+//blend are a contiguous range of the pixel buffer and go through the bulk fill.
+void LEDSegsBase::WriteRunColor(PlanRun *run, short jfirst, short n, uint32_t color, stripSegment *segptr) {
+  short iLED;
+
+  if (n <= 0) return;
+  iLED = run->firstLED + (jfirst * run->step);
+  if (SegBlend(segptr) != cSegBlendNone) {
+    for (; n > 0; n--, iLED += run->step) WritePixel(iLED, color, segptr);
+  }
+  else if (run->step == 1) objLPDStrip->fillPixelColor(iLED, n, color);
+  else if (run->step == -1) objLPDStrip->fillPixelColor(iLED - n + 1, n, color);
+  else {
+    for (; n > 0; n--, iLED += run->step) objLPDStrip->setPixelColor(iLED, color);
+  }
+}
+
+#if defined LEDSEGS_STATS
+
+/*
+______________________________
+Instrumentation (LEDSEGS_STATS)
+
+Each pipeline stage's time (cStatXXX) is recorded on every DisplayStrip() call. A frame that takes
+longer than the TimedDisplay() period counts as an overrun. Display routine time is also kept
+per segment.
+*/
+
+//Histogram bucket for a time: exact below 4us, then two buckets per power of two
+static short StatsBucket(unsigned long us) {
+  short msb;
+  if (us < 4) return us;
+  for (msb = 2; (us >> (msb + 1)) != 0; msb++) {}
+  return min((short) ((2 * msb) + ((us >> (msb - 1)) & 1)), (short) (cStatBuckets - 1));
+}
+
+//Largest time that falls in a histogram bucket
+static unsigned long StatsBucketTop(short ibucket) {
+  if (ibucket < 4) return ibucket;
+  return ((3UL + (ibucket & 1)) << ((ibucket >> 1) - 1)) - 1;
+}
+
+void LEDSegsBase::StatsRecord(short stage, unsigned long us) {
+  StageStats *st = &stripStats[stage];
+  if ((st->count == 0) || (us < st->minUS)) st->minUS = us;
+  if (us > st->maxUS) st->maxUS = us;
+  st->count++;
+  st->totalUS += us;
+  st->hist[StatsBucket(us)]++;
+  if ((stage == cStatFrame) && (stripDisplayPeriodMS > 0) && (us > stripDisplayPeriodMS * 1000UL)) statsOverruns++;
+}
+
+LEDStatsSummary LEDSegsBase::GetStats(short stage) {
+  LEDStatsSummary sum = {0, 0, 0, 0, 0};
+  StageStats *st;
+  unsigned long seen, target;
+  short ibucket;
+
+  if ((stage < 0) || (stage >= cStatNumStages)) return sum;
+  st = &stripStats[stage];
+  if (st->count == 0) return sum;
+  sum.count = st->count;
+  sum.minUS = st->minUS;
+  sum.maxUS = st->maxUS;
+  sum.avgUS = st->totalUS / st->count;
+
+  //p99: the bucket where the cumulative count reaches 99% of the samples
+  target = st->count - (st->count / 100);
+  seen = 0;
+  for (ibucket = 0; ibucket < cStatBuckets; ibucket++) {
+    seen += st->hist[ibucket];
+    if (seen >= target) break;
+  }
+  sum.p99US = min(StatsBucketTop(ibucket), st->maxUS);
+  return sum;
+}
+
+unsigned long LEDSegsBase::GetStats_Frames() {return stripStats[cStatFrame].count;}
+unsigned long LEDSegsBase::GetStats_Overruns() {return statsOverruns;}
+unsigned long LEDSegsBase::GetStats_Skipped() {return objLPDStrip->skippedFrames() - statsSkippedBase;}
+unsigned long LEDSegsBase::GetStats_Culled() {return statsCulled;}
+unsigned long LEDSegsBase::GetSegmentStats_Calls(short iseg) {return segStats[iseg].calls;}
+unsigned long LEDSegsBase::GetSegmentStats_AvgUS(short iseg) {return segStats[iseg].calls ? segStats[iseg].totalUS / segStats[iseg].calls : 0;}
+unsigned long LEDSegsBase::GetSegmentStats_MaxUS(short iseg) {return segStats[iseg].maxUS;}
+
+void LEDSegsBase::ResetStats() {
+  memset(stripStats, 0, sizeof(stripStats));
+  memset(segStats, 0, nMaxSegments * sizeof(SegmentStats));
+  statsOverruns = 0;
+  statsSkippedBase = objLPDStrip->skippedFrames();
+  statsCulled = 0;
+}
+
+//Print the stats table, e.g. strip->DumpStats(Serial)
+void LEDSegsBase::DumpStats(Print &out) {
+  static const char *stagenames[cStatNumStages] = {"ReadSpectrum", "MapBands", "Routines", "Write", "Show", "Frame"};
+  LEDStatsSummary sum;
+  short i;
+
+  out.print("LEDSegs stats: frames="); out.print(GetStats_Frames());
+  out.print(" overruns="); out.print(GetStats_Overruns());
+  out.print(" skipped="); out.print(GetStats_Skipped());
+  out.print(" culled="); out.print(GetStats_Culled());
+  out.print(" period(ms)="); out.println(stripDisplayPeriodMS);
+  out.println("stage: count min avg max p99 (us)");
+  for (i = 0; i < cStatNumStages; i++) {
+    sum = GetStats(i);
+    out.print(stagenames[i]); out.print(": ");
+    out.print(sum.count); out.print(" ");
+    out.print(sum.minUS); out.print(" ");
+    out.print(sum.avgUS); out.print(" ");
+    out.print(sum.maxUS); out.print(" ");
+    out.println(sum.p99US);
+  }
+  for (i = 0; i < nMaxSegments; i++) {
+    if (segStats[i].calls == 0) continue;
+    out.print("Segment "); out.print(i);
+    out.print(" routine: calls="); out.print(segStats[i].calls);
+    out.print(" avg(us)="); out.print(GetSegmentStats_AvgUS(i));
+    out.print(" max(us)="); out.println(segStats[i].maxUS);
+  }
+}
+
+#endif //LEDSEGS_STATS
+
 #endif  //_LEDSEGS_cpp
@@ -7,6 +7,8 @@
 
 //Storage limits for various things. You can redefine these before including this library.
 
+//A segment takes 45 bytes of SRAM on AVR boards with the defaults there. The optional caches below add to that:
+//cSegPlanCache 26 bytes, cFixedPointCache 14, cSegBlendModes 2 and occlusion culling (cMaxCullSpans) 4.
 #ifndef cMaxSegments
 #define cMaxSegments 100  //Max number of definable segments
 #endif
@@ -19,6 +21,80 @@
 #define cMaxTimers 32 //Max number of definable timers
 #endif
 
+#ifndef cMaxRescaleTables
+#define cMaxRescaleTables 8 //Max number of distinct compiled rescale arrays (see SetSegment_Rescale)
+#endif
+
+#ifndef cMaxRandomTables
+#define cMaxRandomTables 4 //Max number of distinct random pattern lengths above cSegNRandom (see SetSegment_RandomLength)
+#endif
+
+//Spectrum sources other than the shield (see SetSpectrumSource and LEDSpectrumFFT) can give up to cMaxBands
+//bands (at most 64). Each band costs 4 bytes of SRAM per strip, and segment band masks (LEDBandMask) are
+//2, 4 or 8 bytes for up to 16, 32 or 64 bands.
+#ifndef cMaxBands
+#if defined(__AVR__)
+#define cMaxBands 16
+#else
+#define cMaxBands 64
+#endif
+#endif
+
+//The largest LEDSpectrumFFT transform (a power of 2). An LEDSpectrumFFT takes about 17 bytes of SRAM per point.
+#ifndef cMaxFFTSize
+#if defined(__AVR__)
+#define cMaxFFTSize 128
+#else
+#define cMaxFFTSize 2048
+#endif
+#endif
+
+//Compiled rescale tables hold one level per 2^cRescaleTableShift input levels: 0 (the default) gives exact
+//1025-entry tables (2K each). On RAM-limited boards you can #define 2 for compact 257-entry tables (514 bytes
+//each) that interpolate between entries, at the cost of rescaled levels a few levels off the exact ones.
+#ifndef cRescaleTableShift
+#define cRescaleTableShift 0
+#endif
+
+//Per-segment caches for the newer rendering features, each costing SRAM per segment (see cMaxSegments). They
+//are compiled in except on AVR boards; #define one as 1 or 0 before including this library to change that.
+//  cSegPlanCache: keep each segment's render plan (see CompileSegmentPlan) instead of working it out every frame
+//  cFixedPointCache: the reciprocals SetFixedPointLevels() needs; without them levels are always divided
+//  cSegBlendModes: SetSegment_Blend() and SetSegment_Opacity(); without them segments always replace the LEDs
+#ifndef cSegPlanCache
+#if defined(__AVR__)
+#define cSegPlanCache 0
+#else
+#define cSegPlanCache 1
+#endif
+#endif
+
+#ifndef cFixedPointCache
+#if defined(__AVR__)
+#define cFixedPointCache 0
+#else
+#define cFixedPointCache 1
+#endif
+#endif
+
+#ifndef cSegBlendModes
+#if defined(__AVR__)
+#define cSegBlendModes 0
+#else
+#define cSegBlendModes 1
+#endif
+#endif
+
+//Division-free (fixed-point) level normalization, see SetFixedPointLevels(). On by default on AVR boards,
+//which have no hardware divide, when cFixedPointCache is compiled in there.
+#ifndef cFixedPointLevels
+#if defined(__AVR__)
+#define cFixedPointLevels true
+#else
+#define cFixedPointLevels false
+#endif
+#endif
+
 //General macros
 #define _LEDSEGS_CNT(ary) (sizeof(ary) / sizeof(ary[ 0 ]))
 
@@ -28,6 +104,7 @@
 
 const short cSegNumBands = 7;
 const short cMaxSegmentLevel = 1023; //Normalized max sample value out of MapBandsToSegments().
+const short cMaxBandLevel = 1023;    //Max band level a spectrum source returns (see SetSpectrumSource).
 
 //Frequency band index values bit mask values (for DefineSegment()). Bit 0 (0x1) is the lowest freq.,
 //bit 7 (0x40) is highest. These are fixed by the spectrum analyzer chip used on the shield, and the
@@ -42,6 +119,16 @@ const short cSegBand5 = 0x10;  //2.5KHz center
 const short cSegBand6 = 0x20;  //6.25KHz - Think about omitting this (6KHz is a high "audible" freq.)
 const short cSegBand7 = 0x40;  //16KHz - I recommend omitting this one, just noise.
 
+//A segment's bands: bit n selects band n. The shield only has the seven above; other spectrum sources can
+//have up to cMaxBands (see LEDSegs::BandRange).
+#if cMaxBands > 32
+typedef uint64_t LEDBandMask;
+#elif cMaxBands > 16
+typedef uint32_t LEDBandMask;
+#else
+typedef uint16_t LEDBandMask;
+#endif
+
 //LEDSegs Segment actions. See DefineSegment and SetSegment_Action.
 
 const short cSegActionNone = 0;        //Do nothing (undefined or do-nothing segment)
@@ -51,7 +138,7 @@ const short cSegActionFromMiddle = 3;  //Fill LEDs from the middle out
 const short cSegActionAll = 4;         //Fill all LEDs in segment. Do not look at current value.
 const short cSegActionStatic = cSegActionAll; //(Legacy)
 const short cSegActionRandom = 5;      //Illuminate foreground color LEDs randomly throughout the segment range based on level
-const short cSegActionBits = 6;        //Display bits from a long[] array. Uses the BitsPtr value for the segment, which has to be set.
+const short cSegActionBits = 6;        //Display bits from a bit array. Uses the BitsPtr value for the segment, which has to be set.
 
 //Segment Options
 
@@ -59,6 +146,18 @@ const short cSegOptNoOffOverwrite =  0x01; //Do not overwrite an LED if value is
 const short cSegOptModulateSegment = 0x02; //Vary intensity of LEDs based on level
 const short cSegOptBandAvg =         0x04; //Scale to the average across all band values, instead of using max
 
+//Segment blend modes, for how a segment's LEDs combine with the lower-index segments' (see SetSegment_Blend).
+//R, G and B are blended separately.
+
+const short cSegBlendNone = 0;      //Replace the LED (default)
+const short cSegBlendAdd = 1;       //Add, saturating at 127
+const short cSegBlendMax = 2;       //The brighter of the two
+const short cSegBlendMultiply = 3;  //Multiply, with 127 as 1: white changes nothing, black turns the LED off
+const short cSegBlendAlpha = 4;     //Mix in the segment's color by its opacity (SetSegment_Opacity, 0..255)
+
+//SetPart_Decay() value for a part whose LEDs start each frame off (the default), instead of as the last frame faded
+const short cPartNoDecay = -1;
+
 //Software gain control constants. This provides a simple noise gate and 'fast attack'/'slow decay' AGC.
 //As each band sample is read, a fixed assumed noise value (defined below) for each band is subtracted out.
 //In the MapBandsToSegments processing, the segment's max level seen so far is updated, but not permitted
@@ -71,10 +170,57 @@ const static short cBandNoiseFloor[cSegNumBands] = {90, 90, 90, 90, 100, 100, 12
 //cSegNRandom is the number of randomizer 'slots' that contain distinct random values. It is used for cSegActionRandom
 //segments. The LED index plus the pattern number for the segment, modulo cSegNRandom, is used to index the
 //array of random values for comparison to determine whether to display that LED. The random pattern repeats every
-//cSegNRandom LEDs, but that's enough to not be visible.
+//cSegNRandom LEDs, which isn't visible on short segments. Long segments can be given their own longer pattern with
+//SetSegment_RandomLength(), up to cSegMaxRandomLength slots. Those tables are allocated (4 bytes per slot), shared
+//by the segments with the same length and sorted when filled, so frames don't do more work for a longer pattern.
 
-const short cSegNRandomMask = 0X3F; //Array count has to be power of 2.
-const short cSegNRandom = cSegNRandomMask + 1;
+#ifndef cSegNRandom
+#define cSegNRandom 64 //Has to be a power of 2
+#endif
+const short cSegNRandomMask = cSegNRandom - 1;
+
+#ifndef cSegMaxRandomLength
+#define cSegMaxRandomLength 4096 //Has to be a power of 2
+#endif
+
+//Occlusion culling (see SetOcclusionCulling()) remembers up to cMaxCullSpans hidden LED ranges,
+//4 bytes of SRAM each. A segment whose hidden ranges don't fit is drawn whole. 0 compiles culling out
+//(and its 4 bytes per segment), which is the AVR default; #define it to 8 or so to use it there.
+#ifndef cMaxCullSpans
+#if defined(__AVR__)
+#define cMaxCullSpans 0
+#else
+#define cMaxCullSpans 64
+#endif
+#endif
+
+//Optional pipeline instrumentation. #define LEDSEGS_STATS before including this library to collect
+//per-stage frame timings in microseconds (see GetStats() and DumpStats()). Without it, none of the
+//timing code or storage is compiled in.
+
+#if defined LEDSEGS_STATS
+
+const short cStatReadSpectrum = 0;    //ReadSpectrum()
+const short cStatMapBands = 1;        //MapBandsToSegments()
+const short cStatDisplayRoutines = 2; //Segment display routines
+const short cStatWriteSegments = 3;   //Writing segments into the pixel buffer
+const short cStatShow = 4;            //LPD8806::show()
+const short cStatFrame = 5;           //The whole DisplayStrip() call
+const short cStatNumStages = 6;
+
+//Timings are also binned in a histogram of half-octave buckets for the p99 estimate. The
+//reported p99 is the upper edge of its bucket (so it can read up to ~40% high).
+const short cStatBuckets = 48;
+
+struct LEDStatsSummary {
+  unsigned long count;  //Number of samples
+  unsigned long minUS;
+  unsigned long avgUS;
+  unsigned long maxUS;
+  unsigned long p99US;
+};
+
+#endif
 
 /*
 ______________
@@ -85,6 +231,13 @@ class LEDBits {
 public:
   static void BitRotate(short, uint8_t[], short int);
   static bool BitRead(short, uint8_t []);
+  static void BitWrite(short firstbit, short nbits, uint8_t[], uint32_t value);
+  static void BitShiftIn(short bitwidth, uint8_t[], short nbits, uint32_t inbits);
+  static void BitFill(short firstbit, short nbits, uint8_t[], uint32_t pattern, short patternwidth);
+  static void BitSetRange(short firstbit, short nbits, uint8_t[]);
+  static void BitClearRange(short firstbit, short nbits, uint8_t[]);
+  static short BitCount(short firstbit, short nbits, uint8_t[]);
+  static void BitReverse(short firstbit, short nbits, uint8_t[]);
 };
 
 /*
@@ -102,6 +255,18 @@ class LEDTimers {
   public:
     LEDTimers();
     typedef void (*TimerRoutine) (short int, void *);
+
+    //A timer element
+    struct LEDTimer {
+      unsigned long timerExpiration;   //Timer expiration in ms (0=available timer)
+      unsigned long timerRepeat;       //If the timer repeats, the # of ms for the repeat (0=no repeat)
+      TimerRoutine timerSub;           //A reference to the timer routine to be called on expiration
+      void *timerPtr;                  //Arbitrary pointer associated with the timer
+    };
+
+    //Use the given array of maxTimers timers. Must be called before any other method.
+    void AttachTimers(LEDTimer *, short maxTimers);
+
     unsigned short DefineTimer(unsigned long, unsigned long, TimerRoutine);
     unsigned short DefineTimer(unsigned long, unsigned long, TimerRoutine, void *);
     void CancelTimer(short);
@@ -115,49 +280,117 @@ class LEDTimers {
 
   private:
 
-    //A timer element
-    struct LEDTimer {
-      unsigned long timerExpiration;   //Timer expiration in ms (0=available timer)
-      unsigned long timerRepeat;       //If the timer repeats, the # of ms for the repeat (0=no repeat)
-      TimerRoutine timerSub;           //A reference to the timer routine to be called on expiration
-      void *timerPtr;                  //Arbitrary pointer associated with the timer
-    };
-    
     //The array of timers. (Index 0 is ignored to keep timer IDs positive.)
-    LEDTimer Timers[cMaxTimers];
+    LEDTimer *Timers;
+    short nMaxTimers;
 
 }; //LEDTimers class
 
+/*
+_______________________
+LEDSpectrumFFT Class:
+
+A spectrum source (see LEDSegs::SetSpectrumSource) that analyzes 16-bit PCM audio with a fixed-point FFT
+instead of the shield. Feed it samples with AddSamples() as they arrive. Each read windows the latest
+fftSize samples (Hann), transforms the left and right channels together as one complex FFT, and sums the
+power of the bins in each of nBands log-spaced bands from loHz to hiHz. A full-scale sine reads
+cMaxBandLevel in its band.
+
+  LEDSpectrumFFT fft;
+  fft.Begin(44100, 1024, 32);
+  strip->SetSpectrumSource(LEDSpectrumFFT::ReadBands, &fft, fft.GetNumBands());
+  ...
+  fft.AddSamples(pcm, nFrames, 2);   //From the audio input, between DisplayStrip() calls
+*/
+
+class LEDSpectrumFFT {
+  public:
+    LEDSpectrumFFT();
+
+    //fftSize is a power of 2, 16..cMaxFFTSize. Bands default to 40Hz..16KHz, and never go past 0.45 of the
+    //sample rate. The low bands are widened to at least a bin each. Returns false if the size or band count
+    //isn't usable (more bands than bins in the range, or more than cMaxBands).
+    bool Begin(uint32_t sampleRate, short fftSize, short nBands);
+    bool Begin(uint32_t sampleRate, short fftSize, short nBands, long loHz, long hiHz);
+
+    //nFrames frames of nChannels interleaved samples. The first channel is left, the second (if any) right.
+    void AddSamples(const int16_t *, short nFrames, short nChannels);
+
+    //Fill levels[0..nBands-1] (0..cMaxBandLevel) from the latest fftSize samples, like the shield the max of
+    //the two channels if both are read
+    void Analyze(short *levels, bool doLeft, bool doRight);
+    short GetNumBands();
+    long GetBandHz(short);  //Low edge of the band
+
+    //The LEDSegs::SpectrumSourceRoutine; ptr is the LEDSpectrumFFT
+    static void ReadBands(short *, bool, bool, void *);
+
+  private:
+    void Transform();
+
+    uint32_t fftRate;
+    short fftSize;        //0 until Begin()
+    short fftNumBands;
+    short fftRingPos;     //Where AddSamples() writes next (the oldest sample)
+    short bandFirstBin[cMaxBands + 1];  //Band n is bins bandFirstBin[n]..bandFirstBin[n + 1] - 1
+    int16_t ringLeft[cMaxFFTSize], ringRight[cMaxFFTSize];
+    int16_t window[cMaxFFTSize / 2 + 1];  //Q15 Hann window (symmetric, so half of it)
+    int16_t data[2 * cMaxFFTSize];        //Interleaved re, im: left in re, right in im
+    //Twiddles for the stage of half-size h at entries h..2h-1, pairs (cos, sin) and (-sin, cos), so
+    //that each half of b * w is one pair's dot product with b (see Transform)
+    int16_t twReal[2 * cMaxFFTSize], twImag[2 * cMaxFFTSize];
+};
+
 /*
 _________________________
 LED strip class (LEDSegs::)
+
+The code lives in LEDSegsBase, which works on arrays it doesn't own. LEDSegsT (below) supplies them
+sized at compile time, and LEDSegs is the LEDSegsT with the default cMax... sizes.
 */
 
-class LEDSegs : public LEDTimers, public LEDBits {
+class LEDSegsBase : public LEDTimers, public LEDBits {
+
+  //The host benchmark harness (host/bench) times the private pipeline stages individually
+  friend class LEDSegsBench;
+
+  //Attaches its arrays to the private pointers below
+  template <short, short, short, short> friend class LEDSegsT;
 
   public:
     typedef void (*SegmentDisplayRoutine) (short);
-    LEDSegs(short);
-    LEDSegs(short, short, short);
-    ~LEDSegs();
+    typedef void (*SpectrumSourceRoutine) (short *, bool, bool, void *);
+    ~LEDSegsBase();
     void LEDSegsInit(short, bool, short, short);
     short int TimedDisplay(short int);
     void DisplayStrip(bool, bool);
     void ResetRandom();
     void ResetStrip();
+    void SetStripTransfer(LPD8806TransferRoutine, void *);
+    void SetStripAsyncTransfer(LPD8806TransferRoutine, LPD8806WaitRoutine, void *);
+    void SetStripSkipUnchanged(unsigned short);
+    void SetSpectrumSource(SpectrumSourceRoutine, void *);
+    void SetSpectrumSource(SpectrumSourceRoutine, void *, short);
+    short GetSpectrumBands();
+    static void ReadShieldSpectrum(short *, bool, bool, void *);
+    static LEDBandMask BandRange(short, short);
     void SetSegmentIndex(short);
     short GetSegmentIndex();
     void SetMaxLevelFloor(short int);
     short int GetMaxLevelFloor();
  	  void SetMaxLevelDecay(short int);
     short int GetMaxLevelDecay();
+    void SetFixedPointLevels(bool);
+    bool GetFixedPointLevels();
+    void SetOcclusionCulling(bool);
+    bool GetOcclusionCulling();
     
     void SetSegment_Action(short, short);
     void SetSegment_Action(short);
     void SetSegment_BackColor(short, uint32_t);
     void SetSegment_BackColor(uint32_t);
-    void SetSegment_Bands(short, short);
-    void SetSegment_Bands(short);
+    void SetSegment_Bands(short, LEDBandMask);
+    void SetSegment_Bands(LEDBandMask);
     void SetSegment_DisplayRoutine(short, SegmentDisplayRoutine);
     void SetSegment_DisplayRoutine(SegmentDisplayRoutine);
     void SetSegment_FirstLED(short, short);
@@ -172,14 +405,26 @@ class LEDSegs : public LEDTimers, public LEDBits {
     void SetSegment_NumLEDs(short);
     void SetSegment_Part(short, short);
     void SetSegment_Part(short);
-    void SetSegment_BitsPtr(short, uint32_t *);
-    void SetSegment_BitsPtr(uint32_t *);
+    void SetSegment_BitsPtr(short, const uint8_t *);
+    void SetSegment_BitsPtr(short, const uint32_t *);
+    void SetSegment_BitsPtr(short, const uint64_t *);
+    void SetSegment_BitsPtr(const uint8_t *);
+    void SetSegment_BitsPtr(const uint32_t *);
+    void SetSegment_BitsPtr(const uint64_t *);
+    void SetSegment_BitsOffset(short, short);
+    void SetSegment_BitsOffset(short);
+    void SetSegment_Blend(short, short);
+    void SetSegment_Blend(short);
+    void SetSegment_Opacity(short, short);
+    void SetSegment_Opacity(short);
     void SetSegment_Options(short, short);
     void SetSegment_Options(short);
     void SetSegment_Persistence(short, short);
     void SetSegment_Persistence(short, short, short);
     void SetSegment_RandomPattern(short, short);
     void SetSegment_RandomPattern(short);
+    void SetSegment_RandomLength(short, short);
+    void SetSegment_RandomLength(short);
     void SetSegment_Spacing(short, short);
     void SetSegment_Rescale(const short int *);
     void SetSegment_Rescale(short, const short int *);
@@ -189,8 +434,12 @@ class LEDSegs : public LEDTimers, public LEDBits {
     short    GetSegment_Action();
     uint32_t GetSegment_BackColor(short);
     uint32_t GetSegment_BackColor();
-    short    GetSegment_Bands(short);
-    short    GetSegment_Bands();
+    LEDBandMask GetSegment_Bands(short);
+    LEDBandMask GetSegment_Bands();
+    short    GetSegment_BitsOffset(short);
+    short    GetSegment_BitsOffset();
+    short    GetSegment_Blend(short);
+    short    GetSegment_Blend();
     short    GetSegment_FirstLED(short);
     short    GetSegment_FirstLED();
     uint32_t GetSegment_ForeColor(short);
@@ -203,13 +452,17 @@ class LEDSegs : public LEDTimers, public LEDBits {
     short    GetSegment_NumLEDs();
     short    GetSegment_Options(short);
     short    GetSegment_Options();
+    short    GetSegment_Opacity(short);
+    short    GetSegment_Opacity();
     short    GetSegment_RandomPattern(short);
     short    GetSegment_RandomPattern();
+    short    GetSegment_RandomLength(short);
+    short    GetSegment_RandomLength();
     short    GetSegment_Spacing(short);
     short    GetSegment_Spacing();
 
-    short DefineSegment(short, short, short, uint32_t, short);
-    short DefineSegment(short, short, short, uint32_t, short, short);
+    short DefineSegment(short, short, short, uint32_t, LEDBandMask);
+    short DefineSegment(short, short, short, uint32_t, LEDBandMask, short);
     void ResetSegment(short int);
     void ResetSegments();
     static uint32_t Color(byte, byte, byte);
@@ -224,10 +477,31 @@ class LEDSegs : public LEDTimers, public LEDBits {
     void  SetPart_Len(short, short);
     bool GetPart_Up(short);
     void SetPart_Up(short, bool);
+    bool GetPart_Circular(short);
+    void SetPart_Circular(short, bool);
+    short GetPart_Offset(short);
+    void  SetPart_Offset(short, short);
+    short GetPart_Decay(short);
+    void  SetPart_Decay(short, short);
 
     bool CheckForDeadAir(short);
     void DisableDeadAirDetect();
     void EnableDeadAirDetect(short int);
+
+#if defined LEDSEGS_STATS
+    /* Instrumentation (public) */
+
+    LEDStatsSummary GetStats(short);
+    unsigned long GetStats_Frames();
+    unsigned long GetStats_Overruns();
+    unsigned long GetStats_Skipped();
+    unsigned long GetStats_Culled();
+    unsigned long GetSegmentStats_Calls(short);
+    unsigned long GetSegmentStats_AvgUS(short);
+    unsigned long GetSegmentStats_MaxUS(short);
+    void ResetStats();
+    void DumpStats(Print &);
+#endif
     
   private:
 
@@ -235,29 +509,79 @@ class LEDSegs : public LEDTimers, public LEDBits {
     const static short cSpectrumStrobe = 4;
 
     short int stripMaxLevelFloor, stripMaxLevelDecay;
+    bool stripFixedPoint; //Normalize levels with the cached reciprocals below instead of dividing (cFixedPointCache)
+    bool stripGenericRuns; //Write runs with WriteRun() instead of the WriteRunKernel() kernels (for comparison)
+    bool stripCulling;     //Skip LEDs that a later opaque segment overwrites (see CullSegments)
+    bool stripCullValid;   //False when the segments changed and the culling must be worked out again
+    bool stripDecay;       //Some part has a decay, so frames start from the last one faded (see FadeLEDs)
 
     //Called by TimedDisplay() timer routine on expiration
     static void teTimedDisplay(short int, void *);
 
+    //A run of LEDs in a segment's render plan (see CompileSegmentPlan): count LEDs starting at
+    //firstLED, step LEDs apart. firstOrd is the first LED's position in the segment's fill order
+    //(advancing by the plan's ordStep per LED) and firstBit its bit number for cSegActionBits.
+    struct PlanRun {
+      short firstLED;
+      short count;
+      short step;
+      short firstOrd;
+      short firstBit;
+    };
+    const static short cPlanMaxRuns = 2; //FromMiddle has a run each side of the center
+
+    //A segment's render plan. With cSegPlanCache each segment keeps its own, recompiled only when its
+    //geometry changes; without it there's one, stripPlan, recompiled for each segment as it's drawn.
+    struct SegmentPlan {
+      bool  valid;            //False when the geometry changed and the render plan must be recompiled
+      uint8_t numRuns;        //The number of runs in runs
+      short ordStep;          //Fill order step between LEDs in a run (spacing + 1)
+      short bitsWidth;        //Bits action: the number of bits shown, which segBitsOffset wraps around
+      PlanRun runs[cPlanMaxRuns]; //The LEDs this segment writes
+    };
+
     struct stripSegment {
       SegmentDisplayRoutine segDisplayRoutine;  //Optional routine to call just before each display cycle
       const short int *segRescaleAry; //Level rescaling array (optional)
       uint32_t segForeColor;  //The base color of the segment's illuminated LEDs
       uint32_t segBackColor;  //Background color for un-illuminated LEDs
-      uint32_t *segBitsPtr;   //Pointer to 32-bit unsigned long for Bits action. (Can go past 32-bits if the segment is longer)
+      const uint8_t *segBitsPtr; //The bits for the Bits action, bit n in bit (n & 7) of byte n >> 3
+      short segBitsOffset;    //Bits action: the bit shown in the first LED (scrolls the bits around the plan's bitsWidth)
       short segFirstLED;      //The first LED in the segment from the beginning (0-origin)
-      short segNumLEDs;       //The number of LEDs in the segment
-      short segBands;         //The spectrum bands that are averaged together to make up the sample value for this segment
-      short segAction;        //The way the LEDs in the segment are populated (cSegActionXXX)
       short segSpacing;       //Spacing between LEDs that are illuminated in the segment (0 default = no added spacing)
-      short segOptions;       //Options for the segment (cSegOptXXX)
-      short segLevel;         //Normalized, averaged level for this segment's bands
-      short segMaxLevel;      //Normalized, max level for this segment's bands
       short segPart;          //The part index associated with the segment (default is part 0 = the whole strip)
-      short segRandomPattern; //A randomization index [0..63], for cSegActionRandom. Default=0.
-      short segPersistUp;     //Weighting of prior level when this level is higher than prior
-      short segPersistDown;   //Weighting of prior level when current level is less than prior
+      short segRandomPattern; //A randomization index [0..pattern length-1], for cSegActionRandom. Default=0.
+      uint8_t segRandomTable; //The random table in randomTables (0 = the cSegNRandom slots, see SetSegment_RandomLength)
+#if cSegBlendModes
+      uint8_t segBlend;       //How the segment's LEDs combine with the LEDs already written (cSegBlendXXX)
+      uint8_t segOpacity;     //cSegBlendAlpha: 0 (invisible)..255 (opaque)
+#endif
+#if cSegPlanCache
+      SegmentPlan plan;
+#endif
+#if cMaxCullSpans > 0
+      short cullFirst, cullCount; //This frame's hidden LED ranges: cullSpans[cullFirst..cullFirst+cullCount-1]
+#endif
+    };
+
+    //Occlusion culling: the LED ranges hidden by later opaque segments, ascending within each segment,
+    //and the ranges of LEDs some opaque segment writes (at most cCullMaxCover, plus room for one more)
+#if cMaxCullSpans > 0
+    const static short cCullMaxCover = 8;
+    short cullSpans[cMaxCullSpans][2];
+    short cullCover[cCullMaxCover + 1][2];
+    short cullNumCover;
+#endif
+
+    //Rescale arrays compiled to lookup tables, shared by all segments using the same array contents
+    const static short cRescaleTableLen = (cMaxSegmentLevel >> cRescaleTableShift) + 2;
+    struct RescaleTable {
+      const short int *srcAry;  //The array this was compiled from
+      uint32_t srcHash;         //Hash of the array contents when compiled
+      short refs;               //Number of segments using the table (0 = slot free)
+      short *levels;            //cRescaleTableLen levels
     };
+    RescaleTable rescaleTables[cMaxRescaleTables];
 
     //The array of strip part definitions
 
@@ -265,18 +589,98 @@ class LEDSegs : public LEDTimers, public LEDBits {
       short start;
       short len;
       bool  partup;
+      bool  circular;   //Segment LEDs past either end of the part wrap around to the other end
+      short offset;     //Circular parts: rotation of the part's LEDs, applied when writing (not compiled into plans)
+      short decay;      //Fade of the last frame per frame in 256ths (0 = none), or cPartNoDecay to start from off
     };
-    Parts stripParts[cMaxParts];
+    Parts *stripParts;
+    short nMaxParts;
 
     //The actual segments
     short segCurrentIndex;    //The "current" (default) index that will be modified
-    short segMaxDefinedIndex; //Tracks the highest index defined
-    stripSegment SegmentData[cMaxSegments];  //The segment array
+
+    //Defined segments. segActive[0..segNumActive-1] are their indexes in ascending (drawing) order, so
+    //the frame loops only visit live segments. A set bit in segFreeBits marks a slot DefineSegment() can use.
+    short *segActive;
+    short segNumActive;
+    uint32_t *segFreeBits;
+    short nMaxSegments;
+    stripSegment *SegmentData;  //The segment array (configuration and render plan)
+
+    //The fields every per-frame pass reads for every segment are kept out of stripSegment, one array
+    //per field, so those loops touch only a few contiguous shorts per segment.
+    short *SegAction;                //The way the LEDs in the segment are populated (cSegActionXXX)
+    short *SegNumLEDs;               //The number of LEDs in the segment
+    LEDBandMask *SegBands;           //The spectrum bands that are averaged together to make up the sample value for this segment
+    short *SegOptions;               //Options for the segment (cSegOptXXX)
+    short *SegLevel;                 //Normalized, averaged level for this segment's bands
+    short *SegMaxLevel;              //Normalized, max level for this segment's bands
+    short *SegPersistUp;             //Weighting of prior level when this level is higher than prior
+    short *SegPersistDown;           //Weighting of prior level when current level is less than prior
+    short *SegRescale;               //Index of the compiled table for segRescaleAry in rescaleTables, or:
+    const static short cRescaleNone = -1;       //No rescaling
+    const static short cRescaleUncompiled = -2; //No table available; rescale with RescaleLevel() each frame
+
+#if cFixedPointCache
+    //The reciprocals SetFixedPointLevels() normalizes with, kept next to the levels they're for
+    short *SegMaxRecipFor;           //The SegMaxLevel that SegMaxRecip was computed for (0 = none)
+    uint32_t *SegMaxRecip;           //ceil(cMaxSegmentLevel * 2^20 / SegMaxRecipFor)
+    uint16_t *SegPersistUpRecip;     //floor(2^22 / (SegPersistUp + cMaxSegmentLevel))
+    uint16_t *SegPersistDownRecip;   //floor(2^22 / (SegPersistDown + cMaxSegmentLevel))
+    uint32_t *SegLEDsRecip;          //floor(2^24 / SegNumLEDs), for cSegOptModulateSegment
+#endif
+
+#if !cSegPlanCache
+    SegmentPlan stripPlan;
+#endif
+    //The segment's plan, as last compiled (Plan) or brought up to date first (ReadyPlan)
+    SegmentPlan *Plan(short iSegment) {
+#if cSegPlanCache
+      return &SegmentData[iSegment].plan;
+#else
+      return &stripPlan;
+#endif
+    }
+    SegmentPlan *ReadyPlan(short iSegment) {
+      SegmentPlan *plan = Plan(iSegment);
+#if cSegPlanCache
+      if (!plan->valid) CompileSegmentPlan(iSegment);
+#else
+      CompileSegmentPlan(iSegment);
+#endif
+      return plan;
+    }
+    void InvalidatePlan(short iSegment) {
+#if cSegPlanCache
+      SegmentData[iSegment].plan.valid = false;
+#endif
+    }
+
+    //The segment's blend mode and opacity (cSegBlendNone when blending is compiled out)
+#if cSegBlendModes
+    short SegBlend(stripSegment *segptr) {return segptr->segBlend;}
+    short SegOpacity(stripSegment *segptr) {return segptr->segOpacity;}
+#else
+    short SegBlend(stripSegment *) {return cSegBlendNone;}
+    short SegOpacity(stripSegment *) {return 255;}
+#endif
 
     //The per-band level from the spectrum analyzer for the current sample (see ::ReadSpectrum)
     //The max is private for the dead air detection
-    short SpectrumLevel[cSegNumBands];
-    short SpectrumMax[cSegNumBands];
+    short SpectrumLevel[cMaxBands];
+    short SpectrumMax[cMaxBands];
+    SpectrumSourceRoutine spectrumSource; //Fills SpectrumLevel[] each frame (NULL = ReadShieldSpectrum)
+    void *spectrumSourcePtr;
+    short stripNumBands;          //The number of bands the source fills
+    LEDBandMask stripBandsMask;   //Bits 0..stripNumBands-1
+
+    //MapBandsToSegments() cache of band aggregates, [0] by max and [1] by average, in cBandAggSlots slots
+    //picked by a hash of the band mask. A mask's entry is computed the first time a segment needs it in a
+    //frame (see BandAggregate); a mask whose slot is taken replaces the entry there.
+    const static short cBandAggSlots = 32;
+    LEDBandMask bandAggMask[2][cBandAggSlots];
+    short       bandAggLevel[2][cBandAggSlots];
+    uint32_t    bandAggValid[2];
 
     //Spectrum analyzer left/right channels
     const static short cSegSpectrumAnalogLeft = 0; //Left channel
@@ -285,19 +689,66 @@ class LEDSegs : public LEDTimers, public LEDBits {
     //The sampling/segment processing routines
     void ReadSpectrum(bool, bool);
     void MapBandsToSegments();
+    short BandAggregate(LEDBandMask, bool);
+    static short RescaleLevel(const short int *, short);
+    short AcquireRescaleTable(const short int *);
+    void ReleaseRescaleTable(short);
     void ShowSegments();
+    void RunDisplayRoutines();
+    void WriteSegments();
+#if cMaxCullSpans > 0
+    void CullSegments();
+#endif
+    void FadeLEDs(short, short);
+    void CompileSegmentPlan(short);
+    void AddPlanRun(short, short, short, short, short);
+    void InvalidatePartPlans(short);
+    void WriteRun(short, PlanRun *, short, uint32_t, bool);
+    void WriteRunKernel(short, PlanRun *, short, uint32_t, bool, uint8_t *);
+    void WritePlanRun(short, PlanRun *, short, uint32_t, bool, uint8_t *);
+    void WriteScrolledRun(short, PlanRun *, short, uint32_t, bool, uint8_t *);
+#if cMaxCullSpans > 0
+    void WriteVisibleRun(short, PlanRun *, short, uint32_t, bool, uint8_t *);
+#endif
+    void WriteRunColor(PlanRun *, short, short, uint32_t, stripSegment *);
+    void WritePixel(short, uint32_t, stripSegment *);
+#if cFixedPointCache
+    short ModulateStep(short, short, short);
+#endif
 
     //Private reset routines
 
     //Initialize the parts array (all parts = entire strip with up order)
     void ResetParts();
 
+    //Defined segment bookkeeping
+    void ActivateSegment(short);
+    short ActivePosition(short);
+    short FindFreeSegment(short);
+
     //A pointer to the low-level I/O LBD8806 strip object we talk to
     LPD8806* objLPDStrip;
     short nLEDsInStrip;
+    short nMaxLEDs;           //LEDSegsT NumLEDs: the size of stripPixels (0 = strip buffer is allocated)
+    uint8_t *stripPixels;
 
     //Array of random cutoff levels (for cSegActionRandom)
     unsigned short segRandomLevels[cSegNRandom];
+    unsigned short segRandomSorted[cSegNRandom]; //The slots in ascending segRandomLevels order
+
+    //Random tables: 0 is the cSegNRandom slots above, the others longer patterns shared by all segments with the
+    //same SetSegment_RandomLength()
+    struct RandomTable {
+      short length;             //Slots, a power of 2
+      short refs;               //Number of segments using the table (0 = slot free)
+      unsigned short *levels;   //length cutoff levels, then the slots in ascending level order
+      unsigned short *sorted;
+    };
+    RandomTable randomTables[cMaxRandomTables + 1];
+    void FillRandomTable(RandomTable *);
+    short AcquireRandomTable(short);
+    void ReleaseRandomTable(short);
+    short RandomLitSlots(RandomTable *, short);
 
     //Dead air detection methods
     short int DeadAirLevel, DeadAirDetectTimerID;
@@ -306,7 +757,104 @@ class LEDSegs : public LEDTimers, public LEDBits {
     //Called on dead air timer expiration every second. We sum selected bands' maxes to check for signal.
     //ptr is the timer pointer, which is set to the "this" pointer for the segment class instance.
     static void teCheckForDeadAir(short, void *);
-}; //LEDSegs class
+
+#if defined LEDSEGS_STATS
+    //The TimedDisplay() period (0 if not timed), for overrun counting
+    short int stripDisplayPeriodMS;
+
+    struct StageStats {
+      unsigned long count, minUS, maxUS;
+      unsigned long long totalUS;
+      unsigned long hist[cStatBuckets];
+    };
+    StageStats stripStats[cStatNumStages];
+    unsigned long statsOverruns;
+    unsigned long statsSkippedBase; //The strip's skipped-frame count at the last ResetStats()
+    unsigned long statsCulled;      //LEDs not written because a later opaque segment covers them
+
+    struct SegmentStats {
+      unsigned long calls, totalUS, maxUS;
+    };
+    SegmentStats *segStats;
+
+    void StatsRecord(short, unsigned long);
+#endif
+
+  protected:
+    LEDSegsBase() {}
+}; //LEDSegsBase class
+
+/*
+LEDSegsT: an LEDSegs with its capacities fixed at compile time, so strips of different sizes in one
+program each get only the storage they need:
+
+  LEDSegsT<160, 12, 4, 8> porch(160);   //160-LED pixel buffer, 12 segments, 4 parts, 8 timers
+  LEDSegsT<0, 300, 20, 32> *tree = new LEDSegsT<0, 300, 20, 32>(nLEDs);
+
+NumLEDs > 0 also puts the pixel buffer in the object instead of on the heap (the strip length passed
+to the constructor is limited to NumLEDs, and may be left out). NumLEDs = 0 allocates the buffer for
+whatever length is passed. The code is shared: a second size only costs its storage, not another copy
+of the library.
+*/
+
+template <short NumLEDs, short MaxSegments, short MaxParts, short MaxTimers>
+class LEDSegsT : public LEDSegsBase {
+  public:
+    LEDSegsT(short nLEDs) {AttachStorage(); LEDSegsInit(nLEDs, true, 0, 0);}
+    LEDSegsT(short nLEDs, short pinData, short pinClock) {AttachStorage(); LEDSegsInit(nLEDs, false, pinData, pinClock);}
+    LEDSegsT() {AttachStorage(); LEDSegsInit(NumLEDs, true, 0, 0);}
+
+  private:
+    LEDTimer      timerData[MaxTimers];
+    Parts         partData[MaxParts];
+    stripSegment  segmentData[MaxSegments];
+    short         segShorts[9][MaxSegments];  //SegAction...SegRescale (but SegBands) and segActive
+#if cFixedPointCache
+    short         segMaxRecipFor[MaxSegments];
+    uint32_t      segRecips[2][MaxSegments];  //SegMaxRecip and SegLEDsRecip
+    uint16_t      segPersistRecips[2][MaxSegments];
+#endif
+    LEDBandMask   segBandsData[MaxSegments];
+    uint32_t      freeBits[(MaxSegments + 31) / 32];
+    uint8_t       pixelData[NumLEDs > 0 ? LPD8806_BUFFER_BYTES(NumLEDs) : 1];
+#if defined LEDSEGS_STATS
+    SegmentStats  segStatsData[MaxSegments];
+#endif
+
+    void AttachStorage() {
+      AttachTimers(timerData, MaxTimers);
+      stripParts = partData;
+      nMaxParts = MaxParts;
+      SegmentData = segmentData;
+      nMaxSegments = MaxSegments;
+      SegAction = segShorts[0];
+      SegNumLEDs = segShorts[1];
+      SegBands = segBandsData;
+      SegOptions = segShorts[2];
+      SegLevel = segShorts[3];
+      SegMaxLevel = segShorts[4];
+      SegPersistUp = segShorts[5];
+      SegPersistDown = segShorts[6];
+      SegRescale = segShorts[7];
+      segActive = segShorts[8];
+#if cFixedPointCache
+      SegMaxRecipFor = segMaxRecipFor;
+      SegMaxRecip = segRecips[0];
+      SegLEDsRecip = segRecips[1];
+      SegPersistUpRecip = segPersistRecips[0];
+      SegPersistDownRecip = segPersistRecips[1];
+#endif
+      segFreeBits = freeBits;
+      nMaxLEDs = NumLEDs;
+      stripPixels = (NumLEDs > 0) ? pixelData : NULL;
+#if defined LEDSEGS_STATS
+      segStats = segStatsData;
+#endif
+    }
+};
+
+//The default strip class: sizes from cMaxSegments, cMaxParts and cMaxTimers, pixel buffer sized at run time
+typedef LEDSegsT<0, cMaxSegments, cMaxParts, cMaxTimers> LEDSegs;
 
 //Various colors. The bit format of these is defined by the LPD8806 library.
 //Assume nothing about the format except they are an unsigned long int and 0..127
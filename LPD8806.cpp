@@ -73,6 +73,18 @@ a 'latch' anyway.
 // Constructor for use with hardware SPI (specific clock/data pins):
 LPD8806::LPD8806(uint16_t n) {
   pixels = NULL;
+  ownPixels   = false;
+  transferFn  = NULL;
+  waitFn      = NULL;
+  transferPtr = NULL;
+  sendPixels  = NULL;
+  mainBuf     = NULL;
+  asyncBuf    = NULL;
+  sending     = false;
+  maxSkip     = skipRun = 0;
+  skipped     = 0;
+  dirty       = true;
+  sentValid   = false;
   begun  = false;
   updateLength(n);
   updatePins();
@@ -81,6 +93,18 @@ LPD8806::LPD8806(uint16_t n) {
 // Constructor for use with arbitrary clock/data pins:
 LPD8806::LPD8806(uint16_t n, uint8_t dpin, uint8_t cpin) {
   pixels = NULL;
+  ownPixels   = false;
+  transferFn  = NULL;
+  waitFn      = NULL;
+  transferPtr = NULL;
+  sendPixels  = NULL;
+  mainBuf     = NULL;
+  asyncBuf    = NULL;
+  sending     = false;
+  maxSkip     = skipRun = 0;
+  skipped     = 0;
+  dirty       = true;
+  sentValid   = false;
   begun  = false;
   updateLength(n);
   updatePins(dpin, cpin);
@@ -94,12 +118,31 @@ LPD8806::LPD8806(uint16_t n, uint8_t dpin, uint8_t cpin) {
 LPD8806::LPD8806(void) {
   numLEDs = numBytes = 0;
   pixels  = NULL;
+  ownPixels   = false;
+  transferFn  = NULL;
+  waitFn      = NULL;
+  transferPtr = NULL;
+  sendPixels  = NULL;
+  mainBuf     = NULL;
+  asyncBuf    = NULL;
+  sending     = false;
+  maxSkip     = skipRun = 0;
+  skipped     = 0;
+  dirty       = true;
+  sentValid   = false;
   begun   = false;
   updatePins(); // Must assume hardware SPI until pins are set
 }
 
+LPD8806::~LPD8806(void) {
+  waitSend();
+  if(ownPixels)        free(mainBuf);
+  if(asyncBuf != NULL) free(asyncBuf);
+}
+
 // Activate hard/soft SPI as appropriate:
 void LPD8806::begin(void) {
+  sentValid = false;
   if(hardwareSPI == true) startSPI();
   else                    startBitbang();
   begun = true;
@@ -202,15 +245,32 @@ void LPD8806::startBitbang() {
 
 // Change strip length (see notes with empty constructor, above):
 void LPD8806::updateLength(uint16_t n) {
+  updateLength(n, NULL);
+}
+
+// Change strip length, keeping the pixels in 'buf' (at least
+// LPD8806_BUFFER_BYTES(n) bytes, e.g. a static array) instead of the heap.
+// NULL allocates the buffer.  The async second buffer is still malloc()ed.
+void LPD8806::updateLength(uint16_t n, uint8_t *buf) {
   uint8_t latchBytes = (n + 31) / 32;
-  if(pixels != NULL) free(pixels); // Free existing data (if any)
+  waitSend(); // Don't free a buffer that is still being sent
+  if(ownPixels) free(mainBuf); // Free existing data (if any)
+  if(asyncBuf != NULL) free(asyncBuf);
+  asyncBuf   = sendPixels = NULL;
+  sentValid  = false;
+  ownPixels  = (buf == NULL);
   numLEDs    = n;
   n         *= 3; // 3 bytes per pixel
   numBytes   = n + latchBytes;
-  if(NULL != (pixels = (uint8_t *)malloc(numBytes))) { // Alloc new data
+  if(NULL != (pixels = mainBuf = ownPixels ? (uint8_t *)malloc(numBytes) : buf)) { // Alloc new data
     memset( pixels   , 0x80, n);          // Init to RGB 'off' state
     memset(&pixels[n], 0   , latchBytes); // Clear latch bytes
-  } else numLEDs = numBytes = 0; // else malloc failed
+    if((waitFn != NULL) &&
+       (NULL == (sendPixels = asyncBuf = (uint8_t *)malloc(numBytes)))) {
+      transferFn = NULL; // No room for a second buffer; back to per-byte
+      waitFn     = NULL;
+    }
+  } else numLEDs = numBytes = ownPixels = 0; // else malloc failed
   // 'begun' state does not change -- pins retain prior modes
 }
 
@@ -218,6 +278,15 @@ uint16_t LPD8806::numPixels(void) {
   return numLEDs;
 }
 
+// Direct access to the pixel buffer, for code that writes many pixels at
+// once: numPixels() * 3 bytes in strip order (G, R, B), each byte with the
+// high bit set.  There is no bounds checking.  Assumes the caller writes,
+// so the frame is marked changed.
+uint8_t *LPD8806::getPixels(void) {
+  dirty = true;
+  return pixels;
+}
+
 // This is how data is pushed to the strip.  Unfortunately, the company
 // that makes the chip didnt release the protocol document or you need
 // to sign an NDA or something stupid like that, but we reverse engineered
@@ -226,10 +295,29 @@ void LPD8806::show(void) {
   uint8_t  *ptr = pixels;
   uint16_t i    = numBytes;
 
+  if((maxSkip > 0) && frameUnchanged()) {
+    skipped++;
+    return;
+  }
+
   // This doesn't need to distinguish among individual pixel color
   // bytes vs. latch data, etc.  Everything is laid out in one big
   // flat buffer and issued the same regardless of purpose.
-  if(hardwareSPI) {
+  if((waitFn != NULL) && (sendPixels != NULL)) {
+    // Double buffered: wait out the previous frame, then send this one
+    // from the other buffer while the caller draws the next.  The new
+    // drawing buffer starts as a copy so pixels persist across show()
+    // as they do when sending synchronously.
+    waitSend();
+    memcpy(sendPixels, pixels, numBytes);
+    ptr        = sendPixels;
+    sendPixels = pixels;
+    pixels     = ptr;
+    sending    = true;
+    transferFn(sendPixels, numBytes, transferPtr);
+  } else if(transferFn != NULL) {
+    transferFn(pixels, numBytes, transferPtr);
+  } else if(hardwareSPI) {
     while(i--) {
 #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__) || defined (__AVR_ATmega328__) || defined(__AVR_ATmega8__) || (__AVR_ATmega1281__) || defined(__AVR_ATmega2561__) || defined(__AVR_ATmega2560__) || defined(__AVR_ATmega1280__)
       while(!(SPSR & (1<<SPIF))); // Wait for prior byte out
@@ -260,6 +348,117 @@ void LPD8806::show(void) {
   }
 }
 
+// Install a buffer-level output routine.  When set, show() makes one call
+// with the complete pixel + latch buffer instead of issuing it a byte at a
+// time, so a port can hand the frame to DMA, a Linux spidev device, a file,
+// etc.  The buffer must not be modified until the routine has finished
+// with it.  Pass NULL to return to the per-byte SPI/bitbang path.  Pin and
+// SPI setup (begin(), updatePins()) are unaffected.
+void LPD8806::setTransfer(LPD8806TransferRoutine fn, void *ptr) {
+  waitSend();
+  freeAsyncBuf();
+  transferFn  = fn;
+  waitFn      = NULL;
+  transferPtr = ptr;
+}
+
+// Double-buffered output: show() calls 'start' to begin sending the frame
+// and returns without waiting, so the next frame can be drawn while this
+// one goes out (by DMA, a sender thread, ...).  The buffer passed to
+// 'start' is left alone until 'wait' has returned, which happens at the
+// start of the next show() (or on updateLength(), setTransfer() and
+// destruction).  Costs a second pixel buffer and a memcpy per frame.  If
+// the second buffer can't be allocated, output reverts to the per-byte path.
+void LPD8806::setAsyncTransfer(LPD8806TransferRoutine start,
+  LPD8806WaitRoutine wait, void *ptr) {
+  setTransfer(start, ptr);
+  if((start == NULL) || (wait == NULL)) return;
+  waitFn = wait; // (updateLength() allocates the buffer if there's no strip yet)
+  if((numBytes > 0) &&
+     (NULL == (sendPixels = asyncBuf = (uint8_t *)malloc(numBytes)))) {
+    transferFn = NULL;
+    waitFn     = NULL;
+  }
+}
+
+// Drop the async second buffer.  show() swaps 'pixels' and 'sendPixels',
+// so either may be the malloc()ed one; the frame being drawn is moved back
+// into mainBuf (which may be the caller's) before asyncBuf is freed.
+void LPD8806::freeAsyncBuf(void) {
+  if(asyncBuf == NULL) return;
+  if(pixels == asyncBuf) {
+    memcpy(mainBuf, asyncBuf, numBytes);
+    pixels = mainBuf;
+  }
+  free(asyncBuf);
+  asyncBuf = sendPixels = NULL;
+}
+
+// Change detection: show() doesn't resend a frame identical to the last
+// one sent.  If nothing was written since the last show() that's known
+// for free; otherwise the pixel bytes are hashed (a few cycles per 4
+// bytes, far cheaper than sending them) and compared with the last sent
+// frame's hash.  A frame is still resent after 'maxSkip' skips in a row,
+// which bounds how long a glitched strip or (very unlikely) hash
+// collision can go uncorrected.  0 turns the feature off.
+void LPD8806::setSkipUnchanged(uint16_t n) {
+  maxSkip   = n;
+  skipRun   = 0;
+  sentValid = false;
+}
+
+uint32_t LPD8806::skippedFrames(void) {
+  return skipped;
+}
+
+// True if show() can skip this frame (see setSkipUnchanged()):
+boolean LPD8806::frameUnchanged(void) {
+  uint32_t h;
+
+  if(dirty || !sentValid) {
+    dirty = false;
+    h     = frameHash();
+    if(!sentValid || (h != sentHash)) {
+      sentHash  = h;
+      sentValid = true;
+      skipRun   = 0;
+      return false;
+    }
+  }
+  if(skipRun >= maxSkip) { // Periodic refresh
+    skipRun = 0;
+    return false;
+  }
+  skipRun++;
+  return true;
+}
+
+// 32-bit hash of the pixel bytes (not the latch).  Two independent lanes
+// of 4 bytes each so the multiplies can overlap:
+uint32_t LPD8806::frameHash(void) {
+  uint32_t h1 = 2166136261UL, h2 = 0x9E3779B9UL, w1, w2;
+  uint16_t i, n = numLEDs * 3;
+
+  for(i = 0; i + 8 <= n; i += 8) {
+    memcpy(&w1, &pixels[i]    , 4);
+    memcpy(&w2, &pixels[i + 4], 4);
+    h1  = (h1 ^ w1) * 0x9E3779B1UL;
+    h2  = (h2 ^ w2) * 0x85EBCA77UL;
+    h1 ^= h1 >> 15;
+    h2 ^= h2 >> 13;
+  }
+  for(; i < n; i++) h1 = (h1 ^ pixels[i]) * 16777619UL;
+  return h1 ^ (h2 * 0xC2B2AE3DUL);
+}
+
+// Block until an async send (if any) is complete:
+void LPD8806::waitSend(void) {
+  if(sending) {
+    waitFn(transferPtr);
+    sending = false;
+  }
+}
+
 // Convert separate R,G,B into combined 32-bit GRB color:
 uint32_t LPD8806::Color(byte r, byte g, byte b) {
   return ((uint32_t)(g | 0x80) << 16) |
@@ -270,6 +469,7 @@ uint32_t LPD8806::Color(byte r, byte g, byte b) {
 // Set pixel color from separate 7-bit R, G, B components:
 void LPD8806::setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b) {
   if(n < numLEDs) { // Arrays are 0-indexed, thus NOT '<='
+    dirty = true;
     uint8_t *p = &pixels[n * 3];
     *p++ = g | 0x80; // Strip color order is GRB,
     *p++ = r | 0x80; // not the more common RGB,
@@ -280,6 +480,7 @@ void LPD8806::setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b) {
 // Set pixel color from 'packed' 32-bit GRB (not RGB) value:
 void LPD8806::setPixelColor(uint16_t n, uint32_t c) {
   if(n < numLEDs) { // Arrays are 0-indexed, thus NOT '<='
+    dirty = true;
     uint8_t *p = &pixels[n * 3];
     *p++ = (c >> 16) | 0x80;
     *p++ = (c >>  8) | 0x80;
@@ -287,6 +488,54 @@ void LPD8806::setPixelColor(uint16_t n, uint32_t c) {
   }
 }
 
+// Set 'count' pixels starting at 'first' to one packed 32-bit GRB value.
+// Pixels past the end of the strip are ignored, as with setPixelColor().
+// The color is encoded once; after the first four pixels (12 bytes) the
+// filled part of the buffer is copied onto the next, doubling each time,
+// so long fills run at memcpy speed.
+void LPD8806::fillPixelColor(uint16_t first, uint16_t count, uint32_t c) {
+  uint8_t  *p, g, r, b;
+  uint16_t i, done, total, n;
+
+  if(first >= numLEDs) return;
+  if(count > numLEDs - first) count = numLEDs - first;
+  dirty = true;
+  p = &pixels[first * 3];
+  g = (c >> 16) | 0x80;
+  r = (c >>  8) | 0x80;
+  b =  c        | 0x80;
+  for(i = 0; (i < count) && (i < 4); i++) {
+    *p++ = g;
+    *p++ = r;
+    *p++ = b;
+  }
+  if(count <= 4) return;
+
+  p     = &pixels[first * 3];
+  done  = 12;
+  total = count * 3;
+  while(done < total) {
+    n = (done < total - done) ? done : total - done;
+    memcpy(p + done, p, n);
+    done += n;
+  }
+}
+
+// Copy 'count' pixels of already-encoded GRB bytes (high bits set, 3 bytes
+// per pixel, as they appear on the wire) into the strip starting at 'first'.
+void LPD8806::setPixels(uint16_t first, uint16_t count, const uint8_t *grb) {
+  if(first >= numLEDs) return;
+  if(count > numLEDs - first) count = numLEDs - first;
+  dirty = true;
+  memcpy(&pixels[first * 3], grb, count * 3);
+}
+
+// Set all pixels to 'off' (latch bytes are untouched):
+void LPD8806::clear(void) {
+  dirty = true;
+  memset(pixels, 0x80, numLEDs * 3);
+}
+
 // Query color from previously-set pixel (returns packed 32-bit GRB value)
 uint32_t LPD8806::getPixelColor(uint16_t n) {
   if(n < numLEDs) {
@@ -8,6 +8,18 @@
  #include <pins_arduino.h>
 #endif
 
+// Optional buffer-level output routine (see setTransfer()). Called by
+// show() with the whole pixel + latch buffer; 'ptr' is the pointer that
+// was passed to setTransfer().
+typedef void (*LPD8806TransferRoutine)(const uint8_t *buf, uint16_t len, void *ptr);
+
+// Waits for the send started by the last LPD8806TransferRoutine call to
+// finish (see setAsyncTransfer()).
+typedef void (*LPD8806WaitRoutine)(void *ptr);
+
+// Size of the pixel + latch buffer for n LEDs (see updateLength(n, buf)).
+#define LPD8806_BUFFER_BYTES(n) ((n) * 3 + ((n) + 31) / 32)
+
 class LPD8806 {
 
  public:
@@ -15,36 +27,71 @@ class LPD8806 {
   LPD8806(uint16_t n, uint8_t dpin, uint8_t cpin); // Configurable pins
   LPD8806(uint16_t n); // Use SPI hardware; specific pins only
   LPD8806(void); // Empty constructor; init pins & strip length later
+  ~LPD8806(void);
   void
     begin(void),
     show(void),
     setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b),
     setPixelColor(uint16_t n, uint32_t c),
+    fillPixelColor(uint16_t first, uint16_t count, uint32_t c), // Bulk fill
+    setPixels(uint16_t first, uint16_t count, const uint8_t *grb), // Bulk copy, pre-encoded
+    clear(void),                            // All pixels off
     updatePins(uint8_t dpin, uint8_t cpin), // Change pins, configurable
     updatePins(void),                       // Change pins, hardware SPI
-    updateLength(uint16_t n);               // Change strip length
+    updateLength(uint16_t n),               // Change strip length
+    updateLength(uint16_t n, uint8_t *buf), // Same, caller's buffer (not freed)
+    setTransfer(LPD8806TransferRoutine fn, void *ptr), // Bulk output; NULL = per-byte
+    setAsyncTransfer(LPD8806TransferRoutine start, LPD8806WaitRoutine wait,
+      void *ptr),                           // Double-buffered background output
+    setSkipUnchanged(uint16_t maxSkip);     // show() skips repeated frames; 0 = off
   uint16_t
     numPixels(void);
+  uint8_t
+    *getPixels(void);                       // Raw buffer for bulk writers
   uint32_t
     Color(byte, byte, byte),
-    getPixelColor(uint16_t n);
+    getPixelColor(uint16_t n),
+    skippedFrames(void);                    // show() calls skipped as unchanged
 
  private:
 
   uint16_t
     numLEDs,    // Number of RGB LEDs in strip
-    numBytes;   // Size of 'pixels' buffer below
+    numBytes,   // Size of 'pixels' buffer below
+    maxSkip,    // Skip at most this many unchanged frames in a row (0 = off)
+    skipRun;    // Unchanged frames skipped since the last one sent
+  uint32_t
+    sentHash,   // frameHash() of the last frame sent
+    skipped;    // Count of skipped show() calls
   uint8_t
     *pixels,    // Holds LED color values (3 bytes each) + latch
+    *sendPixels, // Async: the buffer being sent while 'pixels' is drawn
+    *mainBuf,    // updateLength() buffer; 'pixels' or 'sendPixels' after swaps
+    *asyncBuf,   // malloc()ed second buffer for async output, or NULL
     clkpin    , datapin,     // Clock & data pin numbers
     clkpinmask, datapinmask; // Clock & data PORT bitmasks
   volatile uint8_t
     *clkport  , *dataport;   // Clock & data PORT registers
+  LPD8806TransferRoutine
+    transferFn;  // If set, show() hands the whole buffer to this
+  LPD8806WaitRoutine
+    waitFn;      // If set, transferFn only starts the send (async)
+  void
+    *transferPtr;
   void
     startBitbang(void),
-    startSPI(void);
+    startSPI(void),
+    waitSend(void),
+    freeAsyncBuf(void);
+  uint32_t
+    frameHash(void);
   boolean
+    frameUnchanged(void),
     hardwareSPI, // If 'true', using hardware SPI
-    begun;       // If 'true', begin() method was previously invoked
+    begun,       // If 'true', begin() method was previously invoked
+    ownPixels,   // If 'true', 'mainBuf' was malloc()ed here
+    sending,     // If 'true', an async send of sendPixels is in flight
+    dirty,       // If 'true', pixels were written since the last show()
+    sentValid;   // If 'true', sentHash describes what the strip shows
 };
 #endif
@@ -0,0 +1,210 @@
+// ledsegs_bench: drive LEDSegs::DisplayStrip() in a tight loop and report frames/sec.
+//
+// Usage: ledsegs_bench [--leds n[,n...]] [--segs n[,n...]] [--frames n] [--device path]
+//                      [--wire-mhz f] [--async] [--period-ms n] [--skip-unchanged n] [--silence]
+//                      [--synth sweep|beat|silence|cycle] [--wav path] [--fft bands]
+//
+// Every combination of strip length and segment count is run. Segments evenly divide the strip
+// and cycle through the level-driven, All, Random and Bits actions. The analog inputs are fed
+// from a fixed-seed generator so runs are repeatable.
+//
+// By default frames go out through the per-byte SPI.transfer() path (discarded by the shim). With
+// --device each frame is written in bulk to a spidev device, file or pipe (LPD8806FdTransfer).
+// --wire-mhz instead simulates a strip on an SPI link of that clock rate: each show() sleeps for
+// the time the frame would take on the wire. --async sends through LPD8806ThreadSender with double
+// buffering (SetStripAsyncTransfer) so the next frame is drawn while the last one is sent.
+//
+// --period-ms paces the frames like TimedDisplay() instead of running flat out. us_in_display is the
+// average time each DisplayStrip() call held up the caller. --skip-unchanged n turns on
+// SetStripSkipUnchanged(n) (the _stats build reports the skipped frames) and --silence feeds all-zero
+// audio, for a static scene.
+//
+// --synth and --wav replace the random analog inputs with a spectrum source (SetSpectrumSource): the
+// LEDSpectrumSynth program of that name, or the WAV file played back at --period-ms (20ms if 0) of
+// audio per frame. Each strip size starts the source over, so every run sees the same levels. With
+// --fft the WAV file is analyzed by a cMaxFFTSize-point LEDSpectrumFFT into that many bands instead of
+// the model of the shield's seven, and the segments' bands are spread over them the same way.
+//
+// The ledsegs_bench_stats build links the LEDSEGS_STATS library and dumps the per-stage
+// instrumentation after each run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include "LEDSegs.h"
+#include "LPD8806FdTransfer.h"
+#include "LPD8806ThreadSender.h"
+#include "LEDSpectrumPCM.h"
+#include "LEDSpectrumSynth.h"
+
+const short cBenchMaxList = 16;
+
+static uint32_t BenchBits[(10000 + 31) / 32];
+
+//Deterministic "audio": each read returns a new pseudo-random band level
+static unsigned long BenchAnalogState = 12345;
+static int BenchAnalogRead(uint8_t) {
+  BenchAnalogState = BenchAnalogState * 1103515245UL + 12345UL;
+  return (int) ((BenchAnalogState >> 16) & 0x3FF);
+}
+
+//Simulated SPI link: hold the sender for len bytes at BenchWireMHz. It sleeps rather than spins, as
+//the CPU would be free during a DMA transfer.
+static double BenchWireMHz;
+static void BenchWireTransfer(const uint8_t *, uint16_t len, void *) {
+  std::this_thread::sleep_for(std::chrono::nanoseconds((long long) (len * 8 * 1000.0 / BenchWireMHz)));
+}
+
+static short ParseList(const char *arg, long list[]) {
+  short n = 0;
+  char *end;
+  while (*arg && (n < cBenchMaxList)) {
+    list[n++] = strtol(arg, &end, 10);
+    if (*end != ',') break;
+    arg = end + 1;
+  }
+  return n;
+}
+
+//-1 for an unknown name
+static short ParseSynthProgram(const char *name) {
+  static const char *names[] = {"silence", "sweep", "beat", "cycle"};
+  short i;
+  for (i = 0; i < (short) _LEDSEGS_CNT(names); i++) if (!strcmp(name, names[i])) return i;
+  return -1;
+}
+
+//Segment iseg takes band (iseg % 5) + 1 of the shield's seven, or the same seventh of nBands bands
+static void DefineBenchSegments(LEDSegs *strip, short nLEDs, short nSegs, short nBands) {
+  static const short actions[] = {cSegActionFromBottom, cSegActionFromTop, cSegActionFromMiddle,
+                                  cSegActionAll, cSegActionRandom, cSegActionBits};
+  short iseg, seglen;
+
+  seglen = max(nLEDs / nSegs, 1);
+  for (iseg = 0; iseg < nSegs; iseg++) {
+    strip->DefineSegment((iseg * seglen) % nLEDs, seglen, actions[iseg % _LEDSEGS_CNT(actions)],
+                         RGBBlue, LEDSegs::BandRange(((iseg % 5) + 1) * nBands / cSegNumBands,
+                                                     ((iseg % 5) + 2) * nBands / cSegNumBands - 1));
+    strip->SetSegment_BackColor(RGBRedVeryDim);
+    strip->SetSegment_BitsPtr(BenchBits);
+    strip->SetSegment_RandomPattern(iseg);
+  }
+}
+
+int main(int argc, char **argv) {
+  long leds[cBenchMaxList] = {160, 480, 2000};
+  long segs[cBenchMaxList] = {3, 30, 100};
+  short nleds = 3, nsegs = 3;
+  long frames = 2000, iframe, periodMS = 0, maxSkip = 0;
+  const char *device = NULL, *wavPath = NULL, *synthName = NULL;
+  short synthProgram = -1, fftBands = 0;
+  LEDSpectrumSynth synth;
+  LEDSpectrumPCM pcm;
+  static LEDSpectrumFFT fft;
+  bool async = false, silence = false;
+  LPD8806FdSink sink;
+  LPD8806TransferRoutine sendFn = NULL;
+  void *sendPtr = NULL;
+  short il, is, i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--leds") && (i + 1 < argc)) nleds = ParseList(argv[++i], leds);
+    else if (!strcmp(argv[i], "--segs") && (i + 1 < argc)) nsegs = ParseList(argv[++i], segs);
+    else if (!strcmp(argv[i], "--frames") && (i + 1 < argc)) frames = strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--device") && (i + 1 < argc)) device = argv[++i];
+    else if (!strcmp(argv[i], "--wire-mhz") && (i + 1 < argc)) BenchWireMHz = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "--async")) async = true;
+    else if (!strcmp(argv[i], "--period-ms") && (i + 1 < argc)) periodMS = strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--silence")) silence = true;
+    else if (!strcmp(argv[i], "--skip-unchanged") && (i + 1 < argc)) maxSkip = strtol(argv[++i], NULL, 10);
+    else if (!strcmp(argv[i], "--synth") && (i + 1 < argc)) synthName = argv[++i];
+    else if (!strcmp(argv[i], "--wav") && (i + 1 < argc)) wavPath = argv[++i];
+    else if (!strcmp(argv[i], "--fft") && (i + 1 < argc)) fftBands = (short) strtol(argv[++i], NULL, 10);
+    else {
+      fprintf(stderr, "usage: %s [--leds n[,n...]] [--segs n[,n...]] [--frames n] [--device path]\n"
+                      "       [--wire-mhz f] [--async] [--period-ms n] [--skip-unchanged n] [--silence]\n"
+                      "       [--synth sweep|beat|silence|cycle] [--wav path] [--fft bands]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (i = 0; i < (short) _LEDSEGS_CNT(BenchBits); i++) BenchBits[i] = 0x0F0F3C3CUL ^ ((uint32_t) i * 0x9E3779B9UL);
+  ShimSetAnalogRead(silence ? NULL : BenchAnalogRead);
+  ShimSetDelay(NULL);
+  if (device) {
+    if (!LPD8806FdOpen(&sink, device, 2000000)) {perror(device); return 1;}
+    sendFn = LPD8806FdTransfer;
+    sendPtr = &sink;
+  }
+  else if (BenchWireMHz > 0) sendFn = BenchWireTransfer;
+  if (async && !sendFn) {
+    fprintf(stderr, "--async needs --device or --wire-mhz\n");
+    return 2;
+  }
+  if (synthName && ((synthProgram = ParseSynthProgram(synthName)) < 0)) {
+    fprintf(stderr, "unknown --synth program %s\n", synthName);
+    return 2;
+  }
+  if (wavPath && !LEDSpectrumPCMOpen(&pcm, wavPath, periodMS ? (short) periodMS : 20)) {perror(wavPath); return 1;}
+  if (fftBands && (!wavPath || !fft.Begin(pcm.sampleRate, cMaxFFTSize, fftBands))) {
+    fprintf(stderr, "--fft needs --wav and 1..%d bands that fit the sample rate\n", cMaxBands);
+    return 2;
+  }
+
+  for (il = 0; il < nleds; il++) {
+    for (is = 0; is < nsegs; is++) {
+      if ((leds[il] < 1) || (leds[il] > 10000) || (segs[is] < 1) || (segs[is] > cMaxSegments)) {
+        fprintf(stderr, "skipping leds=%ld segs=%ld (out of range)\n", leds[il], segs[is]);
+        continue;
+      }
+      LEDSegs *strip = new LEDSegs((short) leds[il]);
+      DefineBenchSegments(strip, (short) leds[il], (short) segs[is], fftBands ? fftBands : cSegNumBands);
+      LPD8806ThreadSender *sender = NULL;
+      if (async) {
+        sender = new LPD8806ThreadSender(sendFn, sendPtr);
+        strip->SetStripAsyncTransfer(LPD8806ThreadSender::Start, LPD8806ThreadSender::Wait, sender);
+      }
+      else if (sendFn) strip->SetStripTransfer(sendFn, sendPtr);
+      strip->SetStripSkipUnchanged((unsigned short) maxSkip);
+      if (wavPath) {
+        LEDSpectrumPCMClose(&pcm);
+        LEDSpectrumPCMOpen(&pcm, wavPath, periodMS ? (short) periodMS : 20);
+        if (fftBands) {
+          pcm.fft = &fft;
+          fft.Begin(pcm.sampleRate, cMaxFFTSize, fftBands);
+        }
+        strip->SetSpectrumSource(LEDSpectrumPCMRead, &pcm, fftBands ? fftBands : cSegNumBands);
+      }
+      else if (synthProgram >= 0) {
+        LEDSpectrumSynthInit(&synth, synthProgram, 1);
+        strip->SetSpectrumSource(LEDSpectrumSynthRead, &synth);
+      }
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), t0;
+      double blocked = 0;
+      for (iframe = 0; iframe < frames; iframe++) {
+        if (periodMS) std::this_thread::sleep_until(start + std::chrono::milliseconds(iframe * periodMS));
+        t0 = std::chrono::steady_clock::now();
+        strip->DisplayStrip(true, true);
+        blocked += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      }
+      double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      printf("leds=%ld segs=%ld frames=%ld seconds=%.4f fps=%.1f us_per_frame=%.2f us_in_display=%.2f\n",
+             leds[il], segs[is], frames, secs, frames / secs, (secs * 1e6) / frames, (blocked * 1e6) / frames);
+#if defined LEDSEGS_STATS
+      strip->DumpStats(Serial);
+#endif
+      delete strip;
+      delete sender;
+    }
+  }
+  if (device) {
+    if (sink.errors) fprintf(stderr, "%s: %lu failed frame writes\n", device, sink.errors);
+    LPD8806FdClose(&sink);
+  }
+  if (wavPath) LEDSpectrumPCMClose(&pcm);
+  return 0;
+}
@@ -0,0 +1,357 @@
+// ledsegs_stagebench: per-stage microbenchmarks for the LEDSegs display pipeline.
+//
+// Usage: ledsegs_stagebench [--out file] [--stage name] [--quick]
+//
+// Each pipeline stage is timed on its own over a fixed scenario matrix:
+//
+//   read_spectrum     ReadSpectrum() (14 analogRead()s and the strobe toggles)
+//   fft               LEDSpectrumFFT::Analyze() of both channels (44.1KHz noise and tones) by
+//                     transform size and band count
+//   map_bands         MapBandsToSegments() by segment count, band max/avg, rescaling and
+//                     fixed-point normalization (all segments have persistence)
+//   display_routines  The display-routine pass of ShowSegments() by segment count
+//   write_segments    The pixel-write pass of ShowSegments() by strip length, segment count,
+//                     action, spacing, part direction and segment options, with the specialized
+//                     run kernels ("runs":"kernel") and the generic WriteRun() loop ("generic")
+//   occlusion         WriteSegments() with a full-strip cSegActionAll segment drawn under the tiled
+//                     segments ("layer":"background") or over them ("cover"), with occlusion
+//                     culling on and off, by strip length and segment count
+//   blend             WriteSegments() with the tiled segments blended over a full-strip
+//                     cSegActionAll segment, by strip length, blend mode and run writer
+//   trails            WriteSegments() for 3 no-off-overwrite segments with the frame cleared
+//                     ("decay":"none") or the last one faded (SetPart_Decay(0, 32)), by strip length
+//   show              LPD8806::show() by strip length and output path: "per_byte" (SPI.transfer()
+//                     into the shim), "bulk" (one LPD8806TransferRoutine call, data discarded) and
+//                     "fd" (LPD8806FdTransfer to /dev/null), plus "skip_unchanged": the
+//                     SetStripSkipUnchanged() check on a rewritten but unchanged frame
+//   segment_churn     A sparse scene: every slot up to cMaxSegments was once defined, then all were
+//                     reset except the live ones (the lowest slots and the last). Times defining
+//                     and resetting one transient segment ("define_reset") and a
+//                     MapBandsToSegments() + WriteSegments() frame ("frame") by live segment count
+//
+// Strip lengths are 160, 480, 2000 and 10000 LEDs; segment counts are 3, 30 and 100, plus 2000 in
+// the ledsegs_stagebench_2k build (cMaxSegments = 2000). Results are written one JSON object per line
+// so runs can be diffed or loaded by a regression script. Every case reports the median and minimum
+// of several timed batches, in nanoseconds per call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "LEDSegs.h"
+#include "LPD8806FdTransfer.h"
+
+static const short BenchLEDs[] = {160, 480, 2000, 10000};
+#if cMaxSegments >= 2000
+static const short BenchSegs[] = {3, 30, 100, 2000};
+#else
+static const short BenchSegs[] = {3, 30, 100};
+#endif
+static const short BenchSpacings[] = {0, 1, 3};
+
+static const struct {short action; const char *name;} BenchActions[] = {
+  {cSegActionNone, "none"}, {cSegActionFromBottom, "from_bottom"}, {cSegActionFromTop, "from_top"},
+  {cSegActionFromMiddle, "from_middle"}, {cSegActionAll, "all"}, {cSegActionRandom, "random"},
+  {cSegActionBits, "bits"}};
+
+static const struct {short options; const char *name;} BenchOptions[] = {
+  {0, "none"}, {cSegOptNoOffOverwrite, "no_off_overwrite"}, {cSegOptModulateSegment, "modulate"}};
+
+static const struct {short blend; const char *name;} BenchBlends[] = {
+  {cSegBlendNone, "none"}, {cSegBlendAdd, "add"}, {cSegBlendMax, "max"}, {cSegBlendMultiply, "multiply"},
+  {cSegBlendAlpha, "alpha"}};
+
+static const short BenchRescale[] = {3, 100, 50, 500, 700, 900, 1000};
+
+const short cBenchBatches = 5;
+
+static FILE *BenchOut;
+static double BenchTargetNs = 2e6;  //Minimum duration of one timed batch
+static const char *BenchStage = NULL;
+static uint32_t BenchBits[(10000 + 31) / 32];
+
+//Deterministic "audio" for ReadSpectrum()
+static unsigned long BenchAnalogState = 12345;
+static int BenchAnalogRead(uint8_t) {
+  BenchAnalogState = BenchAnalogState * 1103515245UL + 12345UL;
+  return (int) ((BenchAnalogState >> 16) & 0x3FF);
+}
+
+static volatile short BenchSink;
+static void BenchDisplayRoutine(short iseg) {BenchSink = iseg;}
+static void BenchTransfer(const uint8_t *buf, uint16_t len, void *) {BenchSink = buf[len - 1];}
+
+static double NowNs() {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int CompareDouble(const void *a, const void *b) {
+  double da = *(const double *) a, db = *(const double *) b;
+  return (da < db) ? -1 : ((da > db) ? 1 : 0);
+}
+
+//Time fn(): pick an iteration count that fills BenchTargetNs, then take the median and
+//min over cBenchBatches batches. Emits one JSON line with the case description in "fields".
+template <class F> static void TimeCase(const char *stage, const char *fields, F fn) {
+  double t0, elapsed, samples[cBenchBatches];
+  long iters = 1, i;
+  short ib;
+
+  if (BenchStage && strcmp(BenchStage, stage)) return;
+
+  for (;;) {
+    t0 = NowNs();
+    for (i = 0; i < iters; i++) fn();
+    elapsed = NowNs() - t0;
+    if ((elapsed >= BenchTargetNs / 4) || (iters >= (1L << 26))) break;
+    iters *= 2;
+  }
+  iters = max(1L, (long) (iters * (BenchTargetNs / max(elapsed, 1.0))));
+
+  for (ib = 0; ib < cBenchBatches; ib++) {
+    t0 = NowNs();
+    for (i = 0; i < iters; i++) fn();
+    samples[ib] = (NowNs() - t0) / iters;
+  }
+  qsort(samples, cBenchBatches, sizeof(double), CompareDouble);
+
+  fprintf(BenchOut, "{\"stage\":\"%s\",%s,\"iters\":%ld,\"ns_median\":%.1f,\"ns_min\":%.1f}\n",
+          stage, fields, iters, samples[cBenchBatches / 2], samples[0]);
+  fflush(BenchOut);
+}
+
+/*
+Segment layout used by every scenario: nSegs equal segments tiling the strip, all in the given
+part, with fixed levels spread over [0..cMaxSegmentLevel] so the write pass is repeatable.
+*/
+
+static void DefineBenchSegments(LEDSegs *strip, short nLEDs, short nSegs, short action, short spacing,
+                                short options, short part) {
+  short iseg, seglen;
+
+  strip->ResetSegments();
+  strip->SetSegmentIndex(0);
+  seglen = max(nLEDs / nSegs, 1);
+  for (iseg = 0; iseg < nSegs; iseg++) {
+    strip->DefineSegment((iseg * seglen) % nLEDs, seglen, action, RGBBlue, cSegBand2 << (iseg % 5), part);
+    strip->SetSegment_BackColor(RGBRedVeryDim);
+    strip->SetSegment_Spacing(spacing);
+    strip->SetSegment_Options(options);
+    strip->SetSegment_BitsPtr(BenchBits);
+    strip->SetSegment_RandomPattern(iseg);
+    strip->SetSegment_Level(((long) iseg * 337 + 200) % (cMaxSegmentLevel + 1));
+  }
+}
+
+class LEDSegsBench {
+  public:
+    static void Run();
+};
+
+void LEDSegsBench::Run() {
+  char fields[256];
+  unsigned short il, is, ia, isp, io;
+  short dir, avg, rescale, fixed, generic;
+
+  //ReadSpectrum: independent of strip and segments
+  {
+    LEDSegs strip(160);
+    TimeCase("read_spectrum", "\"channels\":\"both\"", [&] {strip.ReadSpectrum(true, true);});
+    TimeCase("read_spectrum", "\"channels\":\"left\"", [&] {strip.ReadSpectrum(true, false);});
+  }
+
+  //LEDSpectrumFFT: the transform plus the band sums, independent of the strip
+  {
+    static const short sizes[] = {256, 1024, 2048}, bands[] = {16, 32, 64};
+    static LEDSpectrumFFT fft;
+    static int16_t pcm[2 * 2048];
+    short levels[cMaxBands];
+    unsigned long noise = 1;
+
+    for (short i = 0; i < 2048; i++) {
+      noise = noise * 1103515245UL + 12345UL;
+      pcm[2 * i] = (int16_t) (12000 * sin(2 * M_PI * 440 * i / 44100.0) + ((long) ((noise >> 16) & 0xFFF) - 2048));
+      pcm[2 * i + 1] = (int16_t) (12000 * sin(2 * M_PI * 3000 * i / 44100.0) + ((long) ((noise >> 20) & 0xFFF) - 2048));
+    }
+    for (is = 0; is < _LEDSEGS_CNT(sizes); is++) {
+      for (il = 0; il < _LEDSEGS_CNT(bands); il++) {
+        if (!fft.Begin(44100, sizes[is], bands[il])) continue;
+        fft.AddSamples(pcm, sizes[is], 2);
+        snprintf(fields, sizeof(fields), "\"size\":%d,\"bands\":%d", sizes[is], bands[il]);
+        TimeCase("fft", fields, [&] {fft.Analyze(levels, true, true);});
+      }
+    }
+  }
+
+  //MapBandsToSegments: depends on segment count and the per-segment band options
+  for (is = 0; is < _LEDSEGS_CNT(BenchSegs); is++) {
+    for (avg = 0; avg <= 1; avg++) {
+      for (rescale = 0; rescale <= 1; rescale++) {
+        for (fixed = 0; fixed <= 1; fixed++) {
+          LEDSegs strip(480);
+          DefineBenchSegments(&strip, 480, BenchSegs[is], cSegActionFromBottom, 0, avg ? cSegOptBandAvg : 0, 0);
+          for (short iseg = 0; iseg < BenchSegs[is]; iseg++) {
+            if (rescale) strip.SetSegment_Rescale(iseg, BenchRescale);
+            strip.SetSegment_Persistence(iseg, 200, 800);
+          }
+          strip.SetFixedPointLevels(fixed);
+          strip.ReadSpectrum(true, true);
+          snprintf(fields, sizeof(fields), "\"segs\":%d,\"band_mode\":\"%s\",\"rescale\":%s,\"fixed_point\":%s",
+                   BenchSegs[is], avg ? "avg" : "max", rescale ? "true" : "false", fixed ? "true" : "false");
+          TimeCase("map_bands", fields, [&] {strip.MapBandsToSegments();});
+        }
+      }
+    }
+  }
+
+  //Display-routine pass: every segment has a (trivial) routine
+  for (is = 0; is < _LEDSEGS_CNT(BenchSegs); is++) {
+    LEDSegs strip(480);
+    DefineBenchSegments(&strip, 480, BenchSegs[is], cSegActionFromBottom, 0, 0, 0);
+    for (short iseg = 0; iseg < BenchSegs[is]; iseg++) strip.SetSegment_DisplayRoutine(iseg, BenchDisplayRoutine);
+    snprintf(fields, sizeof(fields), "\"segs\":%d", BenchSegs[is]);
+    TimeCase("display_routines", fields, [&] {strip.RunDisplayRoutines();});
+  }
+
+  //Segment churn: the live segments are slots [0..segs-2] and the last slot (the high-water mark).
+  //There must be a free slot for the transient segment.
+  for (is = 0; (is < _LEDSEGS_CNT(BenchSegs)) && (BenchSegs[is] < cMaxSegments); is++) {
+    LEDSegs strip(480);
+    short transient;
+    DefineBenchSegments(&strip, 480, cMaxSegments, cSegActionFromBottom, 0, 0, 0);
+    for (short iseg = BenchSegs[is] - 1; iseg < cMaxSegments - 1; iseg++) strip.ResetSegment(iseg);
+    strip.ReadSpectrum(true, true);
+    snprintf(fields, sizeof(fields), "\"segs\":%d,\"op\":\"define_reset\"", BenchSegs[is]);
+    TimeCase("segment_churn", fields, [&] {
+      strip.SetSegmentIndex(0);
+      transient = strip.DefineSegment(0, 10, cSegActionFromBottom, RGBRed, cSegBand1);
+      strip.ResetSegment(transient);});
+    snprintf(fields, sizeof(fields), "\"segs\":%d,\"op\":\"frame\"", BenchSegs[is]);
+    TimeCase("segment_churn", fields, [&] {strip.MapBandsToSegments(); strip.WriteSegments();});
+  }
+
+  //Pixel-write pass and show(), per strip length
+  for (il = 0; il < _LEDSEGS_CNT(BenchLEDs); il++) {
+    LEDSegs strip(BenchLEDs[il]);
+    strip.DefinePart(1, 0, BenchLEDs[il], false);
+
+    for (is = 0; is < _LEDSEGS_CNT(BenchSegs); is++) {
+      for (ia = 0; ia < _LEDSEGS_CNT(BenchActions); ia++) {
+        for (isp = 0; isp < _LEDSEGS_CNT(BenchSpacings); isp++) {
+          for (dir = 0; dir <= 1; dir++) {
+            for (io = 0; io < _LEDSEGS_CNT(BenchOptions); io++) {
+              DefineBenchSegments(&strip, BenchLEDs[il], BenchSegs[is], BenchActions[ia].action,
+                                  BenchSpacings[isp], BenchOptions[io].options, dir);
+              for (generic = 0; generic <= 1; generic++) {
+                strip.stripGenericRuns = generic;
+                snprintf(fields, sizeof(fields),
+                         "\"leds\":%d,\"segs\":%d,\"action\":\"%s\",\"spacing\":%d,\"dir\":\"%s\",\"options\":\"%s\",\"runs\":\"%s\"",
+                         BenchLEDs[il], BenchSegs[is], BenchActions[ia].name, BenchSpacings[isp],
+                         dir ? "down" : "up", BenchOptions[io].name, generic ? "generic" : "kernel");
+                TimeCase("write_segments", fields, [&] {strip.WriteSegments();});
+              }
+              strip.stripGenericRuns = false;
+            }
+          }
+        }
+      }
+    }
+
+    //Occlusion culling: the first or last of segs + 1 segments made a full-strip All segment
+    for (is = 0; (is < _LEDSEGS_CNT(BenchSegs)) && (BenchSegs[is] < cMaxSegments); is++) {
+      for (short over = 0; over <= 1; over++) {
+        DefineBenchSegments(&strip, BenchLEDs[il], BenchSegs[is] + 1, cSegActionFromBottom, 0, 0, 0);
+        strip.SetSegmentIndex(over ? BenchSegs[is] : 0);
+        strip.SetSegment_FirstLED(0);
+        strip.SetSegment_NumLEDs(BenchLEDs[il]);
+        strip.SetSegment_Action(cSegActionAll);
+        for (short cull = 0; cull <= 1; cull++) {
+          strip.SetOcclusionCulling(cull);
+          snprintf(fields, sizeof(fields), "\"leds\":%d,\"segs\":%d,\"layer\":\"%s\",\"culling\":%s",
+                   BenchLEDs[il], BenchSegs[is], over ? "cover" : "background", cull ? "true" : "false");
+          TimeCase("occlusion", fields, [&] {strip.WriteSegments();});
+        }
+        strip.SetOcclusionCulling(true);
+      }
+    }
+
+    //Blending: 30 segments blended over a full-strip background (segment 0)
+    for (short ib = 0; ib < (short) _LEDSEGS_CNT(BenchBlends); ib++) {
+      DefineBenchSegments(&strip, BenchLEDs[il], 31, cSegActionFromBottom, 0, 0, 0);
+      for (short iseg = 1; iseg <= 30; iseg++) {
+        strip.SetSegment_Blend(iseg, BenchBlends[ib].blend);
+        strip.SetSegment_Opacity(iseg, 160);
+      }
+      strip.SetSegmentIndex(0);
+      strip.SetSegment_FirstLED(0);
+      strip.SetSegment_NumLEDs(BenchLEDs[il]);
+      strip.SetSegment_Action(cSegActionAll);
+      strip.SetSegment_ForeColor(RGBPurple);
+      for (generic = 0; generic <= 1; generic++) {
+        strip.stripGenericRuns = generic;
+        snprintf(fields, sizeof(fields), "\"leds\":%d,\"segs\":30,\"blend\":\"%s\",\"runs\":\"%s\"",
+                 BenchLEDs[il], BenchBlends[ib].name, generic ? "generic" : "kernel");
+        TimeCase("blend", fields, [&] {strip.WriteSegments();});
+      }
+      strip.stripGenericRuns = false;
+    }
+
+    //Trails: starting the frame from off vs. from the last one faded
+    DefineBenchSegments(&strip, BenchLEDs[il], 3, cSegActionFromBottom, 0, cSegOptNoOffOverwrite, 0);
+    for (short decay = 0; decay <= 1; decay++) {
+      strip.SetPart_Decay(0, decay ? 32 : cPartNoDecay);
+      snprintf(fields, sizeof(fields), "\"leds\":%d,\"segs\":3,\"decay\":\"%s\"", BenchLEDs[il], decay ? "32" : "none");
+      TimeCase("trails", fields, [&] {strip.WriteSegments();});
+    }
+    strip.SetPart_Decay(0, cPartNoDecay);
+
+    snprintf(fields, sizeof(fields), "\"leds\":%d,\"path\":\"per_byte\"", BenchLEDs[il]);
+    TimeCase("show", fields, [&] {strip.objLPDStrip->show();});
+
+    strip.SetStripTransfer(BenchTransfer, NULL);
+    snprintf(fields, sizeof(fields), "\"leds\":%d,\"path\":\"bulk\"", BenchLEDs[il]);
+    TimeCase("show", fields, [&] {strip.objLPDStrip->show();});
+
+    LPD8806FdSink sink;
+    if (LPD8806FdOpen(&sink, "/dev/null", 0)) {
+      strip.SetStripTransfer(LPD8806FdTransfer, &sink);
+      snprintf(fields, sizeof(fields), "\"leds\":%d,\"path\":\"fd\"", BenchLEDs[il]);
+      TimeCase("show", fields, [&] {strip.objLPDStrip->show();});
+      LPD8806FdClose(&sink);
+    }
+    strip.SetStripTransfer(NULL, NULL);
+
+    strip.SetStripSkipUnchanged(0xFFFF);
+    strip.objLPDStrip->show();
+    snprintf(fields, sizeof(fields), "\"leds\":%d,\"path\":\"skip_unchanged\"", BenchLEDs[il]);
+    TimeCase("show", fields, [&] {strip.objLPDStrip->setPixelColor(0, strip.objLPDStrip->getPixelColor(0));
+                                  strip.objLPDStrip->show();});
+    strip.SetStripSkipUnchanged(0);
+  }
+}
+
+int main(int argc, char **argv) {
+  short i;
+
+  BenchOut = stdout;
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--out") && (i + 1 < argc)) {
+      if (!(BenchOut = fopen(argv[++i], "w"))) {perror(argv[i]); return 1;}
+    }
+    else if (!strcmp(argv[i], "--stage") && (i + 1 < argc)) BenchStage = argv[++i];
+    else if (!strcmp(argv[i], "--quick")) BenchTargetNs = 2e5;
+    else {
+      fprintf(stderr, "usage: %s [--out file] [--stage name] [--quick]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (i = 0; i < (short) _LEDSEGS_CNT(BenchBits); i++) BenchBits[i] = 0x0F0F3C3CUL ^ ((uint32_t) i * 0x9E3779B9UL);
+  ShimSetAnalogRead(BenchAnalogRead);
+  ShimSetDelay(NULL);
+
+  LEDSegsBench::Run();
+
+  if (BenchOut != stdout) fclose(BenchOut);
+  return 0;
+}
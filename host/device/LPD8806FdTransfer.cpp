@@ -0,0 +1,71 @@
+// LPD8806FdTransfer.cpp: write LPD8806 frames to a spidev device, file or pipe
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/spi/spidev.h>
+#include "LPD8806FdTransfer.h"
+
+static void LPD8806FdInit(LPD8806FdSink *sink, int fd, bool spidev, bool ownFd) {
+  sink->fd = fd;
+  sink->spidev = spidev;
+  sink->ownFd = ownFd;
+  sink->frames = 0;
+  sink->errors = 0;
+}
+
+bool LPD8806FdOpen(LPD8806FdSink *sink, const char *path, uint32_t speedHz) {
+  struct stat st;
+  uint8_t mode = SPI_MODE_0, bits = 8;
+  bool spidev;
+  int fd, err;
+
+  LPD8806FdInit(sink, -1, false, false);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+
+  spidev = (fstat(fd, &st) == 0) && S_ISCHR(st.st_mode) && (ioctl(fd, SPI_IOC_WR_MODE, &mode) == 0);
+  if (spidev) {
+    if ((ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+        (speedHz && (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz) < 0))) {
+      err = errno;
+      close(fd);
+      errno = err;
+      return false;
+    }
+  }
+  LPD8806FdInit(sink, fd, spidev, true);
+  return true;
+}
+
+void LPD8806FdAttach(LPD8806FdSink *sink, int fd) {LPD8806FdInit(sink, fd, false, false);}
+
+void LPD8806FdClose(LPD8806FdSink *sink) {
+  if (sink->ownFd && (sink->fd >= 0)) close(sink->fd);
+  sink->fd = -1;
+}
+
+//One write() per frame, except spidev which is limited to cLPD8806FdChunk bytes per transfer. The
+//LPD8806 has no frame framing beyond the latch bytes, so splitting a frame is harmless.
+void LPD8806FdTransfer(const uint8_t *buf, uint16_t len, void *ptr) {
+  LPD8806FdSink *sink = (LPD8806FdSink *) ptr;
+  size_t chunk;
+  ssize_t n;
+
+  if (sink->fd < 0) {sink->errors++; return;}
+  while (len > 0) {
+    chunk = (sink->spidev && (len > cLPD8806FdChunk)) ? cLPD8806FdChunk : len;
+    n = write(sink->fd, buf, chunk);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      sink->errors++;
+      return;
+    }
+    if (n == 0) {sink->errors++; return;}
+    buf += n;
+    len -= (uint16_t) n;
+  }
+  sink->frames++;
+}
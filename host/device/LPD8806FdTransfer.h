@@ -0,0 +1,40 @@
+// LPD8806FdTransfer.h: host (Linux) bulk output for LPD8806::setTransfer().
+//
+// Each show() is written to a file descriptor in as few write()s as possible. The descriptor can be a
+// spidev device (/dev/spidevB.C), in which case LPD8806FdOpen() also sets SPI mode 0, 8 bits per word
+// and the clock rate, or any plain file, FIFO or pipe as a stand-in for capture and testing.
+//
+//   LPD8806FdSink sink;
+//   if (LPD8806FdOpen(&sink, "/dev/spidev0.0", 2000000)) strip->SetStripTransfer(LPD8806FdTransfer, &sink);
+//   ...
+//   LPD8806FdClose(&sink);
+
+#ifndef _LPD8806FdTransfer_h
+#define _LPD8806FdTransfer_h
+
+#include <stdint.h>
+
+//spidev rejects transfers larger than its bufsiz module parameter (4096 by default)
+const uint16_t cLPD8806FdChunk = 4096;
+
+struct LPD8806FdSink {
+  int fd;
+  bool spidev;            //fd is a spidev device (chunk writes to cLPD8806FdChunk)
+  bool ownFd;             //LPD8806FdClose() closes fd
+  unsigned long frames;   //show() calls written
+  unsigned long errors;   //show() calls that failed or were cut short
+};
+
+//Open path for writing (created or truncated if it is not a device). speedHz is only used for spidev;
+//0 leaves the device's current rate. Returns false (and sets errno) if it can't be opened or configured.
+bool LPD8806FdOpen(LPD8806FdSink *, const char *path, uint32_t speedHz);
+
+//Use an already open descriptor (stdout, a pipe, ...). It is not closed by LPD8806FdClose().
+void LPD8806FdAttach(LPD8806FdSink *, int fd);
+
+void LPD8806FdClose(LPD8806FdSink *);
+
+//The LPD8806TransferRoutine; ptr is the LPD8806FdSink
+void LPD8806FdTransfer(const uint8_t *buf, uint16_t len, void *ptr);
+
+#endif //_LPD8806FdTransfer_h
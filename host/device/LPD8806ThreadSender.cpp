@@ -0,0 +1,50 @@
+// LPD8806ThreadSender.cpp: send LPD8806 frames from a background thread
+
+#include "LPD8806ThreadSender.h"
+
+LPD8806ThreadSender::LPD8806ThreadSender(LPD8806TransferRoutine fn, void *ptr)
+    : sendFn(fn), sendPtr(ptr), pendingBuf(NULL), pendingLen(0), stopping(false), sentFrames(0),
+      sender(&LPD8806ThreadSender::SendLoop, this) {}
+
+LPD8806ThreadSender::~LPD8806ThreadSender() {
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    stopping = true;
+  }
+  cond.notify_all();
+  sender.join();
+}
+
+//LPD8806 only starts a send after the previous one was waited for, so there's never more than one pending
+void LPD8806ThreadSender::Start(const uint8_t *buf, uint16_t len, void *ptr) {
+  LPD8806ThreadSender *self = (LPD8806ThreadSender *) ptr;
+  {
+    std::unique_lock<std::mutex> guard(self->lock);
+    self->cond.wait(guard, [self] {return self->pendingBuf == NULL;});
+    self->pendingBuf = buf;
+    self->pendingLen = len;
+  }
+  self->cond.notify_all();
+}
+
+void LPD8806ThreadSender::Wait(void *ptr) {
+  LPD8806ThreadSender *self = (LPD8806ThreadSender *) ptr;
+  std::unique_lock<std::mutex> guard(self->lock);
+  self->cond.wait(guard, [self] {return self->pendingBuf == NULL;});
+}
+
+void LPD8806ThreadSender::SendLoop() {
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    cond.wait(guard, [this] {return (pendingBuf != NULL) || stopping;});
+    if (pendingBuf == NULL) return;  //Stopping and nothing left to send
+
+    guard.unlock();
+    sendFn(pendingBuf, pendingLen, sendPtr);
+    guard.lock();
+
+    pendingBuf = NULL;
+    sentFrames++;
+    cond.notify_all();
+  }
+}
@@ -0,0 +1,44 @@
+// LPD8806ThreadSender.h: host (Linux) background sender for LPD8806::setAsyncTransfer().
+//
+// Runs any blocking LPD8806TransferRoutine (e.g. LPD8806FdTransfer) on its own thread so show() only
+// starts the send. Start() hands the frame to the thread; Wait() blocks until the thread is done with it.
+//
+//   LPD8806ThreadSender sender(LPD8806FdTransfer, &sink);
+//   strip->SetStripAsyncTransfer(LPD8806ThreadSender::Start, LPD8806ThreadSender::Wait, &sender);
+//
+// The sender must outlive the strip's use of it (or call SetStripTransfer(NULL, NULL) first).
+
+#ifndef _LPD8806ThreadSender_h
+#define _LPD8806ThreadSender_h
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "LPD8806.h"
+
+class LPD8806ThreadSender {
+  public:
+    LPD8806ThreadSender(LPD8806TransferRoutine, void *);
+    ~LPD8806ThreadSender();
+
+    //The LPD8806TransferRoutine/LPD8806WaitRoutine pair; ptr is the LPD8806ThreadSender
+    static void Start(const uint8_t *buf, uint16_t len, void *ptr);
+    static void Wait(void *ptr);
+
+    unsigned long Frames() {return sentFrames;}
+
+  private:
+    void SendLoop();
+
+    LPD8806TransferRoutine sendFn;
+    void *sendPtr;
+    std::mutex lock;
+    std::condition_variable cond;
+    const uint8_t *pendingBuf;  //The frame to send; NULL when the thread is idle
+    uint16_t pendingLen;
+    bool stopping;
+    unsigned long sentFrames;
+    std::thread sender;
+};
+
+#endif //_LPD8806ThreadSender_h
@@ -0,0 +1,101 @@
+// Arduino.h: host (Linux) shim so LEDSegs and LPD8806 build off-board.
+//
+// Only the subset of the Arduino core that the library touches is provided. Each hardware-facing
+// call goes through a replaceable backend routine (see the ShimSet... functions below), so a
+// benchmark or test can substitute a virtual clock, canned analog samples, a deterministic random
+// generator, or capture pin/SPI traffic. Passing NULL to any ShimSet... call restores the default.
+
+#ifndef _ARDUINO_SHIM_h
+#define _ARDUINO_SHIM_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <type_traits>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+//Arduino's min/max/constrain are macros; these templates take mixed argument types the same way
+//without breaking the standard library headers.
+
+template <class T, class U> inline typename std::common_type<T, U>::type min(T a, U b) {return (a < b) ? a : b;}
+template <class T, class U> inline typename std::common_type<T, U>::type max(T a, U b) {return (a > b) ? a : b;}
+template <class T, class L, class H> inline T constrain(T x, L lo, H hi) {return (x < lo) ? lo : ((x > hi) ? hi : x);}
+
+//Core API
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+int  analogRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t val);
+void pinMode(uint8_t pin, uint8_t mode);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+//Print/Serial. Serial writes to stdout.
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t print(const char[]);
+    size_t print(char);
+    size_t print(unsigned char, int = DEC);
+    size_t print(int, int = DEC);
+    size_t print(unsigned int, int = DEC);
+    size_t print(long, int = DEC);
+    size_t print(unsigned long, int = DEC);
+    size_t print(double, int = 2);
+    size_t println(void);
+    template <class T> size_t println(T val) {size_t n = print(val); return n + println();}
+    template <class T> size_t println(T val, int fmt) {size_t n = print(val, fmt); return n + println();}
+};
+
+class HardwareSerial : public Print {
+  public:
+    void begin(unsigned long) {}
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buffer, size_t size);
+};
+
+extern HardwareSerial Serial;
+
+//Pluggable backends
+
+typedef unsigned long (*ShimClockRoutine) (void);
+typedef void (*ShimDelayRoutine) (unsigned long);
+typedef int  (*ShimAnalogReadRoutine) (uint8_t);
+typedef void (*ShimDigitalWriteRoutine) (uint8_t, uint8_t);
+typedef void (*ShimPinModeRoutine) (uint8_t, uint8_t);
+typedef long (*ShimRandomRoutine) (long);
+typedef void (*ShimRandomSeedRoutine) (unsigned long);
+
+void ShimSetMillis(ShimClockRoutine);              //Default: monotonic host clock
+void ShimSetMicros(ShimClockRoutine);              //Default: monotonic host clock
+void ShimSetDelay(ShimDelayRoutine);               //Default: host sleep (ms)
+void ShimSetAnalogRead(ShimAnalogReadRoutine);     //Default: always 0 (silence)
+void ShimSetDigitalWrite(ShimDigitalWriteRoutine); //Default: discard
+void ShimSetPinMode(ShimPinModeRoutine);           //Default: discard
+void ShimSetRandom(ShimRandomRoutine, ShimRandomSeedRoutine); //Default: seedable LCG, [0..howbig)
+
+#endif //_ARDUINO_SHIM_h
@@ -0,0 +1,135 @@
+// ArduinoShim.cpp: default host backends for the Arduino.h/SPI.h shim
+
+#include <stdio.h>
+#include <time.h>
+#include "Arduino.h"
+#include "SPI.h"
+
+/* Default backends */
+
+static unsigned long long ShimNowMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((unsigned long long) ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+static unsigned long long ShimEpochMicros = ShimNowMicros();
+
+static unsigned long ShimDefaultMillis() {return (unsigned long) ((ShimNowMicros() - ShimEpochMicros) / 1000);}
+static unsigned long ShimDefaultMicros() {return (unsigned long) (ShimNowMicros() - ShimEpochMicros);}
+
+static void ShimDefaultDelay(unsigned long ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
+
+static int  ShimDefaultAnalogRead(uint8_t) {return 0;}
+static void ShimDefaultDigitalWrite(uint8_t, uint8_t) {}
+static void ShimDefaultPinMode(uint8_t, uint8_t) {}
+
+//Same LCG as the C standard's example rand(), so runs are repeatable for a given seed
+static unsigned long ShimRandomState = 1;
+static long ShimDefaultRandom(long howbig) {
+  if (howbig <= 0) return 0;
+  ShimRandomState = ShimRandomState * 1103515245UL + 12345UL;
+  return (long) ((ShimRandomState >> 16) & 0x7FFF) % howbig;
+}
+static void ShimDefaultRandomSeed(unsigned long seed) {ShimRandomState = seed;}
+
+static uint8_t ShimDefaultSPITransfer(uint8_t) {return 0;}
+
+/* Installed backends */
+
+static ShimClockRoutine        ShimMillis = ShimDefaultMillis;
+static ShimClockRoutine        ShimMicros = ShimDefaultMicros;
+static ShimDelayRoutine        ShimDelay = ShimDefaultDelay;
+static ShimAnalogReadRoutine   ShimAnalogRead = ShimDefaultAnalogRead;
+static ShimDigitalWriteRoutine ShimDigitalWrite = ShimDefaultDigitalWrite;
+static ShimPinModeRoutine      ShimPinMode = ShimDefaultPinMode;
+static ShimRandomRoutine       ShimRandom = ShimDefaultRandom;
+static ShimRandomSeedRoutine   ShimRandomSeed = ShimDefaultRandomSeed;
+static ShimSPITransferRoutine  ShimSPITransfer = ShimDefaultSPITransfer;
+
+void ShimSetMillis(ShimClockRoutine r) {ShimMillis = r ? r : ShimDefaultMillis;}
+void ShimSetMicros(ShimClockRoutine r) {ShimMicros = r ? r : ShimDefaultMicros;}
+void ShimSetDelay(ShimDelayRoutine r) {ShimDelay = r ? r : ShimDefaultDelay;}
+void ShimSetAnalogRead(ShimAnalogReadRoutine r) {ShimAnalogRead = r ? r : ShimDefaultAnalogRead;}
+void ShimSetDigitalWrite(ShimDigitalWriteRoutine r) {ShimDigitalWrite = r ? r : ShimDefaultDigitalWrite;}
+void ShimSetPinMode(ShimPinModeRoutine r) {ShimPinMode = r ? r : ShimDefaultPinMode;}
+void ShimSetRandom(ShimRandomRoutine r, ShimRandomSeedRoutine s) {
+  ShimRandom = r ? r : ShimDefaultRandom;
+  ShimRandomSeed = s ? s : ShimDefaultRandomSeed;
+}
+void ShimSetSPITransfer(ShimSPITransferRoutine r) {ShimSPITransfer = r ? r : ShimDefaultSPITransfer;}
+
+/* Core API */
+
+unsigned long millis(void) {return ShimMillis();}
+unsigned long micros(void) {return ShimMicros();}
+void delay(unsigned long ms) {ShimDelay(ms);}
+void delayMicroseconds(unsigned int us) {
+  unsigned long start = micros();
+  while ((micros() - start) < us) {}
+}
+int  analogRead(uint8_t pin) {return ShimAnalogRead(pin);}
+void digitalWrite(uint8_t pin, uint8_t val) {ShimDigitalWrite(pin, val);}
+void pinMode(uint8_t pin, uint8_t mode) {ShimPinMode(pin, mode);}
+long random(long howbig) {return ShimRandom(howbig);}
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) return howsmall;
+  return howsmall + ShimRandom(howbig - howsmall);
+}
+void randomSeed(unsigned long seed) {ShimRandomSeed(seed);}
+
+/* Print/Serial */
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) n += write(*buffer++);
+  return n;
+}
+
+size_t Print::print(const char str[]) {return write((const uint8_t *) str, strlen(str));}
+size_t Print::print(char c) {return write((uint8_t) c);}
+size_t Print::print(unsigned char b, int base) {return print((unsigned long) b, base);}
+size_t Print::print(int n, int base) {return print((long) n, base);}
+size_t Print::print(unsigned int n, int base) {return print((unsigned long) n, base);}
+
+size_t Print::print(long n, int base) {
+  if ((base == DEC) && (n < 0)) return print('-') + print((unsigned long) -n, base);
+  return print((unsigned long) n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *p = &buf[sizeof(buf) - 1];
+  if (base < 2) base = DEC;
+  *p = 0;
+  do {
+    unsigned long d = n % base;
+    *--p = (char) ((d < 10) ? ('0' + d) : ('A' + d - 10));
+    n /= base;
+  } while (n);
+  return print(p);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return print(buf);
+}
+
+size_t Print::println(void) {return print("\r\n");}
+
+HardwareSerial Serial;
+
+size_t HardwareSerial::write(uint8_t c) {return fputc(c, stdout) == EOF ? 0 : 1;}
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {return fwrite(buffer, 1, size, stdout);}
+
+/* SPI */
+
+SPIClass SPI;
+
+uint8_t SPIClass::transfer(uint8_t data) {return ShimSPITransfer(data);}
@@ -0,0 +1,34 @@
+// SPI.h: host (Linux) shim for the Arduino SPI library.
+//
+// SPI.transfer() hands each byte to a replaceable backend (ShimSetSPITransfer); the default
+// discards the data and returns 0. The clock/mode settings are recorded but otherwise ignored.
+
+#ifndef _SPI_SHIM_h
+#define _SPI_SHIM_h
+
+#include <Arduino.h>
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+typedef uint8_t (*ShimSPITransferRoutine) (uint8_t);
+
+void ShimSetSPITransfer(ShimSPITransferRoutine); //NULL restores the default (discard)
+
+class SPIClass {
+  public:
+    void begin(void) {}
+    void end(void) {}
+    void setBitOrder(uint8_t order) {bitOrder = order;}
+    void setDataMode(uint8_t mode) {dataMode = mode;}
+    void setClockDivider(uint8_t div) {clockDivider = div;}
+    uint8_t transfer(uint8_t data);
+
+    uint8_t bitOrder, dataMode, clockDivider;
+};
+
+extern SPIClass SPI;
+
+#endif //_SPI_SHIM_h
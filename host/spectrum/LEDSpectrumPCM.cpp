@@ -0,0 +1,208 @@
+// LEDSpectrumPCM.cpp: band levels from a WAV file through a model of the MSGEQ7 filters
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LEDSpectrumPCM.h"
+
+//The MSGEQ7's band centers (see cSegBand1..7), and the filter Q that makes neighbouring bands (2.5x
+//apart) cross about 3dB down
+static const float PCMBandHz[cSegNumBands] = {63, 160, 400, 1000, 2500, 6250, 16000};
+const float cPCMBandQ = 1.05f;
+
+static uint32_t ReadLE(const uint8_t *p, short n) {
+  uint32_t v = 0;
+  while (n-- > 0) v = (v << 8) | p[n];
+  return v;
+}
+
+//Constant 0dB peak gain band-pass biquads (the RBJ audio EQ cookbook BPF)
+static void PCMInitFilters(LEDSpectrumPCM *pcm) {
+  short iBand;
+  float w0, alpha, a0;
+
+  memset(pcm->state, 0, sizeof(pcm->state));
+  for (iBand = 0; iBand < cSegNumBands; iBand++) {
+    memset(pcm->coef[iBand], 0, sizeof(pcm->coef[iBand]));
+    if (PCMBandHz[iBand] >= 0.45f * pcm->sampleRate) continue;
+    w0 = 2 * (float) M_PI * PCMBandHz[iBand] / pcm->sampleRate;
+    alpha = sinf(w0) / (2 * cPCMBandQ);
+    a0 = 1 + alpha;
+    pcm->coef[iBand][0] = alpha / a0;
+    pcm->coef[iBand][1] = 0;
+    pcm->coef[iBand][2] = -alpha / a0;
+    pcm->coef[iBand][3] = -2 * cosf(w0) / a0;
+    pcm->coef[iBand][4] = (1 - alpha) / a0;
+  }
+}
+
+//Find the fmt and data chunks. Anything else (LIST, fact, ...) is skipped.
+static bool PCMReadHeader(LEDSpectrumPCM *pcm) {
+  uint8_t hdr[40];
+  uint32_t size, format;
+  long fileLen;
+  bool haveFmt = false;
+
+  if ((fseek(pcm->file, 0, SEEK_END) != 0) || ((fileLen = ftell(pcm->file)) < 0) || (fseek(pcm->file, 0, SEEK_SET) != 0)) return false;
+  if ((fread(hdr, 1, 12, pcm->file) != 12) || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) return false;
+  while (fread(hdr, 1, 8, pcm->file) == 8) {
+    size = ReadLE(hdr + 4, 4);
+    if (!memcmp(hdr, "fmt ", 4)) {
+      if ((size < 16) || (fread(hdr, 1, min(size, (uint32_t) sizeof(hdr)), pcm->file) != min(size, (uint32_t) sizeof(hdr)))) return false;
+      format = ReadLE(hdr, 2);
+      if ((format == 0xFFFE) && (size >= 26)) format = ReadLE(hdr + 24, 2); //WAVE_FORMAT_EXTENSIBLE sub-format
+      pcm->channels = (short) ReadLE(hdr + 2, 2);
+      pcm->sampleRate = ReadLE(hdr + 4, 4);
+      pcm->bytesPerSample = (short) (ReadLE(hdr + 14, 2) / 8);
+      if ((format != 1) || (pcm->channels < 1) || (pcm->sampleRate < 1000) ||
+          ((pcm->bytesPerSample != 1) && (pcm->bytesPerSample != 2)) ||
+          (ReadLE(hdr + 12, 2) != (uint32_t) (pcm->channels * pcm->bytesPerSample))) return false;
+      haveFmt = true;
+      if (size > sizeof(hdr)) fseek(pcm->file, size - sizeof(hdr), SEEK_CUR);
+      if (size & 1) fseek(pcm->file, 1, SEEK_CUR);
+    }
+    else if (!memcmp(hdr, "data", 4)) {
+      if (!haveFmt) return false;
+      pcm->dataStart = ftell(pcm->file);
+      pcm->dataBytes = (uint32_t) min((long) size, fileLen - pcm->dataStart); //Streamed files leave size unset
+      pcm->dataBytes -= pcm->dataBytes % (pcm->channels * pcm->bytesPerSample);
+      return true;
+    }
+    else if (fseek(pcm->file, size + (size & 1), SEEK_CUR) != 0) return false;
+  }
+  return false;
+}
+
+bool LEDSpectrumPCMOpen(LEDSpectrumPCM *pcm, const char *path, short frameMS) {
+  memset(pcm, 0, sizeof(*pcm));
+  pcm->loop = true;
+  pcm->gain = 1;
+  pcm->file = fopen(path, "rb");
+  if (!pcm->file) return false;
+  if (!PCMReadHeader(pcm)) {
+    LEDSpectrumPCMClose(pcm);
+    errno = EINVAL;
+    return false;
+  }
+  pcm->frameSamples = max((uint32_t) ((uint64_t) pcm->sampleRate * max(frameMS, (short) 1) / 1000), (uint32_t) 1);
+  pcm->buf = (uint8_t *) malloc(pcm->frameSamples * pcm->channels * pcm->bytesPerSample);
+  pcm->work = (float *) malloc(pcm->frameSamples * sizeof(float));
+  if (!pcm->buf || !pcm->work) {
+    LEDSpectrumPCMClose(pcm);
+    errno = ENOMEM;
+    return false;
+  }
+  PCMInitFilters(pcm);
+  fseek(pcm->file, pcm->dataStart, SEEK_SET);
+  return true;
+}
+
+void LEDSpectrumPCMClose(LEDSpectrumPCM *pcm) {
+  if (pcm->file) fclose(pcm->file);
+  free(pcm->buf);
+  free(pcm->work);
+  pcm->file = NULL;
+  pcm->buf = NULL;
+  pcm->work = NULL;
+}
+
+//Fill buf with the next frame of audio, looping or padding with silence at the end of the data
+static void PCMFill(LEDSpectrumPCM *pcm) {
+  uint32_t need, got = 0, n;
+
+  need = pcm->frameSamples * pcm->channels * pcm->bytesPerSample;
+  while (got < need) {
+    if ((pcm->dataPos >= pcm->dataBytes) && pcm->loop && !pcm->ended && (pcm->dataBytes > 0)) {
+      fseek(pcm->file, pcm->dataStart, SEEK_SET);
+      pcm->dataPos = 0;
+    }
+    n = (pcm->dataPos < pcm->dataBytes) ? (uint32_t) fread(pcm->buf + got, 1, min(need - got, pcm->dataBytes - pcm->dataPos), pcm->file) : 0;
+    if (n == 0) {
+      pcm->ended = true;
+      memset(pcm->buf + got, (pcm->bytesPerSample == 1) ? 0x80 : 0, need - got);
+      break;
+    }
+    got += n;
+    pcm->dataPos += n;
+  }
+}
+
+//Decode channel chan of the frame in buf to floats in work
+static void PCMDecode(LEDSpectrumPCM *pcm, short chan) {
+  const uint8_t *p = pcm->buf + chan * pcm->bytesPerSample;
+  short stride = pcm->channels * pcm->bytesPerSample;
+  uint32_t i;
+
+  for (i = 0; i < pcm->frameSamples; i++, p += stride) {
+    if (pcm->bytesPerSample == 1) pcm->work[i] = (p[0] - 128) * (pcm->gain / 128);
+    else pcm->work[i] = (int16_t) ReadLE(p, 2) * (pcm->gain / 32768);
+  }
+}
+
+//Hand the frame in buf to the FFT, a block of 16-bit samples at a time
+static void PCMFeedFFT(LEDSpectrumPCM *pcm) {
+  const short cBlock = 256;
+  int16_t block[2 * cBlock];
+  const uint8_t *p = pcm->buf;
+  uint32_t i, done;
+  short nch, ich, n;
+
+  nch = (pcm->channels > 1) ? 2 : 1;
+  for (done = 0; done < pcm->frameSamples; done += n) {
+    n = (short) min(pcm->frameSamples - done, (uint32_t) cBlock);
+    for (i = 0; i < (uint32_t) n; i++, p += pcm->channels * pcm->bytesPerSample) {
+      for (ich = 0; ich < nch; ich++) {
+        if (pcm->bytesPerSample == 1) block[i * nch + ich] = (int16_t) ((p[ich] - 128) << 8);
+        else block[i * nch + ich] = (int16_t) ReadLE(p + 2 * ich, 2);
+      }
+    }
+    pcm->fft->AddSamples(block, n, nch);
+  }
+}
+
+void LEDSpectrumPCMRead(short *levels, bool doLeft, bool doRight, void *ptr) {
+  LEDSpectrumPCM *pcm = (LEDSpectrumPCM *) ptr;
+  float peak[cSegNumBands], chanPeak[cSegNumBands], s0[cSegNumBands], s1[cSegNumBands], x, y;
+  uint32_t i;
+  short iBand, ich, nch;
+  bool use;
+
+  PCMFill(pcm);
+  if (pcm->fft) {
+    PCMFeedFFT(pcm);
+    pcm->fft->Analyze(levels, doLeft, doRight);
+    return;
+  }
+
+  //Channel 0 is left and 1 right; a mono file is filtered once for both. Both are always filtered so
+  //a channel that wasn't read for a while picks up where the audio is. The bands are filtered side by
+  //side (rather than a band at a time), as they don't depend on each other.
+  nch = (pcm->channels > 1) ? 2 : 1;
+  for (iBand = 0; iBand < cSegNumBands; iBand++) peak[iBand] = 0;
+  for (ich = 0; ich < nch; ich++) {
+    use = (nch == 1) ? (doLeft || doRight) : ((ich == 0) ? doLeft : doRight);
+    PCMDecode(pcm, ich);
+    for (iBand = 0; iBand < cSegNumBands; iBand++) {
+      s0[iBand] = pcm->state[ich][iBand][0];
+      s1[iBand] = pcm->state[ich][iBand][1];
+      chanPeak[iBand] = 0;
+    }
+    for (i = 0; i < pcm->frameSamples; i++) {
+      x = pcm->work[i];
+      for (iBand = 0; iBand < cSegNumBands; iBand++) {
+        const float *c = pcm->coef[iBand];
+        y = c[0] * x + s0[iBand];
+        s0[iBand] = c[1] * x - c[3] * y + s1[iBand];
+        s1[iBand] = c[2] * x - c[4] * y;
+        chanPeak[iBand] = max(chanPeak[iBand], fabsf(y));
+      }
+    }
+    for (iBand = 0; iBand < cSegNumBands; iBand++) {
+      pcm->state[ich][iBand][0] = s0[iBand];
+      pcm->state[ich][iBand][1] = s1[iBand];
+      if (use) peak[iBand] = max(peak[iBand], chanPeak[iBand]);
+    }
+  }
+  for (iBand = 0; iBand < cSegNumBands; iBand++) levels[iBand] = (short) min(peak[iBand] * cMaxBandLevel + 0.5f, (float) cMaxBandLevel);
+}
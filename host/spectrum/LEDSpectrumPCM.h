@@ -0,0 +1,60 @@
+// LEDSpectrumPCM.h: band levels from a WAV file, for LEDSegs::SetSpectrumSource().
+//
+// Plays a PCM WAV file (8 or 16 bit, mono or stereo) through a software model of the shield's MSGEQ7:
+// seven band-pass filters at the chip's center frequencies (63Hz..16KHz) followed by peak detectors.
+// Each read consumes frameMS of audio, so the file plays back in step with the display frames however
+// fast they are actually run, and the same file always gives the same levels.
+//
+// A full-scale sine at a band's center frequency reads cMaxBandLevel. There is no noise floor to take
+// off (a file has none), so quiet passages read lower than on the shield. Bands at or above 0.45 of the
+// sample rate always read 0.
+//
+//   LEDSpectrumPCM pcm;
+//   if (LEDSpectrumPCMOpen(&pcm, "song.wav", 20)) strip->SetSpectrumSource(LEDSpectrumPCMRead, &pcm);
+//   ...
+//   LEDSpectrumPCMClose(&pcm);
+//
+// Setting fft (after opening) analyzes the audio with an LEDSpectrumFFT instead, for its band count:
+//
+//   LEDSpectrumFFT fft;
+//   pcm.fft = &fft;
+//   fft.Begin(pcm.sampleRate, 2048, 32);
+//   strip->SetSpectrumSource(LEDSpectrumPCMRead, &pcm, fft.GetNumBands());
+
+#ifndef _LEDSpectrumPCM_h
+#define _LEDSpectrumPCM_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include "LEDSegs.h"
+
+struct LEDSpectrumPCM {
+  FILE *file;
+  long dataStart;         //File offset of the sample data
+  uint32_t dataBytes;     //Sample data length
+  uint32_t dataPos;       //Bytes of it read so far
+  uint32_t sampleRate;
+  short channels;         //In the file; the first is left, the second (or the first again) right
+  short bytesPerSample;   //1 (unsigned) or 2 (signed, little-endian)
+  uint32_t frameSamples;  //Samples per channel consumed by each read
+  bool loop;              //Start over at the end of the file (default). Otherwise it reads silence.
+  bool ended;             //The end of the file was reached (and not looped)
+  float gain;             //Applied before the peak detectors (default 1, not used with fft)
+  LEDSpectrumFFT *fft;    //If set, reads feed it the audio and return its bands instead (default NULL)
+  uint8_t *buf;           //frameSamples sample frames as read
+  float *work;            //One channel of buf decoded
+  float coef[cSegNumBands][5];      //Band filters, b0 b1 b2 a1 a2 (all 0 for a band that's off)
+  float state[2][cSegNumBands][2];  //Filter state per channel and band
+};
+
+//Open path and check it is a PCM WAV file. Each read will consume frameMS (at least 1ms) of audio.
+//Returns false (and sets errno, EINVAL for a file that isn't PCM WAV) if it can't be used.
+bool LEDSpectrumPCMOpen(LEDSpectrumPCM *, const char *path, short frameMS);
+
+void LEDSpectrumPCMClose(LEDSpectrumPCM *);
+
+//The LEDSegs::SpectrumSourceRoutine; ptr is the LEDSpectrumPCM. With both channels each band is the max
+//of the two, as on the shield. Fills cSegNumBands levels, or the fft's band count.
+void LEDSpectrumPCMRead(short *levels, bool doLeft, bool doRight, void *ptr);
+
+#endif //_LEDSpectrumPCM_h
@@ -0,0 +1,81 @@
+// LEDSpectrumSynth.cpp: deterministic synthetic band levels (sweep, beat, silence)
+
+#include "LEDSpectrumSynth.h"
+
+//Sweep: band position is in 256ths of a band, and a band picks up the tone within cSweepReach of its
+//center, so neighbouring bands overlap the way the analyzer's filters do
+const short cSweepTop = (cSegNumBands - 1) * 256;
+const short cSweepReach = 384;
+const short cSweepPeak = 900;
+
+//Beat: the level each drum sets its bands to, and how fast each band decays (level >> shift per frame)
+static const short BeatKick[cSegNumBands] = {950, 800, 200, 0, 0, 0, 0};
+static const short BeatSnare[cSegNumBands] = {0, 150, 450, 700, 600, 250, 0};
+static const short BeatHat[cSegNumBands] = {0, 0, 0, 0, 150, 500, 450};
+static const short BeatDecayShift[cSegNumBands] = {3, 3, 2, 2, 2, 1, 1};
+
+void LEDSpectrumSynthInit(LEDSpectrumSynth *synth, short program, uint32_t seed) {
+  short iBand;
+
+  synth->program = program;
+  synth->sceneFrames = 600;
+  synth->beatFrames = 30;
+  synth->noise = 40;
+  synth->frames = 0;
+  synth->random = seed;
+  for (iBand = 0; iBand < cSegNumBands; iBand++) synth->beat[iBand] = 0;
+}
+
+static void SynthSweep(LEDSpectrumSynth *synth, short *levels) {
+  long phase, half, pos, dist;
+  short iBand;
+
+  half = synth->sceneFrames / 2;
+  phase = synth->frames % synth->sceneFrames;
+  if (phase < half) pos = phase * cSweepTop / half;
+  else pos = (synth->sceneFrames - phase) * cSweepTop / (synth->sceneFrames - half);
+  for (iBand = 0; iBand < cSegNumBands; iBand++) {
+    dist = pos - iBand * 256;
+    if (dist < 0) dist = -dist;
+    levels[iBand] = (dist >= cSweepReach) ? 0 : (short) (cSweepPeak * (cSweepReach - dist) / cSweepReach);
+  }
+}
+
+//The drums decay every frame whatever the program, so a cycle comes back into the beat smoothly
+static void SynthBeatStep(LEDSpectrumSynth *synth) {
+  short iBand, beatPos, halfBeat;
+  const short *hit = NULL;
+
+  beatPos = (short) (synth->frames % synth->beatFrames);
+  halfBeat = synth->beatFrames / 2;
+  if (beatPos == 0) hit = ((synth->frames / synth->beatFrames) & 1) ? BeatSnare : BeatKick;
+  else if (beatPos == halfBeat) hit = BeatHat;
+  for (iBand = 0; iBand < cSegNumBands; iBand++) {
+    synth->beat[iBand] -= synth->beat[iBand] >> BeatDecayShift[iBand];
+    if (hit) synth->beat[iBand] = max(synth->beat[iBand], hit[iBand]);
+  }
+}
+
+void LEDSpectrumSynthRead(short *levels, bool doLeft, bool doRight, void *ptr) {
+  LEDSpectrumSynth *synth = (LEDSpectrumSynth *) ptr;
+  short iBand, program;
+
+  if (synth->sceneFrames < 2) synth->sceneFrames = 2;
+  if (synth->beatFrames < 2) synth->beatFrames = 2;
+  SynthBeatStep(synth);
+
+  program = synth->program;
+  if (program == cSynthCycle) {
+    static const short scenes[] = {cSynthSweep, cSynthBeat, cSynthSilence};
+    program = scenes[(synth->frames / synth->sceneFrames) % _LEDSEGS_CNT(scenes)];
+  }
+  if (program == cSynthSweep) SynthSweep(synth, levels);
+  for (iBand = 0; iBand < cSegNumBands; iBand++) {
+    if ((program == cSynthSilence) || !(doLeft || doRight)) {levels[iBand] = 0; continue;}
+    if (program == cSynthBeat) levels[iBand] = synth->beat[iBand];
+    synth->random = synth->random * 1664525UL + 1013904223UL;
+    if (synth->noise > 0) levels[iBand] += (short) ((synth->random >> 16) % (synth->noise + 1));
+    levels[iBand] = min(levels[iBand], cMaxBandLevel);
+  }
+  synth->frames++;
+}
@@ -0,0 +1,40 @@
+// LEDSpectrumSynth.h: deterministic synthetic band levels for LEDSegs::SetSpectrumSource().
+//
+// Stands in for the spectrum analyzer shield when there is no audio: each read returns the next frame
+// of a frequency sweep, a drum-machine style beat or silence. The levels depend only on the frame
+// count and seed, never the clock, so a run can be repeated exactly (benchmarks, regression captures).
+//
+//   LEDSpectrumSynth synth;
+//   LEDSpectrumSynthInit(&synth, cSynthCycle, 1);
+//   strip->SetSpectrumSource(LEDSpectrumSynthRead, &synth);
+
+#ifndef _LEDSpectrumSynth_h
+#define _LEDSpectrumSynth_h
+
+#include <stdint.h>
+#include "LEDSegs.h"
+
+//Programs
+const short cSynthSilence = 0;  //All bands 0 (dead air)
+const short cSynthSweep = 1;    //A tone gliding from band 1 up to band 7 and back, one trip per sceneFrames
+const short cSynthBeat = 2;     //Kick on every beat, snare on the off beats, hi-hat on the half beats
+const short cSynthCycle = 3;    //Sweep, beat and silence in turn, sceneFrames each
+
+struct LEDSpectrumSynth {
+  short program;          //cSynthXXX
+  short sceneFrames;      //Frames per sweep trip, and per scene for cSynthCycle
+  short beatFrames;       //Frames per beat
+  short noise;            //Max random jitter added to each band (0 = none)
+  unsigned long frames;   //Reads so far
+  uint32_t random;        //Jitter generator state
+  short beat[cSegNumBands]; //Beat: the current (decaying) drum levels
+};
+
+//Defaults: 600-frame scenes, 30-frame beats (120 bpm at 60 frames/sec) and a little noise on each band.
+//Change the fields after this to suit.
+void LEDSpectrumSynthInit(LEDSpectrumSynth *, short program, uint32_t seed);
+
+//The LEDSegs::SpectrumSourceRoutine; ptr is the LEDSpectrumSynth. Levels are 0 if neither channel is read.
+void LEDSpectrumSynthRead(short *levels, bool doLeft, bool doRight, void *ptr);
+
+#endif //_LEDSpectrumSynth_h
@@ -0,0 +1,116 @@
+// async_fixed_strip_test: double-buffered output on a fixed-size LEDSegsT, whose pixel buffer is a member
+// array rather than the heap. show() swaps that buffer with the malloc()ed second one, so the strip must still
+// send the right frames, switch back to synchronous output and be destroyed without freeing the member array.
+//
+// Two strips get the same random segments and audio; one sends synchronously, the other asynchronously for the
+// first half of the frames and synchronously for the second. Every frame sent must match. Exits non-zero on a
+// mismatch (run under ASan/valgrind to check the buffer ownership as well).
+
+#include <stdio.h>
+#include <string.h>
+#include "LEDSegs.h"
+
+typedef LEDSegsT<160, 8, 4, 8> TestStrip;
+
+const short cTestLEDs = 160;
+const short cTestScenes = 50;
+const short cTestFrames = 40;
+
+//Scene generator and audio: separate LCGs so both strips can replay the same audio
+static unsigned long TestState;
+static long TestRandom(long n) {
+  TestState = TestState * 1103515245UL + 12345UL;
+  return (long) ((TestState >> 16) & 0x7FFF) % n;
+}
+
+static unsigned long TestAudioState;
+static int TestAnalogRead(uint8_t) {
+  TestAudioState = TestAudioState * 1103515245UL + 12345UL;
+  return (int) ((TestAudioState >> 16) & 0x3FF) >> ((TestAudioState >> 30) & 3);
+}
+
+static void TestDelay(unsigned long) {}
+
+//The last frame a strip sent, and the send routines that capture it
+struct SentFrame {
+  uint8_t buf[LPD8806_BUFFER_BYTES(cTestLEDs)];
+  uint16_t len;
+  bool inFlight;
+};
+
+static void TestSend(const uint8_t *buf, uint16_t len, void *ptr) {
+  SentFrame *frame = (SentFrame *) ptr;
+  memcpy(frame->buf, buf, len);
+  frame->len = len;
+}
+
+static void TestStartSend(const uint8_t *buf, uint16_t len, void *ptr) {
+  TestSend(buf, len, ptr);
+  ((SentFrame *) ptr)->inFlight = true;
+}
+
+static void TestWaitSend(void *ptr) {
+  ((SentFrame *) ptr)->inFlight = false;
+}
+
+static void DefineScene(TestStrip *strip, unsigned long seed) {
+  short iseg;
+
+  TestState = seed;
+  for (iseg = 0; iseg < 8; iseg++) {
+    strip->DefineSegment(TestRandom(cTestLEDs), 1 + TestRandom(cTestLEDs), 1 + TestRandom(cSegActionAll),
+                         LEDSegs::Color(TestRandom(128), TestRandom(128), TestRandom(128)), 1 + TestRandom(127));
+    strip->SetSegment_BackColor(LEDSegs::Color(TestRandom(128), TestRandom(128), TestRandom(128)));
+    strip->SetSegment_Options(TestRandom(2) ? cSegOptModulateSegment : 0);
+  }
+}
+
+int main() {
+  long checks = 0, failures = 0;
+  short iscene, iframe;
+  unsigned long audioSeed;
+  SentFrame syncFrame, asyncFrame;
+
+  ShimSetAnalogRead(TestAnalogRead);
+  ShimSetDelay(TestDelay);
+
+  for (iscene = 0; iscene < cTestScenes; iscene++) {
+    TestState = 2000 + iscene;
+    audioSeed = TestRandom(30000);
+
+    TestStrip *sync = new TestStrip(cTestLEDs);
+    TestStrip *async = new TestStrip(cTestLEDs);
+    sync->SetStripTransfer(TestSend, &syncFrame);
+    async->SetStripAsyncTransfer(TestStartSend, TestWaitSend, &asyncFrame);
+    DefineScene(sync, iscene);
+    DefineScene(async, iscene);
+
+    for (iframe = 0; iframe < cTestFrames; iframe++) {
+      //Back to synchronous output halfway, with the drawing buffer possibly the malloc()ed one
+      if (iframe == cTestFrames / 2) async->SetStripTransfer(TestSend, &asyncFrame);
+      syncFrame.len = asyncFrame.len = 0;
+      TestAudioState = audioSeed + iframe;
+      sync->DisplayStrip(true, true);
+      TestAudioState = audioSeed + iframe;
+      async->DisplayStrip(true, true);
+
+      checks++;
+      if ((syncFrame.len == 0) || (asyncFrame.len != syncFrame.len) ||
+          memcmp(syncFrame.buf, asyncFrame.buf, syncFrame.len)) {
+        if (failures++ < 10) printf("scene %d frame %d: async frame differs from sync\n", iscene, iframe);
+      }
+    }
+
+    //Destroy one mid-send, after an odd number of swaps
+    async->SetStripAsyncTransfer(TestStartSend, TestWaitSend, &asyncFrame);
+    async->DisplayStrip(true, true);
+    delete sync;
+    delete async;
+    if (asyncFrame.inFlight) {
+      if (failures++ < 10) printf("scene %d: strip destroyed without waiting for its send\n", iscene);
+    }
+  }
+
+  printf("%ld frames checked, %ld mismatched\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+// fixedpoint_levels_test: SetFixedPointLevels(true) must give the same segment levels and draw the same pixels
+// as the dividing code on every frame.
+//
+// Two strips get the same randomly generated segments (band masks, band max/avg, rescaling, persistence,
+// cSegOptModulateSegment with random fore and back colors, max level floor/decay) and the same audio, one with
+// each normalization mode. Exits non-zero on a mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LEDSegs.h"
+
+const short cTestScenes = 400;
+const short cTestFrames = 60;
+
+static const short TestRescale1[] = {2, 100, 300, 800, 900};
+static const short TestRescale2[] = {3, 200, 100, 500, 600, 1000, 1010};
+static const short *TestRescales[] = {NULL, TestRescale1, TestRescale2};
+
+//Scene generator and audio: separate LCGs so both strips can replay the same audio
+static unsigned long TestState;
+static long TestRandom(long n) {
+  TestState = TestState * 1103515245UL + 12345UL;
+  return (long) ((TestState >> 16) & 0x7FFF) % n;
+}
+
+static unsigned long TestAudioState;
+static int TestAnalogRead(uint8_t) {
+  TestAudioState = TestAudioState * 1103515245UL + 12345UL;
+  return (int) ((TestAudioState >> 16) & 0x3FF) >> ((TestAudioState >> 30) & 3); //Vary the loudness
+}
+
+static void TestDelay(unsigned long) {}
+
+static void DefineScene(LEDSegs *strip, unsigned long seed, short nLEDs, short nSegs) {
+  short iseg;
+
+  TestState = seed;
+  for (iseg = 0; iseg < nSegs; iseg++) {
+    strip->DefineSegment(TestRandom(nLEDs), 1 + TestRandom(nLEDs), cSegActionFromBottom,
+                         LEDSegs::Color(TestRandom(128), TestRandom(128), TestRandom(128)), 1 + TestRandom(127));
+    strip->SetSegment_BackColor(LEDSegs::Color(TestRandom(128), TestRandom(128), TestRandom(128)));
+    strip->SetSegment_Options((TestRandom(2) ? cSegOptBandAvg : 0) | (TestRandom(2) ? cSegOptModulateSegment : 0));
+    strip->SetSegment_Rescale(TestRescales[TestRandom(_LEDSEGS_CNT(TestRescales))]);
+    if (TestRandom(2)) strip->SetSegment_Persistence(TestRandom(1500), TestRandom(1500));
+  }
+  strip->SetMaxLevelFloor(1 + TestRandom(cMaxSegmentLevel));
+  strip->SetMaxLevelDecay(1 + TestRandom(20));
+}
+
+//Each strip's last frame sent, captured by its transfer routine
+static uint8_t DividedFrame[LPD8806_BUFFER_BYTES(2000)], FixedFrame[LPD8806_BUFFER_BYTES(2000)];
+
+static void TestSend(const uint8_t *buf, uint16_t len, void *ptr) {memcpy(ptr, buf, len);}
+
+//The first LED whose pixel bytes differ, or -1
+static short FirstPixelDiff(short nLEDs) {
+  short iLED;
+
+  if (!memcmp(DividedFrame, FixedFrame, nLEDs * 3)) return -1;
+  for (iLED = 0; memcmp(&DividedFrame[iLED * 3], &FixedFrame[iLED * 3], 3) == 0; iLED++);
+  return iLED;
+}
+
+int main() {
+  long checks = 0, failures = 0;
+  short iscene, iframe, iseg, nLEDs, nSegs, iLED;
+  unsigned long audioSeed;
+
+  ShimSetAnalogRead(TestAnalogRead);
+  ShimSetDelay(TestDelay);
+
+  for (iscene = 0; iscene < cTestScenes; iscene++) {
+    TestState = 1000 + iscene;
+    nLEDs = 1 + TestRandom(2000);
+    nSegs = 1 + TestRandom(cMaxSegments);
+    audioSeed = TestRandom(30000);
+
+    LEDSegs divided(nLEDs), fixed(nLEDs);
+    divided.SetFixedPointLevels(false);
+    fixed.SetFixedPointLevels(true);
+    divided.SetStripTransfer(TestSend, DividedFrame);
+    fixed.SetStripTransfer(TestSend, FixedFrame);
+    DefineScene(&divided, iscene, nLEDs, nSegs);
+    DefineScene(&fixed, iscene, nLEDs, nSegs);
+
+    for (iframe = 0; iframe < cTestFrames; iframe++) {
+      TestAudioState = audioSeed + iframe;
+      divided.DisplayStrip(true, true);
+      TestAudioState = audioSeed + iframe;
+      fixed.DisplayStrip(true, true);
+
+      checks++;
+      for (iseg = 0; iseg < nSegs; iseg++) {
+        if (fixed.GetSegment_Level(iseg) != divided.GetSegment_Level(iseg)) {
+          if (failures++ < 10) {
+            printf("scene %d frame %d segment %d: level %d with fixed point, %d dividing\n", iscene, iframe, iseg,
+                   fixed.GetSegment_Level(iseg), divided.GetSegment_Level(iseg));
+          }
+        }
+      }
+      iLED = FirstPixelDiff(nLEDs);
+      if (iLED >= 0) {
+        if (failures++ < 10) printf("scene %d frame %d: LED %d differs with fixed point\n", iscene, iframe, iLED);
+      }
+    }
+  }
+
+  printf("%ld frames checked, %ld mismatches\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,385 @@
+// render_reference_test: the render plans (CompileSegmentPlan, the run writers and kernels, occlusion culling) must
+// draw exactly what the original per-LED ShowSegments() loop drew, LED by LED.
+//
+// Random scenes of FromBottom/FromTop/FromMiddle/All/Random/Bits segments, with spacing, first LEDs and lengths
+// hanging past their parts, random pattern lengths (SetSegment_RandomLength), up and down parts, circular parts
+// with offsets, scrolled bits, blend modes, part decay, cSegOptNoOffOverwrite and cSegOptModulateSegment, are drawn
+// by strips with culling on and off and with the run kernels and the generic WriteRun(). Every frame each one sends is compared with ReferenceFrame() below, which
+// walks each segment's LEDs one at a time the way ShowSegments() did (extended with the later features: wrapping
+// in circular parts, bits scrolling, blending and decay). Segments are moved around between frames so the plans
+// get recompiled, and random tables are refilled and swapped. Exits non-zero on a mismatch.
+
+#include <stdio.h>
+#include <string.h>
+#include "LEDSegs.h"
+
+const short cTestScenes = 300;
+const short cTestFrames = 40;
+const short cTestMaxLEDs = 300;
+const short cTestMaxSegs = 12;
+const short cTestParts = 4;
+const short cTestStrips = 4; //Culling off/on x kernels/generic runs
+
+//Scene generator and audio: separate LCGs so every strip can replay the same audio
+static unsigned long TestState;
+static long TestRandom(long n) {
+  TestState = TestState * 1103515245UL + 12345UL;
+  return (long) ((TestState >> 16) & 0x7FFF) % n;
+}
+
+static unsigned long TestAudioState;
+static int TestAnalogRead(uint8_t) {
+  TestAudioState = TestAudioState * 1103515245UL + 12345UL;
+  return (int) ((TestAudioState >> 16) & 0x3FF) >> ((TestAudioState >> 30) & 3);
+}
+
+static void TestDelay(unsigned long) {}
+
+//What the strips don't have getters for
+struct TestScene {
+  short nLEDs, nSegs;
+  short segPart[cTestMaxSegs];
+  uint8_t bits[cTestMaxSegs][(cTestMaxLEDs + 40) / 8];
+  bool bitsNull[cTestMaxSegs];
+  bool circular[cTestParts];
+};
+
+class LEDSegsBench {
+  public:
+    static unsigned short RandomLevel(LEDSegs *strip, short iseg, short slot) {
+      return strip->randomTables[strip->SegmentData[iseg].segRandomTable].levels[slot];
+    }
+    static void SetGenericRuns(LEDSegs *strip, bool generic) {strip->stripGenericRuns = generic;}
+};
+
+/*_____________
+ReferenceFrame
+*/
+
+static uint8_t BlendChannel(uint8_t under, uint8_t over, short mode, short opacity) {
+  short weight = opacity + (opacity >> 7);
+  uint16_t m;
+
+  switch (mode) {
+    case cSegBlendAdd: return min(under + over, 127);
+    case cSegBlendMax: return max(under, over);
+    case cSegBlendMultiply: m = (under * over) + 63; return (m + (m >> 7) + 1) >> 7;
+    case cSegBlendAlpha: return ((uint16_t) under * (256 - weight) + (uint16_t) over * weight) >> 8;
+  }
+  return over;
+}
+
+static uint32_t MapChannels(uint32_t under, uint32_t over, short mode, short opacity) {
+  uint32_t color = 0;
+  short shift;
+
+  for (shift = 0; shift <= 16; shift += 8) {
+    color |= (uint32_t) BlendChannel((under >> shift) & 0x7F, (over >> shift) & 0x7F, mode, opacity) << shift;
+  }
+  return color;
+}
+
+static uint32_t FadeColor(uint32_t color, short keep) {
+  uint32_t faded = 0;
+  short shift;
+
+  for (shift = 0; shift <= 16; shift += 8) faded |= ((((color >> shift) & 0x7F) * keep) >> 8) << shift;
+  return faded;
+}
+
+//The entries of one segment, in the order ShowSegments() visited them: iLEDinSegment and the LED
+static short ListEntries(LEDSegs *strip, short iseg, short part, short ords[], short leds[]) {
+  short Action, segNumLEDs, segSpacing1, partStart, partLen, segFirstLED, LEDIncrement, iLED, iLEDinSegment;
+  short SpacingCount, nentries = 0;
+  bool partUp, notSpacingLED;
+
+  Action = strip->GetSegment_Action(iseg);
+  segNumLEDs = strip->GetSegment_NumLEDs(iseg);
+  segSpacing1 = strip->GetSegment_Spacing(iseg) + 1;
+  partStart = strip->GetPart_Start(part);
+  partLen = strip->GetPart_Len(part);
+  partUp = strip->GetPart_Up(part);
+
+  segFirstLED = strip->GetSegment_FirstLED(iseg) + partStart;
+  if ((Action != cSegActionAll) && (Action != cSegActionFromMiddle) && !partUp) {
+    segFirstLED = (partStart + partLen) - (strip->GetSegment_FirstLED(iseg) + segNumLEDs);
+  }
+  LEDIncrement = 1;
+  iLED = segFirstLED;
+  switch (Action) {
+    case cSegActionFromBottom:
+    case cSegActionRandom:
+    case cSegActionBits:
+      if (!partUp) {LEDIncrement = -1; iLED = segFirstLED + segNumLEDs - 1;}
+      break;
+    case cSegActionFromTop:
+      if (partUp) {LEDIncrement = -1; iLED = segFirstLED + segNumLEDs - 1;}
+      break;
+    case cSegActionFromMiddle:
+      LEDIncrement = 0;
+      iLED = segFirstLED + ((segNumLEDs - 1) >> 1);
+      break;
+  }
+
+  SpacingCount = 0;
+  for (iLEDinSegment = 0; iLEDinSegment < segNumLEDs; iLEDinSegment++) {
+    notSpacingLED = (SpacingCount == 0);
+    if (notSpacingLED) {ords[nentries] = iLEDinSegment; leds[nentries] = iLED; nentries++;}
+    if (Action == cSegActionFromMiddle) {
+      if (LEDIncrement <= 0) {
+        LEDIncrement--;
+        if (notSpacingLED) SpacingCount = segSpacing1;
+        SpacingCount--;
+      }
+      else LEDIncrement++;
+      LEDIncrement = -LEDIncrement;
+    }
+    else {
+      if (notSpacingLED) SpacingCount = segSpacing1;
+      SpacingCount--;
+    }
+    iLED += LEDIncrement;
+  }
+  return nentries;
+}
+
+static void ReferenceFrame(LEDSegs *strip, TestScene *scene, uint32_t frame[]) {
+  static short ords[2 * cTestMaxLEDs], leds[2 * cTestMaxLEDs];
+  short iLED, ipart, decay, iseg, Action, part, partStart, partLen, partEnd, segNumLEDs, segval, segLevel;
+  short segSpacing1, center, nentries, ientry, ibit, nbits, width, lap, side, rel, bitnum, offset, pattern, randomMask;
+  uint32_t foreColor, backColor, thisColor;
+  byte bcRGB[3], fcRGB[3];
+  bool optOffOverwrite, circular, partUp;
+
+  //Start from off, or from the last frame faded where a part has a decay (the highest-numbered one wins)
+  for (iLED = 0; iLED < scene->nLEDs; iLED++) {
+    decay = cPartNoDecay;
+    for (ipart = cTestParts - 1; (ipart >= 0) && (decay < 0); ipart--) {
+      if ((iLED >= strip->GetPart_Start(ipart)) && (iLED < strip->GetPart_Start(ipart) + strip->GetPart_Len(ipart))) {
+        decay = strip->GetPart_Decay(ipart);
+      }
+    }
+    frame[iLED] = (decay < 0) ? 0 : FadeColor(frame[iLED], 256 - decay);
+  }
+
+  for (iseg = 0; iseg < scene->nSegs; iseg++) {
+    Action = strip->GetSegment_Action(iseg);
+    if (Action == cSegActionNone) continue;
+    part = scene->segPart[iseg];
+    partStart = strip->GetPart_Start(part);
+    partLen = strip->GetPart_Len(part);
+    partEnd = partStart + partLen - 1;
+    partUp = strip->GetPart_Up(part);
+    circular = scene->circular[part];
+    segNumLEDs = strip->GetSegment_NumLEDs(iseg);
+    segSpacing1 = strip->GetSegment_Spacing(iseg) + 1;
+    segLevel = strip->GetSegment_Level(iseg);
+    backColor = strip->GetSegment_BackColor(iseg);
+    foreColor = strip->GetSegment_ForeColor(iseg);
+    optOffOverwrite = (strip->GetSegment_Options(iseg) & cSegOptNoOffOverwrite) == 0;
+    pattern = strip->GetSegment_RandomPattern(iseg);
+    randomMask = strip->GetSegment_RandomLength(iseg) - 1;
+
+    segval = (((long) segLevel) * ((long) (segNumLEDs + 1))) / ((long) (cMaxSegmentLevel + 1));
+    segval = constrain(segval, 0, segNumLEDs);
+    if ((strip->GetSegment_Options(iseg) & cSegOptModulateSegment) && (segNumLEDs > 0)) {
+      LEDSegs::Colorvals(backColor, bcRGB);
+      LEDSegs::Colorvals(foreColor, fcRGB);
+      foreColor = LEDSegs::Color(bcRGB[0] + (((fcRGB[0] - bcRGB[0]) * segval) / segNumLEDs),
+                                 bcRGB[1] + (((fcRGB[1] - bcRGB[1]) * segval) / segNumLEDs),
+                                 bcRGB[2] + (((fcRGB[2] - bcRGB[2]) * segval) / segNumLEDs));
+    }
+
+    nentries = ListEntries(strip, iseg, part, ords, leds);
+    center = leds[0];
+
+    //A circular part shows at most one lap of each run (FromMiddle has one each side of the center), and bits
+    //scroll around the number of entries shown
+    lap = (partLen + segSpacing1 - 1) / segSpacing1;
+    nbits = 0;
+    for (ientry = 0; ientry < nentries; ientry++) {
+      if (circular ? (ientry < lap) : ((leds[ientry] >= partStart) && (leds[ientry] <= partEnd))) nbits++;
+    }
+    width = nbits;
+    offset = strip->GetSegment_BitsOffset(iseg);
+
+    ibit = 0;
+    for (ientry = 0; ientry < nentries; ientry++) {
+      iLED = leds[ientry];
+      if (circular) {
+        if (partLen <= 0) break;
+        if (Action == cSegActionFromMiddle) side = (iLED <= center) ? (center - iLED) / segSpacing1 : (iLED - center) / segSpacing1 - 1;
+        else side = ientry;
+        if (side >= lap) continue;
+        rel = (short) ((iLED - partStart + (long) (partUp ? 1 : -1) * strip->GetPart_Offset(part)) % partLen);
+        if (rel < 0) rel += partLen;
+        iLED = partStart + rel;
+      }
+      else if ((iLED < partStart) || (iLED > partEnd)) continue;
+      bitnum = ibit++;
+
+      thisColor = backColor;
+      switch (Action) {
+        case cSegActionFromBottom:
+        case cSegActionFromTop:
+        case cSegActionFromMiddle:
+          if (segval > ords[ientry]) thisColor = foreColor;
+          break;
+        case cSegActionAll:
+          thisColor = foreColor;
+          break;
+        case cSegActionRandom:
+          if (LEDSegsBench::RandomLevel(strip, iseg, (ords[ientry] + pattern) & randomMask) <= segLevel) thisColor = foreColor;
+          break;
+        case cSegActionBits:
+          if ((offset != 0) && (width > 0)) {
+            bitnum = (short) ((bitnum + (long) offset) % width);
+            if (bitnum < 0) bitnum += width;
+          }
+          if (!scene->bitsNull[iseg] && ((scene->bits[iseg][bitnum >> 3] >> (bitnum & 7)) & 1)) thisColor = foreColor;
+          break;
+      }
+
+      if ((iLED < 0) || (iLED >= scene->nLEDs)) continue;
+      if ((thisColor != backColor) || optOffOverwrite) {
+        frame[iLED] = MapChannels(frame[iLED], thisColor, strip->GetSegment_Blend(iseg), strip->GetSegment_Opacity(iseg));
+      }
+    }
+  }
+}
+
+/*__________
+Scene setup
+*/
+
+static uint32_t RandomColor() {return LEDSegs::Color(TestRandom(128), TestRandom(128), TestRandom(128));}
+
+static void DefineScene(LEDSegs *strip, TestScene *scene, unsigned long seed) {
+  static const short actions[] = {cSegActionFromBottom, cSegActionFromTop, cSegActionFromMiddle, cSegActionAll,
+                                  cSegActionRandom, cSegActionBits};
+  short ipart, iseg, part, start, len, nLEDs, Action;
+
+  TestState = seed;
+  for (ipart = 1; ipart < cTestParts; ipart++) {
+    start = TestRandom(scene->nLEDs + 20) - 10;
+    strip->DefinePart(ipart, start, 1 + TestRandom(scene->nLEDs), TestRandom(2));
+    strip->SetPart_Circular(ipart, scene->circular[ipart]);
+    strip->SetPart_Offset(ipart, TestRandom(2 * scene->nLEDs) - scene->nLEDs);
+    if (TestRandom(3) == 0) strip->SetPart_Decay(ipart, TestRandom(256));
+  }
+  if (TestRandom(4) == 0) strip->SetPart_Decay(0, TestRandom(256));
+
+  for (iseg = 0; iseg < scene->nSegs; iseg++) {
+    part = scene->segPart[iseg];
+    len = strip->GetPart_Len(part);
+    Action = actions[TestRandom(6)];
+    nLEDs = 1 + TestRandom(len + 20);
+    if (scene->circular[part] && (Action == cSegActionFromMiddle)) nLEDs = min(nLEDs, len); //Sides can't overlap
+    strip->DefineSegment(TestRandom(len + 10) - 5, nLEDs, Action, RandomColor(), 1 + TestRandom(127));
+    strip->SetSegment_Part(iseg, part);
+    strip->SetSegment_BackColor(iseg, RandomColor());
+    strip->SetSegment_Options(iseg, (TestRandom(3) ? 0 : cSegOptNoOffOverwrite) | (TestRandom(3) ? 0 : cSegOptModulateSegment));
+    strip->SetSegment_Spacing(iseg, TestRandom(3) ? 0 : TestRandom(4));
+    if (TestRandom(2)) strip->SetSegment_RandomLength(iseg, 16 << TestRandom(8));
+    strip->SetSegment_RandomPattern(iseg, TestRandom(4096));
+    if (!scene->bitsNull[iseg]) strip->SetSegment_BitsPtr(iseg, scene->bits[iseg]);
+    strip->SetSegment_BitsOffset(iseg, TestRandom(3) ? 0 : TestRandom(81) - 40);
+    if (TestRandom(3) == 0) {
+      strip->SetSegment_Blend(iseg, 1 + TestRandom(cSegBlendAlpha));
+      strip->SetSegment_Opacity(iseg, TestRandom(256));
+    }
+  }
+}
+
+//Move a segment or part, as a timer routine might
+static void ChangeScene(LEDSegs *strip, TestScene *scene, unsigned long seed) {
+  short iseg, ipart;
+
+  TestState = seed;
+  iseg = TestRandom(scene->nSegs);
+  ipart = 1 + TestRandom(cTestParts - 1);
+  switch (TestRandom(7)) {
+    case 0: strip->SetSegment_FirstLED(iseg, strip->GetSegment_FirstLED(iseg) + TestRandom(9) - 4); break;
+    case 1: strip->SetSegment_Spacing(iseg, TestRandom(4)); break;
+    case 2: strip->SetSegment_BitsOffset(iseg, strip->GetSegment_BitsOffset(iseg) + TestRandom(7) - 3); break;
+    case 3: strip->SetPart_Offset(ipart, strip->GetPart_Offset(ipart) + TestRandom(9) - 4); break;
+    case 4: if (!scene->circular[ipart]) strip->SetPart_Start(ipart, strip->GetPart_Start(ipart) + TestRandom(9) - 4); break;
+    case 5: strip->SetSegment_RandomLength(iseg, 16 << TestRandom(8)); break;
+    case 6: strip->ResetRandom(); break;
+  }
+}
+
+//Each strip's last frame sent, captured by its transfer routine
+static uint8_t SentFrames[cTestStrips][LPD8806_BUFFER_BYTES(cTestMaxLEDs)];
+
+static void TestSend(const uint8_t *buf, uint16_t len, void *ptr) {memcpy(ptr, buf, len);}
+
+int main() {
+  static uint32_t refFrames[cTestStrips][cTestMaxLEDs];
+  long checks = 0, failures = 0;
+  short iscene, iframe, istrip, iseg, ipart, iLED, ibyte;
+  unsigned long audioSeed, sceneSeed;
+  uint8_t expected[3];
+  TestScene scene;
+  LEDSegs *strips[cTestStrips];
+
+  ShimSetAnalogRead(TestAnalogRead);
+  ShimSetDelay(TestDelay);
+
+  for (iscene = 0; iscene < cTestScenes; iscene++) {
+    TestState = 3000 + iscene;
+    scene.nLEDs = 1 + TestRandom(cTestMaxLEDs);
+    scene.nSegs = 1 + TestRandom(cTestMaxSegs);
+    for (ipart = 0; ipart < cTestParts; ipart++) scene.circular[ipart] = (ipart > 0) && (TestRandom(3) == 0);
+    for (iseg = 0; iseg < scene.nSegs; iseg++) {
+      scene.segPart[iseg] = TestRandom(cTestParts);
+      scene.bitsNull[iseg] = (TestRandom(8) == 0);
+      for (ibyte = 0; ibyte < (short) sizeof(scene.bits[0]); ibyte++) scene.bits[iseg][ibyte] = TestRandom(256);
+    }
+    audioSeed = TestRandom(30000);
+    sceneSeed = TestRandom(30000);
+
+    for (istrip = 0; istrip < cTestStrips; istrip++) {
+      strips[istrip] = new LEDSegs(scene.nLEDs);
+      strips[istrip]->SetStripTransfer(TestSend, SentFrames[istrip]);
+      strips[istrip]->SetOcclusionCulling(istrip & 1);
+      LEDSegsBench::SetGenericRuns(strips[istrip], istrip & 2);
+      DefineScene(strips[istrip], &scene, sceneSeed);
+    }
+    memset(refFrames, 0, sizeof(refFrames));
+
+    for (iframe = 0; iframe < cTestFrames; iframe++) {
+      if (iframe % 4 == 3) {
+        for (istrip = 0; istrip < cTestStrips; istrip++) ChangeScene(strips[istrip], &scene, sceneSeed + iframe);
+      }
+      for (istrip = 0; istrip < cTestStrips; istrip++) {
+        TestAudioState = audioSeed + iframe;
+        strips[istrip]->DisplayStrip(true, true);
+      }
+
+      //Each strip against its own reference (their random patterns differ)
+      for (istrip = 0; istrip < cTestStrips; istrip++) {
+        ReferenceFrame(strips[istrip], &scene, refFrames[istrip]);
+        checks++;
+        for (iLED = 0; iLED < scene.nLEDs; iLED++) {
+          expected[0] = (refFrames[istrip][iLED] >> 16) | 0x80;
+          expected[1] = (refFrames[istrip][iLED] >> 8) | 0x80;
+          expected[2] = refFrames[istrip][iLED] | 0x80;
+          if (memcmp(&SentFrames[istrip][iLED * 3], expected, 3)) break;
+        }
+        if (iLED < scene.nLEDs) {
+          if (failures++ < 10) {
+            printf("scene %d frame %d strip %d (culling %s, %s): LED %d is %02X%02X%02X, expected %02X%02X%02X\n",
+                   iscene, iframe, istrip, (istrip & 1) ? "on" : "off", (istrip & 2) ? "generic runs" : "kernels", iLED,
+                   SentFrames[istrip][iLED * 3] & 0x7F, SentFrames[istrip][iLED * 3 + 1] & 0x7F,
+                   SentFrames[istrip][iLED * 3 + 2] & 0x7F, expected[0] & 0x7F, expected[1] & 0x7F, expected[2] & 0x7F);
+          }
+        }
+      }
+    }
+    for (istrip = 0; istrip < cTestStrips; istrip++) delete strips[istrip];
+  }
+
+  printf("%ld frames checked, %ld mismatched\n", checks, failures);
+  return failures ? 1 : 0;
+}